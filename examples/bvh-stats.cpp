@@ -0,0 +1,38 @@
+#include "rey-treycer.h"
+#include <iostream>
+#include <iomanip>
+
+// builds the BVH of a mesh with every builder and prints how the trees look and trace
+// bvh-stats model.obj [threads]
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::cout << "usage: bvh-stats model.obj [threads]\n";
+        return 1;
+    }
+    int threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+    Mesh mesh = load_mesh_from(argv[1], threads);
+    if(mesh.tris.empty()) return 1;
+
+    std::vector<AABB> bounds(mesh.tris.size());
+    std::vector<Vec3> vertices;
+    for(int i = 0; i < (int)mesh.tris.size(); i++)
+        for(int j = 0; j < 3; j++) {
+            bounds[i].grow(mesh.tris[i].vert[j]);
+            vertices.push_back(mesh.tris[i].vert[j]);
+        }
+
+    ThreadPool pool(threads);
+    std::cout << mesh.tris.size() << " triangles, " << pool.size() << " threads\n";
+    std::cout << std::fixed << std::setprecision(2);
+    for(int mode: {BVH_BUILD_SAH, BVH_BUILD_LBVH, BVH_BUILD_SBVH}) {
+        mesh.bvh.settings.mode = mode;
+        mesh.bvh.settings.pool = &pool;
+        mesh.bvh.build(bounds, &vertices);
+        BVHStats s = mesh.bvh.stats();
+        BVHTraversalStats t = measure_traversal(&mesh);
+        std::cout << bvh_mode_name(mode) << ": " << s.build_ms << " ms, " << s.nodes << " nodes, " << s.leaves << " leaves of "
+                  << s.average_leaf_size << " (" << s.references << " references), depth " << s.max_depth << ", SAH cost " << s.sah_cost
+                  << ", per ray " << t.nodes_per_ray() << " nodes and " << t.prims_per_ray() << " triangles\n";
+    }
+    return 0;
+}
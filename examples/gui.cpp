@@ -17,6 +17,8 @@ const float ROT_SPEED = 0.8f;
 
 bool running = true;
 bool camera_control = true;
+// start every render with a coarse 8x8 preview
+bool progressive_preview = true;
 
 int mouse_pos_x;
 int mouse_pos_y;
@@ -25,11 +27,27 @@ Object* selecting_object;
 
 Mesh FOCAL_PLANE;
 
+// "stop render" was pressed, no frames are started until the next restart
+bool stopped = false;
+// rt.sampled_frames() when the running frame was started, the render thread changes rt.rendered_count
+// the preview frames after a restart count as one, so render_target is in full samples per pixel
+int frames_at_start = 0;
+
+// the camera, the objects and the settings the render thread reads are only changed
+// between frames, so the running one is stopped first. a cancelled frame stops within a few pixels
+void stop_frame() {
+    rt.cancel_frame();
+    rt.wait_frame();
+}
+
+// the frame being drawn is cancelled so the new render starts right away
 void restart_render() {
-    rt.rendered_count = 0;
+    stopped = false;
+    rt.restart_render();
 }
 
 void update_camera() {
+    stop_frame();
     rt.update_size(WIDTH, HEIGHT);
 
     float tilted_a = camera->tilted_angle;
@@ -43,19 +61,20 @@ void update_camera() {
 }
 
 int render_target = 100;
+// also stop once the estimated noise is below this, 0 to only count frames
+float noise_target = 0;
 
 double delay = 0;
 double total_delay = 0;
 double avg_delay = 0;
 
-bool drawing = false;
-void draw_to_window() {
-    auto start = std::chrono::system_clock::now();
-    drawing = true;
-    rt.draw_frame();
-    drawing = false;
+std::chrono::system_clock::time_point frame_start;
+// called on the render thread when a frame of rt.start_frame() ended
+void frame_done(bool finished) {
+    // a cancelled frame says nothing about the delay
+    if(!finished) return;
     auto end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed = end - start;
+    std::chrono::duration<double> elapsed = end - frame_start;
 
     delay = elapsed.count() * 1000.0;
 
@@ -68,7 +87,6 @@ void draw_to_window() {
         avg_delay = total_delay / rt.rendered_count;
     else std::cout << "rendered count jumped, skip calculating delay\n";
 }
-std::thread drawing_thread;
 
 void print_v3(Vec3 v) {
     std::cout << v.x << ' ' << v.y << ' ' << v.z << '\n';
@@ -86,39 +104,23 @@ int main(int argc, char** argv) {
 
     // add a plane to visualize focal length
     // it will be used in the gui app with the index 0
-    Mesh FOCAL_PLANE = load_mesh_from("default_model/plane.obj");
+    Mesh FOCAL_PLANE = load_compiled_mesh("default_model/plane.obj");
     FOCAL_PLANE.visible = false;
     FOCAL_PLANE.set_material(FOCAL_PLANE_MAT);
     FOCAL_PLANE.update_material();
     rt.add_object(&FOCAL_PLANE);
 
-    if(argc > 1) {
-        if(std::string(argv[1]) == "cornell")
-            cornell_box(rt);
-        else if(std::string(argv[1]) == "textures")
-            all_textures(rt);
-        else if(std::string(argv[1]) == "all") {
-            cornell_box(rt);
-            all_textures(rt);
-        }
-        else {
-            std::cout << "invalid arguement\n";
-            return 1;
-        }
-    }
-    else cornell_box(rt);
-
-    // camera setting
-    camera->position.z = 10;
+    // camera setting, a scene file can override them
+    default_camera(*camera);
     camera->focus_distance = 20.0f;
     camera->aperture = 0.2;
     camera->diverge_strength = 0.01;
     camera->FOV = 75.0f;
-    camera->max_range = 100;
     camera->max_ray_bounce_count = 5;
-    camera->ray_per_pixel = 1;
 
-    camera->init();
+    if(!load_named_scene(argc > 1 ? argv[1] : "cornell", rt)) return 1;
+
+    gui.stop_frame = stop_frame;
 
     // start gui
     while(running) {
@@ -138,6 +140,8 @@ int main(int argc, char** argv) {
                 mouse_pos_x *= WIDTH / (float)w;
                 mouse_pos_y *= HEIGHT / (float)h;
 
+                // the render thread refits the objects at the start of a frame
+                stop_frame();
                 HitInfo hit = rt.get_collision_on(mouse_pos_x, mouse_pos_y);
                 if(hit.did_hit) {
                     selecting_object = hit.object;
@@ -164,6 +168,12 @@ int main(int argc, char** argv) {
             float cam_pan = camera->panned_angle;
             float cam_tilt = camera->tilted_angle;
 
+            bool moving = false;
+            for(int key: {SDL_SCANCODE_LEFT, SDL_SCANCODE_RIGHT, SDL_SCANCODE_UP, SDL_SCANCODE_DOWN,
+                                   SDL_SCANCODE_W, SDL_SCANCODE_S, SDL_SCANCODE_A, SDL_SCANCODE_D, SDL_SCANCODE_E, SDL_SCANCODE_Q})
+                moving = moving or keys[key];
+            if(moving) stop_frame();
+
             if(keys[SDL_SCANCODE_LEFT]) camera->pan(rot_speed);
             if(keys[SDL_SCANCODE_RIGHT]) camera->pan(-rot_speed);
             if(keys[SDL_SCANCODE_UP]) camera->tilt(rot_speed);
@@ -176,7 +186,7 @@ int main(int argc, char** argv) {
             if(keys[SDL_SCANCODE_Q]) camera->position.y -= speed;
 
             if(camera->position != cam_pos or camera->panned_angle != cam_pan or camera->tilted_angle != cam_tilt)
-                restart_render();
+                rt.camera_moved();
         }
 
         float old_FOV = camera->FOV;
@@ -184,19 +194,51 @@ int main(int argc, char** argv) {
         float old_focus_distance = camera->focus_distance;
 
         int objs_state = 0;
+        int render_request = REQUEST_NONE;
+        // rendered_count is only read while no frame is drawn
+        int frames_done = rt.frame_running() ? frames_at_start : rt.sampled_frames();
+        // denoise the last frame if it was turned on after the render finished
+        // and show the raw image again if it was turned off
+        if(!rt.frame_running()) {
+            if(rt.denoise and rt.rendered_count > 0 and rt.denoised_count != rt.rendered_count)
+                rt.denoise_frame();
+            std::shared_ptr<const RenderedFrame> shown = rt.front_frame();
+            if(shown and shown->denoised != rt.denoise)
+                rt.publish_frame();
+        }
+
+        // the last finished frame, the render thread never writes into it
+        std::shared_ptr<const RenderedFrame> frame = rt.front_frame();
+
         gui.gui(
-            &(rt.screen_color),
+            frame.get(),
             &camera_control,
-            &rt.lazy_mode, &render_target, &rt.rendered_count,
-            delay, avg_delay,
+            &rt.lazy_mode, &progressive_preview, &rt.denoise, &rt.temporal_reprojection, &render_target, stopped ? render_target : frames_done, &render_request,
+            delay, avg_delay, rt.noise_estimate, &noise_target,
             rt.get_running_thread_count(),
             &WIDTH, &HEIGHT,
-            &rt.objects, selecting_object, &objs_state,
+            &rt.objects, &rt.scene, selecting_object, &objs_state,
             &rt.camera,
             &rt.up_sky_color, &rt.down_sky_color,
             &running
         );
 
+        int preview_block_size = progressive_preview ? 8 : 0;
+        if(rt.preview_block_size != preview_block_size) {
+            stop_frame();
+            rt.preview_block_size = preview_block_size;
+        }
+
+        // the gui restarted or stopped the render, do not wait for the frame being drawn
+        if(render_request == REQUEST_RESTART)
+            restart_render();
+        else if(render_request == REQUEST_STOP) {
+            stopped = true;
+            rt.cancel_frame();
+        }
+        else if(rt.frame_running() and frames_at_start >= render_target)
+            rt.cancel_frame();
+
         switch(objs_state) {
             case 1: // make new
                 selecting_object = rt.objects.back();
@@ -218,13 +260,14 @@ int main(int argc, char** argv) {
 
         gui.render();
 
-        if(rt.rendered_count < render_target and !drawing) {
-            // you need to join the old thread before start a new one
-            if(main_thread_delta_time > 0) // if not first run
-                drawing_thread.join();
-
-            // start draw thread
-            drawing_thread = std::thread(draw_to_window);
+        if(!stopped and !rt.frame_running()) {
+            int frames = rt.sampled_frames();
+            bool quiet_enough = noise_target > 0 and frames > 0 and rt.noise_estimate <= noise_target;
+            if(frames < render_target and !quiet_enough) {
+                frames_at_start = frames;
+                frame_start = std::chrono::system_clock::now();
+                rt.start_frame(frame_done);
+            }
         }
 
         auto end = std::chrono::system_clock::now();
@@ -233,8 +276,9 @@ int main(int argc, char** argv) {
         main_thread_delta_time = elapsed.count();
     }
 
-    // wait for additional threads to end
-    drawing_thread.join();
+    // wait for the render thread to end
+    rt.cancel_frame();
+    rt.wait_frame();
 
     gui.destroy();
 
@@ -4,11 +4,14 @@
 #include <SDL2/SDL.h>
 #include "objects.h"
 #include "camera.h"
+#include "rey-treycer.h"
+#include "postprocess.h"
 
 #include "imgui/imgui.h"
 #include "imgui/backends/imgui_impl_sdl2.h"
 #include "imgui/backends/imgui_impl_sdlrenderer2.h"
 
+#include <functional>
 #include <vector>
 
 #include <sstream>
@@ -16,11 +19,25 @@
 
 #include "image.h"
 
+// what the editor asked the render to do, see GUI::gui()
+enum RENDER_REQUEST {
+    REQUEST_NONE,
+    REQUEST_RESTART,
+    REQUEST_STOP,
+};
+
 class GUI {
 private:
     SDL_Texture* texture;
     ImGuiIO io;
 
+    // frame_id of the frame in the texture, -1 if the texture has to be drawn completely
+    int uploaded_frame = -1;
+    // tonemapping of the texture and of saved images
+    PostProcessor display;
+    // the settings the texture was drawn with
+    PostProcessSettings uploaded_settings;
+
     // prevously selected object
     Object* prev_object = nullptr;
 
@@ -47,11 +64,22 @@ private:
     bool show_crosshair = false;
     float up_sky_color[3] = {0.5, 0.7, 1.0};
     float down_sky_color[3] = {1.0, 1.0, 1.0};
-    float gamma = 1.0f;
+    const char* tonemapping_items[3] = {"clamp", "reinhard", "aces"};
 
     // the focal plane for visualizing focus point
-    Object* focal_plane = nullptr;
+    Mesh* focal_plane = nullptr;
     bool show_focal_plane = false;
+    // where the focal plane was put, it is only moved again when these change
+    CameraState focal_plane_camera;
+    float focal_plane_distance = -1;
+
+    // change a setting the render thread reads, the frame being drawn is stopped first
+    template<class T>
+    void set(T* setting, T value) {
+        if(*setting == value) return;
+        stop_frame();
+        *setting = value;
+    }
 
 public:
     SDL_Event event;
@@ -66,6 +94,10 @@ public:
     unsigned char* pixels;
     int pitch;
 
+    // stop the frame being drawn and wait for it, called before the camera, the objects
+    // or a setting the render thread reads is changed
+    std::function<void()> stop_frame = []() {};
+
     GUI(char* title, int w, int h) {
         WIDTH = w; HEIGHT = h;
         SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER);
@@ -96,11 +128,12 @@ public:
     void change_geometry(int w, int h) {
         WIDTH = w;
         HEIGHT = h;
-        disable_drawing();
+        SDL_DestroyTexture(texture);
         texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
+        uploaded_frame = -1;
     }
     // save image from vector
-    void save_image(std::vector<std::vector<Vec3>>* screen_color, int tonemapping_method, float gamma) {
+    void save_image(const std::vector<std::vector<Vec3>>* screen_color, PostProcessSettings settings) {
         auto t = std::time(nullptr);
         auto tm = *std::localtime(&t);
         std::string str;
@@ -109,20 +142,23 @@ public:
         str = "imgs/" + oss.str() + ".png";
         char *c = const_cast<char*>(str.c_str());
 
-        save_to_image(c, screen_color, tonemapping_method, gamma, WIDTH, HEIGHT);
+        if(screen_color->empty()) return;
+        save_to_image(c, screen_color, settings, screen_color->size(), (*screen_color)[0].size());
     }
     void process_gui_event() {
         ImGui_ImplSDL2_ProcessEvent(&event);
     }
 
     // TODO: make the params look less ugly
-    void gui(std::vector<std::vector<Vec3>>* screen,
+    // `frame` is the last finished frame, nullptr before the first one
+    // `frame_num` is how far the render is, restarts and stops go to `render_request`
+    void gui(const RenderedFrame* frame,
              bool* camera_control,
-             bool* lazy_mode, int* frame_count, int* frame_num,
-             double delay, double avg_delay,
+             bool* lazy_mode, bool* preview, bool* denoise, bool* temporal, int* frame_count, int frame_num, int* render_request,
+             double delay, double avg_delay, float noise, float* noise_target,
              int running_thread_count,
              int* width, int* height,
-             std::vector<Object*>* oc, Object* selecting_object, int* objects_state,
+             std::vector<Object*>* oc, Scene* scene, Object* selecting_object, int* objects_state,
              Camera* camera,
              Vec3* up_sky_c, Vec3* down_sky_c,
              bool* running) {
@@ -130,24 +166,15 @@ public:
         ImGui_ImplSDL2_NewFrame();
         ImGui::NewFrame();
 
-        // copy all pixel to renderer
-        enable_drawing();
-        for(int x = 0; x < WIDTH; x++)
-            for(int y = 0; y < HEIGHT; y++) {
-                // post processing
-                Vec3 COLOR = tonemap((*screen)[x][y], TONEMAP_RGB_CLAMPING);
-                COLOR = gamma_correct(COLOR, gamma);
-
-                draw_pixel(x, y, COLOR);
-            }
-        disable_drawing();
+        // copy the changed pixels to renderer
+        if(frame != nullptr) upload_frame(*frame);
 
         // the UI part
         
         if(ImGui::CollapsingHeader("Editor")) {
             std::string info;
-            if(*frame_num + 1 < *frame_count)
-                info = "rendering frame " + std::to_string(*frame_num + 1) + '/' + std::to_string(*frame_count);
+            if(frame_num + 1 < *frame_count)
+                info = "rendering frame " + std::to_string(frame_num + 1) + '/' + std::to_string(*frame_count);
             else if(running_thread_count != 0) {
                 info = "stopping, " + std::to_string(running_thread_count) + " thread(s) remain(s)";
             }
@@ -157,6 +184,7 @@ public:
 
             std::string delay_text = "last delay " + std::to_string(delay) + "ms";
             delay_text += ", avg " + std::to_string(avg_delay) + "ms";
+            delay_text += ", noise " + std::to_string(noise);
 
             ImGui::Text("%s", info.c_str());
             ImGui::Text("%s", delay_text.c_str());
@@ -169,12 +197,32 @@ public:
             *height = fmin(*height, MAX_HEIGHT);
             *height = fmax(*height, 2);
 
+            ImGui::InputFloat("noise target", noise_target, 0.01f);
+            *noise_target = fmax(*noise_target, 0);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("stop before the frame count once the image is this quiet, 0 to turn off");
+
             ImGui::Checkbox("camera control", camera_control);
             if(ImGui::IsItemHovered())
                 ImGui::SetTooltip("turn on camera control\n WASD: position\n EQ: up/down\n right/left/up/down: angle");
-            ImGui::Checkbox("lazy mode", lazy_mode);
+            bool lazy = *lazy_mode;
+            ImGui::Checkbox("lazy mode", &lazy);
             if(ImGui::IsItemHovered())
                 ImGui::SetTooltip("render in checker pattern, decrease render time");
+            set(lazy_mode, lazy);
+            ImGui::Checkbox("progressive preview", preview);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("start with big blocks and refine them, faster first frames");
+            bool den = *denoise;
+            ImGui::Checkbox("denoise", &den);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("blur the noise away using albedo, normal and depth\n usable after a few frames");
+            set(denoise, den);
+            bool temp = *temporal;
+            ImGui::Checkbox("temporal reprojection", &temp);
+            if(ImGui::IsItemHovered())
+                ImGui::SetTooltip("keep the rendered image while moving the camera");
+            set(temporal, temp);
 
             ImGui::Checkbox("show crosshair", &show_crosshair);
 
@@ -184,76 +232,92 @@ public:
                 // add focal plane if not have
                 // use default id: 0
                 if(focal_plane == nullptr) {
-                    focal_plane = (*oc)[0];
+                    focal_plane = static_cast<Mesh*>((*oc)[0]);
                 }
-                // show the focal plane
-                focal_plane->visible = true;
-
-                Vec3 new_pos = camera->position + camera->get_looking_direction() * camera->focus_distance;
-                Vec3 right_dir = -camera->get_right_direction();
-
-                // optimized version of rotating then translating
-                focal_plane->tris = focal_plane->default_tris;
-                for(int i = 0; i < (int)focal_plane->tris.size(); i++) {
-                    for(int j = 0; j < 3; j++) {
-                        Vec3* pos = &(focal_plane->tris[i].vert[j]);
-                        *pos = _scale(*pos, {100, 0, 100});
-                        *pos = _rotate_y(*pos, camera->panned_angle); // panned angle
-                        *pos = _rotate_on_axis(*pos, right_dir, -camera->tilted_angle + M_PI/2); // tilted angle
-                        *pos = *pos + new_pos;
+                // a moved plane is rasterized again, so only move it when the camera or the focus changed
+                CameraState now = camera->state();
+                if(!focal_plane->visible or now != focal_plane_camera or camera->focus_distance != focal_plane_distance) {
+                    stop_frame();
+                    focal_plane_camera = now;
+                    focal_plane_distance = camera->focus_distance;
+                    // show the focal plane
+                    focal_plane->visible = true;
+
+                    Vec3 new_pos = camera->position + camera->get_looking_direction() * camera->focus_distance;
+                    Vec3 right_dir = -camera->get_right_direction();
+
+                    // optimized version of rotating then translating
+                    focal_plane->tris = focal_plane->default_tris;
+                    for(int i = 0; i < (int)focal_plane->tris.size(); i++) {
+                        for(int j = 0; j < 3; j++) {
+                            Vec3* pos = &(focal_plane->tris[i].vert[j]);
+                            *pos = _scale(*pos, {100, 0, 100});
+                            *pos = _rotate_y(*pos, camera->panned_angle); // panned angle
+                            *pos = _rotate_on_axis(*pos, right_dir, -camera->tilted_angle + M_PI/2); // tilted angle
+                            *pos = *pos + new_pos;
+                        }
                     }
+                    // calculate AABB for rendering
+                    focal_plane->calculate_AABB();
                 }
-                // calculate AABB for rendering
-                focal_plane->calculate_AABB();
             }
             else if(focal_plane != nullptr) {
                 // hide the focal plane object
-                focal_plane->visible = false;
+                set(&focal_plane->visible, false);
             }
             // force render if clicked
             if(old_show_focal_plane != show_focal_plane)
-                *frame_num = 0;
+                *render_request = REQUEST_RESTART;
 
             ImGui::ColorEdit3("up sky color", up_sky_color);
-            Vec3 ukc = Vec3(up_sky_color[0], up_sky_color[1], up_sky_color[2]);
-            if(*up_sky_c != ukc)
-                *up_sky_c = ukc;
+            set(up_sky_c, Vec3(up_sky_color[0], up_sky_color[1], up_sky_color[2]));
 
             ImGui::ColorEdit3("down sky color", down_sky_color);
-            Vec3 dkc = Vec3(down_sky_color[0], down_sky_color[1], down_sky_color[2]);
-            if(*down_sky_c != dkc)
-                *down_sky_c = dkc;
+            set(down_sky_c, Vec3(down_sky_color[0], down_sky_color[1], down_sky_color[2]));
 
             ImGui::InputInt("frame count", frame_count, 1);
             if(ImGui::IsItemHovered())
                 ImGui::SetTooltip("number of frame will be rendered");
 
             if(ImGui::Button("render"))
-                *frame_num = 0;
+                *render_request = REQUEST_RESTART;
             ImGui::SameLine();
             if(ImGui::Button("stop render"))
-                *frame_num = *frame_count;
+                *render_request = REQUEST_STOP;
 
             if(ImGui::Button("fit window size with viewport size")) SDL_SetWindowSize(window, *width, *height);
-            if(ImGui::Button("save image")) save_image(screen, TONEMAP_RGB_CLAMPING, gamma);
+            if(ImGui::Button("save image") and frame != nullptr) save_image(&(frame->color), display.settings);
             ImGui::SameLine();
             if(ImGui::Button("quit"))
                 *running = false;
         }
 
         if(ImGui::CollapsingHeader("camera")) {
-            ImGui::DragFloat("gamma correction", &gamma, 0.01f, 0.0f, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
-
-            ImGui::SliderFloat("FOV", &(camera->FOV), 1.0f, 179.0f);
-            ImGui::DragFloat("focus distance", &(camera->focus_distance), 0.1f, 0.0f, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
-            ImGui::DragFloat("aperture", &(camera->aperture), 0.001f, 0, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
-            ImGui::DragFloat("diverge strength", &(camera->diverge_strength), 0.1f, 0.0f, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
-            ImGui::DragFloat("max range", &(camera->max_range), 1, 0.0f, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
-            ImGui::InputInt("max ray bounce", &(camera->max_ray_bounce_count), 1);
-            camera->max_ray_bounce_count = fmax(camera->max_ray_bounce_count, 1);
-
-            ImGui::InputInt("ray per pixel", &(camera->ray_per_pixel), 1);
-            camera->ray_per_pixel = fmax(camera->ray_per_pixel, 1);
+            PostProcessSettings& pp = display.settings;
+            ImGui::Combo("tonemapping", &pp.tonemapping, tonemapping_items, 3);
+            ImGui::DragFloat("exposure", &pp.exposure, 0.05f, -10.0f, 10.0f, "%.2f");
+            ImGui::Checkbox("sRGB", &pp.srgb);
+            if(!pp.srgb)
+                ImGui::DragFloat("gamma correction", &pp.gamma, 0.01f, 0.0f, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
+
+            // edited on copies, the render thread reads the camera
+            float fov = camera->FOV, focus = camera->focus_distance, aperture = camera->aperture;
+            float diverge = camera->diverge_strength, range = camera->max_range;
+            int bounces = camera->max_ray_bounce_count, rays = camera->ray_per_pixel;
+            ImGui::SliderFloat("FOV", &fov, 1.0f, 179.0f);
+            ImGui::DragFloat("focus distance", &focus, 0.1f, 0.0f, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::DragFloat("aperture", &aperture, 0.001f, 0, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::DragFloat("diverge strength", &diverge, 0.1f, 0.0f, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::DragFloat("max range", &range, 1, 0.0f, INFINITY, "%.3f", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::InputInt("max ray bounce", &bounces, 1);
+            ImGui::InputInt("ray per pixel", &rays, 1);
+            set(&camera->FOV, fov);
+            set(&camera->focus_distance, focus);
+            set(&camera->aperture, aperture);
+            set(&camera->diverge_strength, diverge);
+            set(&camera->max_range, range);
+            set(&camera->max_ray_bounce_count, std::max(bounces, 1));
+            set(&camera->ray_per_pixel, std::max(rays, 1));
         }
 
         ImGui::Begin("object property");
@@ -261,46 +325,50 @@ public:
             bool new_obj = false;
             if(ImGui::Button("add sphere")) {
                 Material mat;
-                mat.texture = new ColorTexture;
+                mat.texture = scene->make<ColorTexture>();
 
-                Sphere* sphere = new Sphere;
+                Sphere* sphere = scene->make<Sphere>();
                 sphere->set_material(mat);
+                stop_frame();
                 oc->push_back(sphere);
                 new_obj = true;
             }
             ImGui::SameLine();
             if(ImGui::Button("add plane")) {
                 Material mat;
-                mat.texture = new ColorTexture;
+                mat.texture = scene->make<ColorTexture>();
 
-                Mesh* mesh = new Mesh;
-                *mesh = load_mesh_from("default_model/plane.obj");
+                Mesh* mesh = scene->make<Mesh>();
+                *mesh = load_compiled_mesh("default_model/plane.obj");
                 mesh->set_material(mat);
                 mesh->update_material();
+                stop_frame();
                 oc->push_back(mesh);
                 new_obj = true;
             }
             ImGui::SameLine();
             if(ImGui::Button("add cube")) {
                 Material mat;
-                mat.texture = new ColorTexture;
+                mat.texture = scene->make<ColorTexture>();
 
-                Mesh* mesh = new Mesh;
-                *mesh = load_mesh_from("default_model/cube.obj");
+                Mesh* mesh = scene->make<Mesh>();
+                *mesh = load_compiled_mesh("default_model/cube.obj");
                 mesh->set_material(mat);
                 mesh->update_material();
+                stop_frame();
                 oc->push_back(mesh);
                 new_obj = true;
             }
             ImGui::SameLine();
             if(ImGui::Button("add dodecahedron")) {
                 Material mat;
-                mat.texture = new ColorTexture;
+                mat.texture = scene->make<ColorTexture>();
 
-                Mesh* mesh = new Mesh;
-                *mesh = load_mesh_from("default_model/dodecahedron.obj");
+                Mesh* mesh = scene->make<Mesh>();
+                *mesh = load_compiled_mesh("default_model/dodecahedron.obj");
                 mesh->set_material(mat);
                 mesh->update_material();
+                stop_frame();
                 oc->push_back(mesh);
                 new_obj = true;
             }
@@ -471,6 +539,7 @@ public:
                                     or mat.smoke != smoke
                                     or mat.density != density;
             if(object_changed) {
+                stop_frame();
                 if(obj->is_sphere())
                     obj->set_radius(radius);
                 else
@@ -489,10 +558,10 @@ public:
                 mat.smoke = smoke;
                 mat.density = density;
                 obj->set_material(mat);
-                obj->calculate_AABB();
-                *frame_num = 0;
+                *render_request = REQUEST_RESTART;
             }
             if(ImGui::Button("delete object")) {
+                stop_frame();
                 for(int i = 0; i < (int)oc->size(); i++)
                     if((*oc)[i] == selecting_object)
                         oc->erase(oc->begin() + i);
@@ -507,17 +576,44 @@ public:
     }
 
     // graphics
-    void enable_drawing() {
-        SDL_LockTexture(texture, NULL, (void**)&pixels, &pitch);
-    }
-    void draw_pixel(int x, int y, Vec3 color) {
-        pixels[y * pitch + x * 4 + 0] = color.z * 255;
-        pixels[y * pitch + x * 4 + 1] = color.y * 255;
-        pixels[y * pitch + x * 4 + 2] = color.x * 255;
-        pixels[y * pitch + x * 4 + 3] = 255;
-    }
-    void disable_drawing() {
-        SDL_UnlockTexture(texture);
+
+    // tonemap and encode the tiles of `frame` that changed since the last upload into the texture
+    // the changed tiles of a tile row are merged into runs and every run is locked once
+    // so an unchanged frame costs nothing and a full one a lock per tile row
+    void upload_frame(const RenderedFrame& frame) {
+        const PostProcessSettings& pp = display.settings;
+        if(pp.tonemapping != uploaded_settings.tonemapping or pp.exposure != uploaded_settings.exposure
+           or pp.srgb != uploaded_settings.srgb or pp.gamma != uploaded_settings.gamma) {
+            uploaded_settings = pp;
+            uploaded_frame = -1;
+        }
+        // the frame of an older viewport size, or one that was already uploaded
+        if(frame.width != WIDTH or frame.height != HEIGHT) return;
+        if(uploaded_frame >= 0 and frame.frame_id <= uploaded_frame) return;
+
+        for(int ty = 0; ty < frame.tile_rows; ty++)
+            for(int tx = 0; tx < frame.tile_columns; ) {
+                auto changed = [&](int t) {
+                    return uploaded_frame < 0 or frame.tile_version[t + ty * frame.tile_columns] > uploaded_frame;
+                };
+                if(!changed(tx)) {
+                    tx++;
+                    continue;
+                }
+                int run_end = tx + 1;
+                while(run_end < frame.tile_columns and changed(run_end)) run_end++;
+
+                SDL_Rect rect;
+                rect.x = tx * DRAW_TILE_SIZE;
+                rect.y = ty * DRAW_TILE_SIZE;
+                rect.w = std::min(run_end * DRAW_TILE_SIZE, WIDTH) - rect.x;
+                rect.h = std::min(rect.y + DRAW_TILE_SIZE, HEIGHT) - rect.y;
+                SDL_LockTexture(texture, &rect, (void**)&pixels, &pitch);
+                display.convert(frame.color, rect.x, rect.y, rect.w, rect.h, pixels, pitch, PIXEL_BGRA8);
+                SDL_UnlockTexture(texture);
+                tx = run_end;
+            }
+        uploaded_frame = frame.frame_id;
     }
     void load_texture() {
         // scale the texture to fit the window
@@ -14,32 +14,35 @@
 #include <vector>
 #include "vec3.h"
 #include "helper.h"
+#include "postprocess.h"
+#include "scene.h"
 
 // save image from vector
-inline void save_to_image(char* name, std::vector<std::vector<Vec3>>* colors, int tonemapping_method, float gamma, int WIDTH, int HEIGHT) {
-    unsigned char data[WIDTH * HEIGHT * 3];
-
-    for(int x = 0; x < WIDTH; x++)
-        for(int y = 0; y < HEIGHT; y++) {
-            Vec3 color = (*colors)[x][y];
-            color = tonemap(color, tonemapping_method);
-            color = gamma_correct(color, gamma);
-            color *= 255;
-
-            int r = color.x;
-            int g = color.y;
-            int b = color.z;
-
-            unsigned char* pixel = data + (y * WIDTH + x) * 3;
-            pixel[0] = r;
-            pixel[1] = g;
-            pixel[2] = b;
-        }
-    stbi_write_png(name, WIDTH, HEIGHT, 3, data, WIDTH * 3);
+inline void save_to_image(char* name, const std::vector<std::vector<Vec3>>* colors, PostProcessSettings settings, int WIDTH, int HEIGHT) {
+    std::vector<unsigned char> data(WIDTH * HEIGHT * 3);
+    PostProcessor post;
+    post.settings = settings;
+    post.to_rgb8(*colors, WIDTH, HEIGHT, data.data(), std::thread::hardware_concurrency());
+    stbi_write_png(name, WIDTH, HEIGHT, 3, data.data(), WIDTH * 3);
+}
+inline void save_to_image(char* name, const std::vector<std::vector<Vec3>>* colors, int tonemapping_method, float gamma, int WIDTH, int HEIGHT) {
+    PostProcessSettings settings;
+    settings.tonemapping = tonemapping_method;
+    settings.gamma = gamma;
+    save_to_image(name, colors, settings, WIDTH, HEIGHT);
 }
 
 unsigned char* load_image(const char* chr, int* image_width, int* image_height, int* channels) {
     return stbi_load(chr, image_width, image_height, channels, 0);
 }
 
+// load an image as a tiled texture
+// the image is converted to `<name>.rtt` next to it on first use, later runs only map that file
+inline TiledTexture* load_tiled_texture(Scene& scene, const char* chr) {
+    TiledTexture* tex = scene.make<TiledTexture>();
+    if(!open_tiled_texture(*tex, chr, load_image))
+        std::cout << "failed to load image " << chr << '\n';
+    return tex;
+}
+
 #endif
@@ -0,0 +1,44 @@
+#include "rey-treycer.h"
+#include <iostream>
+
+// merges partial buffers of render-part into one image
+// merge-parts out.png|out.pfm|out.exr|out.rtp part... [--denoise]
+// an .rtp output is a partial buffer of the whole image again, which can be merged further
+int main(int argc, char** argv) {
+    bool denoise = false;
+    if(argc > 1 and std::string(argv[argc - 1]) == "--denoise") {
+        denoise = true;
+        argc--;
+    }
+    if(argc < 3) {
+        std::cout << "usage: merge-parts output part... [--denoise]\n";
+        return 1;
+    }
+
+    std::vector<PartialBuffer> parts(argc - 2);
+    for(int i = 2; i < argc; i++)
+        if(!parts[i - 2].load(argv[i])) {
+            std::cout << "failed to read " << argv[i] << '\n';
+            return 1;
+        }
+    PartialBuffer merged;
+    std::string error;
+    if(!merge_partials(parts, merged, &error)) {
+        std::cout << error << '\n';
+        return 1;
+    }
+    parts.clear();
+
+    int missing = merged.image_width * merged.image_height;
+    for(int p = 0; p < merged.width * merged.height; p++)
+        missing -= merged.sample_count[p] > 0;
+    if(missing > 0) std::cout << missing << " pixels are not in any part\n";
+
+    std::string out = argv[1];
+    if(!save_partial_image(merged, out, denoise, std::max(1u, std::thread::hardware_concurrency()))) {
+        std::cout << "failed to write " << out << '\n';
+        return 1;
+    }
+    std::cout << "merged " << argc - 2 << " parts into " << out << '\n';
+    return 0;
+}
@@ -10,39 +10,74 @@
 int main(int argc, char** argv) {
     ReyTreycer rt(1280, 720);
 
-        if(argc > 1) {
-        if(std::string(argv[1]) == "cornell")
-            cornell_box(rt);
-        else if(std::string(argv[1]) == "textures")
-            all_textures(rt);
-        else if(std::string(argv[1]) == "all") {
-            cornell_box(rt);
-            all_textures(rt);
-        }
+    // camera setting, a scene file can override them
+    default_camera(rt.camera);
+
+    // when to stop, 100 samples per pixel unless given with --time, --spp or --noise
+    // --pfm and --exr also stream the float image to a file while rendering
+    // --checkpoint saves the render every --checkpoint-every frames (10) and resumes from it if it exists
+    // --shm publishes every frame to a shared memory segment of that name, see watch-render
+    RenderBudget budget;
+    std::string pfm_file, exr_file, shm_name;
+    rt.checkpoint_interval = 10;
+    while(argc > 2 and std::string(argv[argc - 2]).substr(0, 2) == "--") {
+        std::string option = argv[argc - 2];
+        float value = atof(argv[argc - 1]);
+        if(option == "--time") budget.seconds = value;
+        else if(option == "--spp") budget.samples_per_pixel = value;
+        else if(option == "--noise") budget.noise = value;
+        else if(option == "--pfm") pfm_file = argv[argc - 1];
+        else if(option == "--exr") exr_file = argv[argc - 1];
+        else if(option == "--checkpoint") rt.checkpoint_file = argv[argc - 1];
+        else if(option == "--checkpoint-every") rt.checkpoint_interval = value;
+        else if(option == "--shm") shm_name = argv[argc - 1];
         else {
-            std::cout << "invalid arguement\n";
+            std::cout << "invalid option " << option << '\n';
             return 1;
         }
+        argc -= 2;
     }
-    else all_textures(rt);
-
-    // camera setting
-    Camera* camera = &rt.camera;
-    camera->position.z = 10;
-    camera->FOV = 90.0f;
-    camera->max_range = 100;
-    camera->max_ray_bounce_count = 50;
-    camera->ray_per_pixel = 1;
-    camera->init();
-
-    while(rt.rendered_count < 100) {
-        auto start = std::chrono::system_clock::now();
-        rt.draw_frame();
-        auto end = std::chrono::system_clock::now();
-        std::chrono::duration<double> elapsed = end - start;
-        
-        std::cout << "frame " << rt.rendered_count << " took " << (elapsed.count() * 1000) << " ms\n";
+    if(budget.seconds <= 0 and budget.samples_per_pixel <= 0 and budget.noise <= 0)
+        budget.samples_per_pixel = 100;
+
+    if(!load_named_scene(argc > 1 ? argv[1] : "textures", rt)) return 1;
+
+    if(!rt.checkpoint_file.empty() and rt.load_checkpoint(rt.checkpoint_file))
+        std::cout << "resuming " << rt.checkpoint_file << " after " << rt.rendered_count << " frames\n";
+
+    PFMWriter pfm;
+    EXRWriter exr;
+    TileSink* sink = nullptr;
+    if(!pfm_file.empty() and pfm.begin(pfm_file, rt.WIDTH, rt.HEIGHT)) sink = &pfm;
+    else if(!exr_file.empty() and exr.begin(exr_file, rt.WIDTH, rt.HEIGHT)) sink = &exr;
+    else if(!pfm_file.empty() or !exr_file.empty()) {
+        std::cout << "failed to create " << pfm_file << exr_file << '\n';
+        return 1;
     }
+    rt.tile_sink = sink;
+
+    SharedFramebuffer shared;
+    if(!shm_name.empty()) {
+        if(!shared.create(shm_name)) {
+            std::cout << "failed to create shared memory " << shm_name << '\n';
+            return 1;
+        }
+        rt.shared_framebuffer = &shared;
+    }
+
+    RenderReport report = rt.render_until(budget);
+    rt.shared_framebuffer = nullptr;
+    if(!rt.checkpoint_file.empty()) rt.save_checkpoint(rt.checkpoint_file);
+
+    if(sink != nullptr) {
+        rt.tile_sink = nullptr;
+        // tiles skipped by adaptive sampling were written in earlier frames, but the
+        // preview frames were not streamed, so write everything once more
+        rt.write_image(*sink);
+        if(!sink->finish()) std::cout << "failed to write " << pfm_file << exr_file << '\n';
+    }
+    std::cout << report.frames << " frames took " << (report.seconds * 1000) << " ms"
+              << ", estimated noise " << report.noise << '\n';
     auto t = std::time(nullptr);
     auto tm = *std::localtime(&t);
 
@@ -53,5 +88,11 @@ int main(int argc, char** argv) {
     char *c = const_cast<char*>(str.c_str());
     save_to_image(c, &rt.screen_color, TONEMAP_RGB_CLAMPING, 1, rt.WIDTH, rt.HEIGHT);
 
+    // and a denoised version next to it
+    rt.denoise_frame();
+    str = "imgs/" + oss.str() + "-denoised.png";
+    c = const_cast<char*>(str.c_str());
+    save_to_image(c, &rt.denoised_color, TONEMAP_RGB_CLAMPING, 1, rt.WIDTH, rt.HEIGHT);
+
     return 0;
 }
@@ -0,0 +1,73 @@
+#include "rey-treycer.h"
+#include "distributed.h"
+#include "scenes.h"
+#include <iostream>
+#include <cstdio>
+
+// renders one image with many processes over tcp, every process loads the same scene
+//   render-farm scene --coordinator port [--out file] [--frames n] [--batch n] [--tile n]
+//   render-farm scene --worker host:port
+int main(int argc, char** argv) {
+    ReyTreycer rt(1280, 720);
+
+    // camera setting, a scene file can override them
+    default_camera(rt.camera);
+
+    DistributedSettings settings;
+    int port = -1;
+    std::string worker, out_file = "farm.png";
+    while(argc > 2 and std::string(argv[argc - 2]).substr(0, 2) == "--") {
+        std::string option = argv[argc - 2];
+        std::string value = argv[argc - 1];
+        if(option == "--coordinator") port = atoi(value.c_str());
+        else if(option == "--worker") worker = value;
+        else if(option == "--out") out_file = value;
+        else if(option == "--frames") settings.frames = atoi(value.c_str());
+        else if(option == "--batch") settings.frames_per_batch = atoi(value.c_str());
+        else if(option == "--tile") settings.tile_size = atoi(value.c_str());
+        else {
+            std::cout << "invalid option " << option << '\n';
+            return 1;
+        }
+        argc -= 2;
+    }
+    if((port < 0) == worker.empty()) {
+        std::cout << "give either --coordinator port or --worker host:port\n";
+        return 1;
+    }
+
+    if(!load_named_scene(argc > 1 ? argv[1] : "textures", rt)) return 1;
+
+    if(!worker.empty()) {
+        size_t colon = worker.find_last_of(':');
+        if(colon == std::string::npos) {
+            std::cout << "invalid worker address " << worker << '\n';
+            return 1;
+        }
+        std::string error;
+        if(!run_render_worker(rt, worker.substr(0, colon), atoi(worker.substr(colon + 1).c_str()), &error)) {
+            std::cout << error << '\n';
+            return 1;
+        }
+        return 0;
+    }
+
+    RenderCoordinator coordinator;
+    if(!coordinator.listen(port)) {
+        std::cout << "cannot listen on port " << port << '\n';
+        return 1;
+    }
+    std::cout << "waiting for workers on port " << coordinator.port() << '\n';
+    coordinator.on_progress = [](const DistributedProgress& p) {
+        std::cout << p.items_done << '/' << p.items_total << " items, " << p.workers << " workers ("
+                  << p.workers_failed << " lost, " << p.workers_rejected << " rejected), "
+                  << (int)p.seconds << " s, " << (int)p.seconds_left << " s left\n";
+    };
+    if(!coordinator.run(rt, settings)) return 1;
+    if(!save_partial_image(coordinator.result, out_file)) {
+        std::cout << "failed to write " << out_file << '\n';
+        return 1;
+    }
+    std::cout << "written to " << out_file << '\n';
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include "rey-treycer.h"
+#include "scenes.h"
+#include <iostream>
+#include <cstdio>
+
+// renders one piece of an image into a partial buffer, merge-parts puts the pieces together
+// render-part scene [--region x,y,width,height] [--frames first,count] [--out file] [--checkpoint file]
+int main(int argc, char** argv) {
+    ReyTreycer rt(1280, 720);
+
+    // camera setting, a scene file can override them
+    default_camera(rt.camera);
+
+    // the whole image and frames 0 to 99 unless given
+    RenderRegion region;
+    long long first_frame = 0;
+    int frames = 100;
+    std::string out_file = "part.rtp";
+    rt.checkpoint_interval = 10;
+    while(argc > 2 and std::string(argv[argc - 2]).substr(0, 2) == "--") {
+        std::string option = argv[argc - 2];
+        std::string value = argv[argc - 1];
+        bool valid = true;
+        if(option == "--region")
+            valid = sscanf(value.c_str(), "%d,%d,%d,%d", &region.x, &region.y, &region.width, &region.height) == 4;
+        else if(option == "--frames")
+            valid = sscanf(value.c_str(), "%lld,%d", &first_frame, &frames) == 2 and first_frame >= 0;
+        else if(option == "--out") out_file = value;
+        else if(option == "--checkpoint") rt.checkpoint_file = value;
+        else valid = false;
+        if(!valid) {
+            std::cout << "invalid option " << option << ' ' << value << '\n';
+            return 1;
+        }
+        argc -= 2;
+    }
+
+    if(!load_named_scene(argc > 1 ? argv[1] : "textures", rt)) return 1;
+
+    // a killed run started again goes on from its last checkpoint
+    bool resume = !rt.checkpoint_file.empty() and rt.load_checkpoint(rt.checkpoint_file);
+    if(resume) std::cout << "resuming " << rt.checkpoint_file << " after " << rt.rendered_count << " frames\n";
+
+    PartialBuffer part = rt.render_region(region, first_frame, frames, resume);
+    if(!part.save(out_file)) {
+        std::cout << "failed to write " << out_file << '\n';
+        return 1;
+    }
+    std::cout << "pixels " << part.x << ',' << part.y << ' ' << part.width << 'x' << part.height
+              << ", frames " << part.first_frame << " to " << part.end_frame << ", written to " << out_file << '\n';
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include "rey-treycer.h"
+#include "scenes.h"
+#include "sequence.h"
+#include <iostream>
+#include <cstdio>
+
+// renders a camera animation into numbered images or a .y4m video
+// render-sequence scene [--turntable frames] [--move x,y,z] [--frames count] [--fps n] [--spp n] [--out file]
+//   --turntable  the camera circles the y axis once, looking at it, in that many frames
+//   --move       the camera moves that far, in --frames frames (48)
+int main(int argc, char** argv) {
+    ReyTreycer rt(1280, 720);
+
+    // camera setting, a scene file can override them
+    Camera* camera = &rt.camera;
+    default_camera(*camera);
+
+    int turntable = 0, frames = 48;
+    bool move = false;
+    Vec3 distance = VEC3_ZERO;
+    float fps = 24;
+    SequenceSettings settings;
+    settings.budget.samples_per_pixel = 16;
+    settings.output = "imgs/sequence-%04d.png";
+    while(argc > 2 and std::string(argv[argc - 2]).substr(0, 2) == "--") {
+        std::string option = argv[argc - 2];
+        std::string value = argv[argc - 1];
+        bool valid = true;
+        if(option == "--turntable") valid = (turntable = atoi(value.c_str())) > 0;
+        else if(option == "--move") valid = move = parse_scene_vec3(value, &distance);
+        else if(option == "--frames") valid = (frames = atoi(value.c_str())) > 0;
+        else if(option == "--fps") valid = (fps = atof(value.c_str())) > 0;
+        else if(option == "--spp") valid = (settings.budget.samples_per_pixel = atoi(value.c_str())) > 0;
+        else if(option == "--out") settings.output = value;
+        else if(option == "--denoise") settings.denoise = value == "1";
+        else valid = false;
+        if(!valid) {
+            std::cout << "invalid option " << option << ' ' << value << '\n';
+            return 1;
+        }
+        argc -= 2;
+    }
+
+    if(!load_named_scene(argc > 1 ? argv[1] : "textures", rt)) return 1;
+
+    Sequence seq;
+    seq.fps = fps;
+    Vec3 start = camera->position;
+    if(turntable > 0) {
+        // a key on every frame, the circle is exact where it is sampled
+        float radius = sqrtf(start.x * start.x + start.z * start.z);
+        float start_angle = atan2f(start.x, start.z);
+        for(int i = 0; i <= turntable; i++) {
+            float a = start_angle + 2 * M_PI * i / turntable;
+            seq.camera_position.key(i / fps, Vec3(sinf(a) * radius, start.y, cosf(a) * radius));
+            seq.camera_pan.key(i / fps, rad2deg(a));
+        }
+        // the last key is the first frame again
+        seq.frame_count = turntable;
+    }
+    else if(move) {
+        seq.camera_position.interpolation = INTERPOLATE_SMOOTH;
+        seq.camera_position.key(0, start);
+        seq.camera_position.key((frames - 1) / fps, start + distance);
+    }
+    else seq.frame_count = frames;
+
+    SequenceReport report = render_sequence(rt, seq, settings, [](int frame, const RenderReport& r) {
+        std::cout << "frame " << frame << ": " << r.frames << " frames took " << (r.seconds * 1000) << " ms"
+                  << ", estimated noise " << r.noise << std::endl;
+    });
+    if(!report.ok) {
+        std::cout << report.error << '\n';
+        return 1;
+    }
+    std::cout << report.frames << " frames took " << report.seconds << " s, "
+              << report.writer_wait << " s of it waiting for the writer\n";
+    return 0;
+}
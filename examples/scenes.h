@@ -3,21 +3,23 @@
 
 #include "rey-treycer.h"
 #include "image.h"
+#include "scene_loader.h"
+#include <iostream>
 
-// object that need to be access as pointer like Object, Texture (later Material)
-// needed to be created with `new` keyword if defined in local scope to keep it exist
-// if created in main function you dont need the new keyword because it will remain
+// object that need to be access as pointer like Object, Texture
+// are made with `rt.scene.make<T>()` so they live as long as the ray tracer
+// if created in main function you can also use plain variables because they will remain
 // until the end of the program
 
 inline void cornell_box(ReyTreycer& rt) {
-    Mesh plane = load_mesh_from("default_model/plane.obj");
+    Mesh plane = load_compiled_mesh("default_model/plane.obj");
     plane.set_scale({5, 5, 5});
 
-    ColorTexture* tex_red = new ColorTexture;
+    ColorTexture* tex_red = rt.scene.make<ColorTexture>();
     tex_red->color = RED;
-    ColorTexture* tex_green = new ColorTexture;
+    ColorTexture* tex_green = rt.scene.make<ColorTexture>();
     tex_green->color = GREEN;
-    ColorTexture* tex_white = new ColorTexture;
+    ColorTexture* tex_white = rt.scene.make<ColorTexture>();
     tex_white->color = WHITE;
 
     Material mat_red;
@@ -34,14 +36,14 @@ inline void cornell_box(ReyTreycer& rt) {
     mat_light.emission_strength = 5.0f;
     mat_light.texture = tex_white;
 
-    Mesh* floor = new Mesh; *floor = plane;
+    Mesh* floor = rt.scene.make<Mesh>(); *floor = plane;
     floor->set_position({0, -5, 0});
     floor->set_material(mat_white);
     floor->update_material();
     floor->calculate_AABB();
     rt.add_object(floor);
 
-    Mesh* ceil = new Mesh; *ceil = plane;
+    Mesh* ceil = rt.scene.make<Mesh>(); *ceil = plane;
     ceil->set_rotation({M_PI, 0, 0});
     ceil->set_position({0, 5, 0});
     ceil->set_material(mat_white);
@@ -49,7 +51,7 @@ inline void cornell_box(ReyTreycer& rt) {
     ceil->calculate_AABB();
     rt.add_object(ceil);
 
-    Mesh* wall_back = new Mesh; *wall_back = plane;
+    Mesh* wall_back = rt.scene.make<Mesh>(); *wall_back = plane;
     wall_back->set_rotation({M_PI/2, 0, 0});
     wall_back->set_position({0, 0, -5});
     wall_back->set_material(mat_white);
@@ -57,7 +59,7 @@ inline void cornell_box(ReyTreycer& rt) {
     wall_back->calculate_AABB();
     rt.add_object(wall_back);
 
-    Mesh* wall_front = new Mesh; *wall_front = plane;
+    Mesh* wall_front = rt.scene.make<Mesh>(); *wall_front = plane;
     wall_front->set_rotation({M_PI/2, M_PI, 0});
     wall_front->set_position({0, 0, 5});
     wall_front->set_material(mat_white);
@@ -65,7 +67,7 @@ inline void cornell_box(ReyTreycer& rt) {
     wall_front->calculate_AABB();
     rt.add_object(wall_front);
 
-    Mesh* wall_red = new Mesh; *wall_red = plane;
+    Mesh* wall_red = rt.scene.make<Mesh>(); *wall_red = plane;
     wall_red->set_rotation({0, 0, -M_PI/2});
     wall_red->set_position({-5, 0, 0});
     wall_red->set_material(mat_red);
@@ -73,7 +75,7 @@ inline void cornell_box(ReyTreycer& rt) {
     wall_red->calculate_AABB();
     rt.add_object(wall_red);
 
-    Mesh* wall_green = new Mesh; *wall_green = plane;
+    Mesh* wall_green = rt.scene.make<Mesh>(); *wall_green = plane;
     wall_green->set_rotation({0, 0, M_PI/2});
     wall_green->set_position({5, 0, 0});
     wall_green->set_material(mat_green);
@@ -81,8 +83,8 @@ inline void cornell_box(ReyTreycer& rt) {
     wall_green->calculate_AABB();
     rt.add_object(wall_green);
 
-    Mesh* light = new Mesh;
-    *light = load_mesh_from("default_model/cube.obj");
+    Mesh* light = rt.scene.make<Mesh>();
+    *light = load_compiled_mesh("default_model/cube.obj");
     light->set_scale({2.5f, 0.1f, 2.5f});
     light->set_position({0, 5, 0});
     light->set_material(mat_light);
@@ -93,41 +95,39 @@ inline void cornell_box(ReyTreycer& rt) {
 
 inline void all_textures(ReyTreycer& rt) {
     // dice
-    ImageTexture* dice_tex = new ImageTexture;
-    dice_tex->pixel_data = load_image("texture/dice.png",
-                                      &(dice_tex->image_width), &(dice_tex->image_height),
-                                      &(dice_tex->channels));
+    // tiled textures are paged in through the shared texture cache
+    // see `load_tiled_texture()` in image.h
+    TiledTexture* dice_tex = load_tiled_texture(rt.scene, "texture/dice.png");
     Material cube_mat;
     cube_mat.texture = dice_tex;
 
-    Mesh* cube = new Mesh;
-    *cube = load_mesh_from("default_model/cube-uv.obj");
+    Mesh* cube = rt.scene.make<Mesh>();
+    *cube = load_compiled_mesh("default_model/cube-uv.obj");
     cube->set_material(cube_mat);
     cube->update_material();
     cube->set_position({1.4, 0, 0});
     cube->set_rotation({0.5, -2.33, 0});
-    // after setting mesh transformation you need to run calculate_AABB()
-    cube->calculate_AABB();
+    // the boxes of a moved mesh are updated when the next frame starts
     rt.add_object(cube);
 
-    ProceduralTexture* checker_tex = new ProceduralTexture;
+    ProceduralTexture* checker_tex = rt.scene.make<ProceduralTexture>();
     // see all pre-defined function in rey-treycer.h tail
     checker_tex->set_function(&checker); 
     Material sphere_mat;
     sphere_mat.texture = checker_tex;
 
-    Sphere* sphere = new Sphere;
+    Sphere* sphere = rt.scene.make<Sphere>();
     sphere->set_material(sphere_mat);
     sphere->set_position({0, 3, 0});
     rt.add_object(sphere);
 
-    ColorTexture* color_tex = new ColorTexture;
+    ColorTexture* color_tex = rt.scene.make<ColorTexture>();
     color_tex->color = WHITE;
     Material dodeca_mat;
     dodeca_mat.texture = color_tex;
 
-    Mesh* dodecah = new Mesh;
-    *dodecah = load_mesh_from("default_model/dodecahedron.obj");
+    Mesh* dodecah = rt.scene.make<Mesh>();
+    *dodecah = load_compiled_mesh("default_model/dodecahedron.obj");
     dodecah->set_material(dodeca_mat);
     dodecah->update_material();
     dodecah->set_position({-2, 0, 0});
@@ -136,4 +136,34 @@ inline void all_textures(ReyTreycer& rt) {
     rt.add_object(dodecah);
 }
 
+// camera setting shared by the examples, a scene file can override them
+inline void default_camera(Camera& camera) {
+    camera.position.z = 10;
+    camera.FOV = 90.0f;
+    camera.max_range = 100;
+    camera.max_ray_bounce_count = 50;
+    camera.ray_per_pixel = 1;
+}
+
+// picks the scene given on the command line: cornell, textures, all or a .scene file
+// the camera is initialized afterward, load_scene() already does it for scene files
+inline bool load_named_scene(std::string arg, ReyTreycer& rt) {
+    if(arg == "cornell")
+        cornell_box(rt);
+    else if(arg == "textures")
+        all_textures(rt);
+    else if(arg == "all") {
+        cornell_box(rt);
+        all_textures(rt);
+    }
+    else if(arg.size() > 6 and arg.substr(arg.size() - 6) == ".scene")
+        return load_scene(arg, rt, load_image);
+    else {
+        std::cout << "invalid arguement\n";
+        return false;
+    }
+    rt.camera.init();
+    return true;
+}
+
 #endif
@@ -0,0 +1,63 @@
+#include "rey-treycer.h"
+#include <iostream>
+#include <chrono>
+#include <thread>
+
+// watches a render published to shared memory, for example by `no-gui cornell --shm name`
+// prints the progress and, when the render ends, writes its last frame to a png if given
+//   watch-render name [out.png]
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::cout << "usage: watch-render name [out.png]\n";
+        return 1;
+    }
+    SharedFramebuffer shared;
+    // the render might not have started yet
+    for(int i = 0; i < 100 and !shared.open(argv[1]); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if(!shared.is_open()) {
+        std::cout << "no render named " << argv[1] << '\n';
+        return 1;
+    }
+
+    SharedFramebufferHeader frame;
+    std::vector<char> pixels;
+    uint64_t shown = 0;
+    bool got_frame = false;
+    while(true) {
+        if(shared.read(frame, pixels)) {
+            if(frame.frame_id != shown and frame.width > 0) {
+                std::cout << "frame " << frame.frame_id << ", " << frame.rendered_count << " samples, noise " << frame.noise << '\n';
+                shown = frame.frame_id;
+                got_frame = true;
+            }
+            if(frame.finished) break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+
+    if(argc > 2 and got_frame) {
+        if(frame.format != SHARED_RGB32F) {
+            std::cout << "only float frames can be saved\n";
+            return 1;
+        }
+        std::vector<std::vector<Vec3>> color(frame.width, std::vector<Vec3>(frame.height, VEC3_ZERO));
+        for(int y = 0; y < frame.height; y++) {
+            const float* row = (const float*)(pixels.data() + y * frame.pitch);
+            for(int x = 0; x < frame.width; x++)
+                color[x][y] = Vec3(row[x * 3], row[x * 3 + 1], row[x * 3 + 2]);
+        }
+        PNGWriter png;
+        if(!png.begin(argv[2], frame.width, frame.height)) {
+            std::cout << "failed to write " << argv[2] << '\n';
+            return 1;
+        }
+        for(int y = 0; y < frame.height; y += DRAW_TILE_SIZE)
+            png.write_tile(color, 0, y, frame.width, std::min(DRAW_TILE_SIZE, frame.height - y));
+        if(!png.finish()) {
+            std::cout << "failed to write " << argv[2] << '\n';
+            return 1;
+        }
+    }
+    return 0;
+}
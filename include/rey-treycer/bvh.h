@@ -0,0 +1,762 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "constant.h"
+#include "thread_pool.h"
+
+// bounding volume hierarchy over a list of primitive boxes
+// used to skip most of the triangles of a mesh when casting a ray
+//
+// two builders, picked with BVHBuildSettings::mode:
+//   BVH_BUILD_SAH   splits every node where the surface area heuristic says rays are cheapest,
+//                   testing a few planes per axis (binning). slower to build, faster to trace
+//   BVH_BUILD_LBVH  sorts the primitives along a morton curve and splits where the codes differ,
+//                   the boxes are filled in by one refit at the end. fast to build, slower to trace
+//   BVH_BUILD_SBVH  SAH, plus spatial splits that cut triangles crossing a plane into a part for
+//                   each side. tightest boxes for long or overlapping triangles, the slowest build,
+//                   and the boxes do not survive a refit, so for meshes that stay where they are
+// with a ThreadPool, big SAH and LBVH subtrees are built as tasks on it
+
+enum BVH_BUILD_MODE {
+    BVH_BUILD_SAH = 0,
+    BVH_BUILD_LBVH = 1,
+    BVH_BUILD_SBVH = 2,
+};
+// sah, lbvh or sbvh, as in scene files and the mesh cache names
+inline const char* bvh_mode_name(int mode) {
+    const char* names[] = {"sah", "lbvh", "sbvh"};
+    return mode >= 0 and mode <= BVH_BUILD_SBVH ? names[mode] : "sah";
+}
+
+const int BVH_MAX_LEAF_SIZE = 4;
+// meshes with fewer triangles are faster to test one by one
+const int BVH_MIN_PRIMS = 16;
+// past this depth nodes are split at the median to keep the tree shallow
+const int BVH_MAX_SPLIT_DEPTH = 40;
+// most SAH candidate planes per axis
+const int BVH_MAX_BINS = 64;
+// subtrees with fewer primitives are not worth a task
+const int BVH_TASK_MIN_PRIMS = 4096;
+// enough for any tree the builder makes
+const int BVH_STACK_SIZE = 128;
+// the distance returned for a missed box, finite so it still compares right with -ffast-math
+const float BVH_MISS = 1e30f;
+// surface area heuristic: the cost of visiting a node and of testing a triangle
+const float BVH_TRAVERSAL_COST = 1;
+const float BVH_INTERSECTION_COST = 1;
+// a refitted tree is built again once its cost grew this much over the cost it was built with
+const float BVH_REBUILD_RATIO = 1.5f;
+// SBVH only looks for a spatial split where the children of the best object split
+// overlap by more than this part of the root area
+const float BVH_SPATIAL_SPLIT_ALPHA = 1e-5f;
+
+struct AABB {
+    Vec3 min = Vec3(INFINITY, INFINITY, INFINITY);
+    Vec3 max = -Vec3(INFINITY, INFINITY, INFINITY);
+
+    void grow(Vec3 p) {
+        min = Vec3(fmin(min.x, p.x), fmin(min.y, p.y), fmin(min.z, p.z));
+        max = Vec3(fmax(max.x, p.x), fmax(max.y, p.y), fmax(max.z, p.z));
+    }
+    void grow(const AABB& b) {
+        grow(b.min);
+        grow(b.max);
+    }
+    Vec3 center() const {
+        return (min + max) / 2;
+    }
+    float surface_area() const {
+        Vec3 d = max - min;
+        if(d.x < 0) return 0;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+};
+
+struct BVHBuildSettings {
+    int mode = BVH_BUILD_SAH;
+    // SAH candidate planes per axis, up to BVH_MAX_BINS
+    int bins = 16;
+    // SBVH: spatial splits may add up to this many references per primitive, 0.5 is 50% more
+    float spatial_budget = 0.5f;
+    // big subtrees are built as tasks here, nullptr builds everything on the calling thread
+    ThreadPool* pool = nullptr;
+};
+
+// what a tree looks like, see BVH::stats()
+struct BVHStats {
+    int mode = BVH_BUILD_SAH;
+    int nodes = 0;
+    int leaves = 0;
+    // the root is at depth 0
+    int max_depth = 0;
+    float average_leaf_size = 0;
+    // entries in BVH::prim_indices, more than the primitives when spatial splits cut some
+    int references = 0;
+    // BVH::cost()
+    float sah_cost = 0;
+    // how long the last build took, 0 for a tree loaded from a cache
+    double build_ms = 0;
+};
+
+// counted by Ray::cast_to_mesh_counted(), see measure_traversal()
+struct BVHTraversalStats {
+    int64_t rays = 0;
+    // nodes whose box was entered, and triangles tested
+    int64_t nodes = 0;
+    int64_t prims = 0;
+
+    float nodes_per_ray() const {
+        return rays > 0 ? (float)nodes / rays : 0;
+    }
+    float prims_per_ray() const {
+        return rays > 0 ? (float)prims / rays : 0;
+    }
+};
+
+struct BVHNode {
+    Vec3 box_min = VEC3_ZERO;
+    Vec3 box_max = VEC3_ZERO;
+    // inner node: index of the left child, the right child is right after it
+    // leaf: index of the first primitive in BVH::prim_indices
+    int first = 0;
+    // number of primitives in a leaf, 0 for inner nodes
+    int count = 0;
+};
+
+class BVH {
+private:
+    void set_bounds(BVHNode& node, const std::vector<AABB>& prim_bounds) {
+        AABB box;
+        for(int i = node.first; i < node.first + node.count; i++)
+            box.grow(prim_bounds[prim_indices[i]]);
+        node.box_min = box.min;
+        node.box_max = box.max;
+    }
+    static float node_area(const BVHNode& node) {
+        AABB box;
+        box.min = node.box_min;
+        box.max = node.box_max;
+        return box.surface_area();
+    }
+    // the SAH cost of one node, relative to a root of area 1
+    static float node_cost(const BVHNode& node) {
+        return node_area(node) * (node.count > 0 ? node.count * BVH_INTERSECTION_COST : BVH_TRAVERSAL_COST);
+    }
+    // the axis with the largest extent of a box
+    static int longest_axis(const AABB& box) {
+        Vec3 extent = box.max - box.min;
+        int axis = 0;
+        if(extent.y > extent.x) axis = 1;
+        if(extent.z > (axis == 0 ? extent.x : extent.y)) axis = 2;
+        return axis;
+    }
+    static float axis_of(Vec3 v, int axis) {
+        return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+    }
+
+    // sort prim_indices along a morton curve through the centers of the primitives,
+    // `morton` gets the code of every position in prim_indices
+    void sort_morton(const std::vector<AABB>& prim_bounds, std::vector<uint32_t>& morton) {
+        int n = prim_bounds.size();
+        AABB centroids;
+        for(const AABB& b: prim_bounds) centroids.grow(b.center());
+        Vec3 extent = centroids.max - centroids.min;
+        // 10 bits per axis, each bit of x, y and z put next to each other
+        auto spread = [](uint32_t v) {
+            v = (v * 0x00010001u) & 0xFF0000FFu;
+            v = (v * 0x00000101u) & 0x0F00F00Fu;
+            v = (v * 0x00000011u) & 0xC30C30C3u;
+            v = (v * 0x00000005u) & 0x49249249u;
+            return v;
+        };
+        auto quantize = [](float v, float from, float size) {
+            return size > 0 ? (uint32_t)std::min(fmaxf((v - from) / size, 0) * 1024, 1023.0f) : 0u;
+        };
+        std::vector<std::pair<uint32_t, int>> keys(n);
+        for(int i = 0; i < n; i++) {
+            Vec3 c = prim_bounds[i].center();
+            keys[i].first = spread(quantize(c.x, centroids.min.x, extent.x)) * 4
+                          + spread(quantize(c.y, centroids.min.y, extent.y)) * 2
+                          + spread(quantize(c.z, centroids.min.z, extent.z));
+            keys[i].second = i;
+        }
+
+        // sort pieces on the pool, then merge them here
+        int pieces = settings.pool != nullptr ? std::min(settings.pool->size(), n / BVH_TASK_MIN_PRIMS) : 1;
+        if(pieces > 1) {
+            std::vector<std::future<void>> sorted;
+            for(int p = 0; p < pieces; p++)
+                sorted.push_back(settings.pool->submit([&keys, p, pieces, n]() {
+                    std::sort(keys.begin() + (int64_t)n * p / pieces, keys.begin() + (int64_t)n * (p + 1) / pieces);
+                }));
+            for(std::future<void>& f: sorted) settings.pool->wait(f);
+            for(int p = 1; p < pieces; p++)
+                std::inplace_merge(keys.begin(), keys.begin() + (int64_t)n * p / pieces, keys.begin() + (int64_t)n * (p + 1) / pieces);
+        }
+        else std::sort(keys.begin(), keys.end());
+
+        morton.resize(n);
+        for(int i = 0; i < n; i++) {
+            morton[i] = keys[i].first;
+            prim_indices[i] = keys[i].second;
+        }
+    }
+
+    // LBVH: the primitives are in morton order, split where the highest differing bit of the codes changes
+    int split_morton(const BVHNode& node, int depth, const std::vector<uint32_t>& morton) {
+        uint32_t a = morton[node.first], b = morton[node.first + node.count - 1];
+        if(a == b or depth >= BVH_MAX_SPLIT_DEPTH) return node.count / 2;
+        // keep only the highest differing bit, the left side agrees with `a` above it
+        uint32_t top = a ^ b;
+        while(top & (top - 1)) top &= top - 1;
+        int lo = node.first, hi = node.first + node.count - 1;
+        while(hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if((a ^ morton[mid]) < top) lo = mid;
+            else hi = mid;
+        }
+        return lo - node.first + 1;
+    }
+
+    // the cheapest SAH plane through the centers of `count` boxes, box_of(k) is box k
+    struct ObjectSplit {
+        float cost = INFINITY;
+        // -1 if no plane has boxes on both sides
+        int axis = -1;
+        // boxes in bins below `split` go left
+        int split = 0;
+        int bin_count = 2;
+        float from = 0;
+        float scale = 0;
+        AABB left, right;
+
+        int bin(Vec3 center) const {
+            return std::min((int)((axis_of(center, axis) - from) * scale), bin_count - 1);
+        }
+    };
+    template<class BoxOf>
+    ObjectSplit find_object_split(int count, BoxOf box_of, const AABB& centroids) const {
+        struct Bin {
+            AABB box;
+            int count = 0;
+        };
+        ObjectSplit best;
+        int bin_count = std::max(2, std::min(settings.bins, BVH_MAX_BINS));
+        for(int axis = 0; axis < 3; axis++) {
+            float from = axis_of(centroids.min, axis);
+            float extent = axis_of(centroids.max, axis) - from;
+            if(extent <= 0) continue;
+            float scale = bin_count / extent;
+
+            Bin bins[BVH_MAX_BINS];
+            for(int i = 0; i < count; i++) {
+                const AABB& b = box_of(i);
+                int k = std::min((int)((axis_of(b.center(), axis) - from) * scale), bin_count - 1);
+                bins[k].count++;
+                bins[k].box.grow(b);
+            }
+            // box and count right of every plane, plane k is between bin k - 1 and bin k
+            AABB right_box[BVH_MAX_BINS];
+            int right_count[BVH_MAX_BINS];
+            AABB box;
+            int n = 0;
+            for(int k = bin_count - 1; k > 0; k--) {
+                if(bins[k].count > 0) box.grow(bins[k].box);
+                n += bins[k].count;
+                right_box[k] = box;
+                right_count[k] = n;
+            }
+            box = AABB();
+            n = 0;
+            for(int k = 1; k < bin_count; k++) {
+                if(bins[k - 1].count > 0) box.grow(bins[k - 1].box);
+                n += bins[k - 1].count;
+                if(n == 0 or right_count[k] == 0) continue;
+                float cost = n * box.surface_area() + right_count[k] * right_box[k].surface_area();
+                if(cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.split = k;
+                    best.bin_count = bin_count;
+                    best.from = from;
+                    best.scale = scale;
+                    best.left = box;
+                    best.right = right_box[k];
+                }
+            }
+        }
+        return best;
+    }
+
+    // SAH: bin the centers on every axis and take the plane with the lowest cost,
+    // then move the primitives left of it to the front. returns how many went left
+    int split_sah(const BVHNode& node, int depth, const std::vector<AABB>& prim_bounds) {
+        int* begin = prim_indices.data() + node.first;
+        int* end = begin + node.count;
+        AABB centroids;
+        for(int* i = begin; i < end; i++) centroids.grow(prim_bounds[*i].center());
+
+        // too deep or every center at the same place, split at the median of the longest axis
+        auto median = [&]() {
+            int axis = longest_axis(centroids);
+            int* mid = begin + node.count / 2;
+            std::nth_element(begin, mid, end, [&](int a, int b) {
+                return axis_of(prim_bounds[a].center(), axis) < axis_of(prim_bounds[b].center(), axis);
+            });
+            return node.count / 2;
+        };
+        if(depth >= BVH_MAX_SPLIT_DEPTH) return median();
+
+        ObjectSplit split = find_object_split(node.count, [&](int k) -> const AABB& { return prim_bounds[begin[k]]; }, centroids);
+        if(split.axis == -1) return median();
+        // the same bin formula as the search, so every primitive goes to the side it was counted on
+        int* mid = std::partition(begin, end, [&](int i) { return split.bin(prim_bounds[i].center()) < split.split; });
+        return mid - begin;
+    }
+
+    // SBVH works on references, a primitive or the part of it inside a box
+    struct Reference {
+        AABB box;
+        int prim = 0;
+    };
+    static bool is_empty(const AABB& b) {
+        return b.min.x > b.max.x or b.min.y > b.max.y or b.min.z > b.max.z;
+    }
+    static void set_axis(Vec3& v, int axis, float value) {
+        if(axis == 0) v.x = value;
+        else if(axis == 1) v.y = value;
+        else v.z = value;
+    }
+    // the box of the part of a reference between `from` and `to` on `axis`, empty if there is none
+    // with `vertices` the triangle itself is clipped, otherwise only its box
+    static AABB clip_reference(const Reference& ref, int axis, float from, float to, const std::vector<Vec3>* vertices) {
+        AABB out;
+        if(vertices != nullptr) {
+            // the corners inside the slab and where the edges cross its planes
+            const Vec3* v = vertices->data() + 3 * ref.prim;
+            for(int j = 0; j < 3; j++) {
+                Vec3 a = v[j], b = v[(j + 1) % 3];
+                float pa = axis_of(a, axis), pb = axis_of(b, axis);
+                if(pa >= from and pa <= to) out.grow(a);
+                for(float plane: {from, to})
+                    if((pa - plane) * (pb - plane) < 0) out.grow(a + (b - a) * ((plane - pa) / (pb - pa)));
+            }
+            if(is_empty(out)) return out;
+        }
+        else out = ref.box;
+        // the reference may have been clipped on other axes before
+        out.min = Vec3(fmax(out.min.x, ref.box.min.x), fmax(out.min.y, ref.box.min.y), fmax(out.min.z, ref.box.min.z));
+        out.max = Vec3(fmin(out.max.x, ref.box.max.x), fmin(out.max.y, ref.box.max.y), fmin(out.max.z, ref.box.max.z));
+        set_axis(out.min, axis, fmax(axis_of(out.min, axis), from));
+        set_axis(out.max, axis, fmin(axis_of(out.max, axis), to));
+        return out;
+    }
+
+    // the cheapest plane through the references, which are cut in two where they cross it
+    struct SpatialSplit {
+        float cost = INFINITY;
+        int axis = -1;
+        float position = 0;
+        // references that would end up on each side, crossing ones on both
+        int left_count = 0;
+        int right_count = 0;
+        AABB left, right;
+    };
+    SpatialSplit find_spatial_split(const std::vector<Reference>& refs, const AABB& node_box, const std::vector<Vec3>* vertices) const {
+        struct Bin {
+            AABB box;
+            // references starting and ending in this bin
+            int entry = 0;
+            int exit = 0;
+        };
+        SpatialSplit best;
+        int bin_count = std::max(2, std::min(settings.bins, BVH_MAX_BINS));
+        for(int axis = 0; axis < 3; axis++) {
+            float from = axis_of(node_box.min, axis);
+            float extent = axis_of(node_box.max, axis) - from;
+            if(extent <= 0) continue;
+            float width = extent / bin_count;
+            auto bin_of = [&](float p) {
+                return std::max(0, std::min((int)((p - from) / width), bin_count - 1));
+            };
+
+            Bin bins[BVH_MAX_BINS];
+            for(const Reference& ref: refs) {
+                int first = bin_of(axis_of(ref.box.min, axis));
+                int last = std::max(first, bin_of(axis_of(ref.box.max, axis)));
+                for(int k = first; k <= last; k++) {
+                    AABB part = first == last ? ref.box
+                              : clip_reference(ref, axis, from + k * width, k == bin_count - 1 ? from + extent : from + (k + 1) * width, vertices);
+                    if(!is_empty(part)) bins[k].box.grow(part);
+                }
+                bins[first].entry++;
+                bins[last].exit++;
+            }
+            AABB right_box[BVH_MAX_BINS];
+            int right_count[BVH_MAX_BINS];
+            AABB box;
+            int n = 0;
+            for(int k = bin_count - 1; k > 0; k--) {
+                if(!is_empty(bins[k].box)) box.grow(bins[k].box);
+                n += bins[k].exit;
+                right_box[k] = box;
+                right_count[k] = n;
+            }
+            box = AABB();
+            n = 0;
+            for(int k = 1; k < bin_count; k++) {
+                if(!is_empty(bins[k - 1].box)) box.grow(bins[k - 1].box);
+                n += bins[k - 1].entry;
+                if(n == 0 or right_count[k] == 0) continue;
+                float cost = n * box.surface_area() + right_count[k] * right_box[k].surface_area();
+                if(cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.position = from + k * width;
+                    best.left_count = n;
+                    best.right_count = right_count[k];
+                    best.left = box;
+                    best.right = right_box[k];
+                }
+            }
+        }
+        return best;
+    }
+
+    // SBVH: like the SAH builder, but where the children of the best split would overlap a node may
+    // also be cut by a plane, the primitives crossing it go to both sides clipped to their part
+    // so long or slanted triangles stop blowing up the boxes. `settings.spatial_budget` limits
+    // the extra references. the lists grow, so this builds depth first into new lists, on this thread
+    void build_sbvh(const std::vector<AABB>& prim_bounds, const std::vector<Vec3>* vertices) {
+        int n = prim_bounds.size();
+        int budget = n + (int)(n * fmaxf(settings.spatial_budget, 0));
+        int references = n;
+        float root_area = 0;
+
+        struct Task {
+            int node;
+            int depth;
+            std::vector<Reference> refs;
+        };
+        std::vector<Task> stack(1);
+        stack[0].node = 0;
+        stack[0].depth = 0;
+        stack[0].refs.resize(n);
+        for(int i = 0; i < n; i++) {
+            stack[0].refs[i].box = prim_bounds[i];
+            stack[0].refs[i].prim = i;
+        }
+        prim_indices.reserve(n);
+        nodes.push_back(BVHNode());
+
+        while(!stack.empty()) {
+            Task task = std::move(stack.back());
+            stack.pop_back();
+            std::vector<Reference>& refs = task.refs;
+            int count = refs.size();
+            AABB box, centroids;
+            for(const Reference& ref: refs) {
+                box.grow(ref.box);
+                centroids.grow(ref.box.center());
+            }
+            nodes[task.node].box_min = box.min;
+            nodes[task.node].box_max = box.max;
+            if(task.node == 0) root_area = box.surface_area();
+
+            if(count <= BVH_MAX_LEAF_SIZE) {
+                nodes[task.node].first = prim_indices.size();
+                nodes[task.node].count = count;
+                for(const Reference& ref: refs) prim_indices.push_back(ref.prim);
+                continue;
+            }
+
+            std::vector<Reference> left, right;
+            bool deep = task.depth >= BVH_MAX_SPLIT_DEPTH;
+            ObjectSplit object;
+            if(!deep) object = find_object_split(count, [&](int k) -> const AABB& { return refs[k].box; }, centroids);
+
+            // only where the object split leaves overlapping children, and while there is budget
+            AABB overlap;
+            if(object.axis != -1) {
+                overlap.min = Vec3(fmax(object.left.min.x, object.right.min.x), fmax(object.left.min.y, object.right.min.y), fmax(object.left.min.z, object.right.min.z));
+                overlap.max = Vec3(fmin(object.left.max.x, object.right.max.x), fmin(object.left.max.y, object.right.max.y), fmin(object.left.max.z, object.right.max.z));
+            }
+            bool overlapping = object.axis == -1 or (!is_empty(overlap) and overlap.surface_area() > BVH_SPATIAL_SPLIT_ALPHA * root_area);
+            if(!deep and references < budget and overlapping) {
+                SpatialSplit spatial = find_spatial_split(refs, box, vertices);
+                int extra = spatial.left_count + spatial.right_count - count;
+                if(spatial.axis != -1 and spatial.cost < object.cost and references + extra <= budget) {
+                    int axis = spatial.axis;
+                    float plane = spatial.position;
+                    float left_area = spatial.left.surface_area(), right_area = spatial.right.surface_area();
+                    float split_cost = spatial.left_count * left_area + spatial.right_count * right_area;
+                    for(const Reference& ref: refs) {
+                        float from = axis_of(ref.box.min, axis), to = axis_of(ref.box.max, axis);
+                        if(to <= plane) {
+                            left.push_back(ref);
+                            continue;
+                        }
+                        if(from >= plane) {
+                            right.push_back(ref);
+                            continue;
+                        }
+                        // a crossing reference stays whole on one side if growing that side costs less than cutting it
+                        AABB grown_left = spatial.left, grown_right = spatial.right;
+                        grown_left.grow(ref.box);
+                        grown_right.grow(ref.box);
+                        float left_cost = spatial.left_count * grown_left.surface_area() + (spatial.right_count - 1) * right_area;
+                        float right_cost = (spatial.left_count - 1) * left_area + spatial.right_count * grown_right.surface_area();
+                        if(left_cost < split_cost and left_cost <= right_cost) left.push_back(ref);
+                        else if(right_cost < split_cost) right.push_back(ref);
+                        else {
+                            // a part too thin to survive the clipping goes to one side whole
+                            Reference l = ref, r = ref;
+                            l.box = clip_reference(ref, axis, from, plane, vertices);
+                            r.box = clip_reference(ref, axis, plane, to, vertices);
+                            if(!is_empty(l.box)) left.push_back(l);
+                            if(!is_empty(r.box)) right.push_back(r);
+                            if(is_empty(l.box) and is_empty(r.box)) left.push_back(ref);
+                        }
+                    }
+                    if(left.empty() or right.empty()) {
+                        left.clear();
+                        right.clear();
+                    }
+                    else references += left.size() + right.size() - count;
+                }
+            }
+
+            if(left.empty()) {
+                if(object.axis != -1) {
+                    for(const Reference& ref: refs)
+                        (object.bin(ref.box.center()) < object.split ? left : right).push_back(ref);
+                }
+                else {
+                    int axis = longest_axis(centroids);
+                    std::nth_element(refs.begin(), refs.begin() + count / 2, refs.end(), [&](const Reference& a, const Reference& b) {
+                        return axis_of(a.box.center(), axis) < axis_of(b.box.center(), axis);
+                    });
+                    left.assign(refs.begin(), refs.begin() + count / 2);
+                    right.assign(refs.begin() + count / 2, refs.end());
+                }
+            }
+            refs = std::vector<Reference>();
+
+            int left_index = nodes.size();
+            nodes[task.node].first = left_index;
+            nodes[task.node].count = 0;
+            nodes.push_back(BVHNode());
+            nodes.push_back(BVHNode());
+            // the left child is taken first, like the other builders
+            stack.push_back({left_index + 1, task.depth + 1, std::move(right)});
+            stack.push_back({left_index, task.depth + 1, std::move(left)});
+        }
+    }
+
+    // split the nodes of the subtree rooted at out[0], which holds its primitive range, depth first
+    // big nodes are built as tasks into their own list and put in at the end,
+    // so every child still comes after its parent and siblings stay next to each other
+    void build_subtree(const std::vector<AABB>& prim_bounds, const std::vector<uint32_t>& morton,
+                       std::vector<BVHNode>& out, int root_depth) {
+        struct Subtree {
+            int node;
+            std::future<std::vector<BVHNode>> nodes;
+        };
+        std::vector<Subtree> subtrees;
+
+        // (node index, depth)
+        std::vector<std::pair<int, int>> stack = {{0, root_depth}};
+        while(!stack.empty()) {
+            auto [index, depth] = stack.back();
+            stack.pop_back();
+            BVHNode node = out[index];
+            if(node.count <= BVH_MAX_LEAF_SIZE) continue;
+
+            if(index != 0 and settings.pool != nullptr and node.count >= BVH_TASK_MIN_PRIMS) {
+                subtrees.push_back({index, settings.pool->submit([this, node, depth, &prim_bounds, &morton]() {
+                    std::vector<BVHNode> sub = {node};
+                    build_subtree(prim_bounds, morton, sub, depth);
+                    return sub;
+                })});
+                continue;
+            }
+
+            int left_count = settings.mode == BVH_BUILD_LBVH ? split_morton(node, depth, morton) : split_sah(node, depth, prim_bounds);
+            BVHNode left, right;
+            left.first = node.first;
+            left.count = left_count;
+            right.first = node.first + left.count;
+            right.count = node.count - left.count;
+            if(settings.mode == BVH_BUILD_SAH) {
+                set_bounds(left, prim_bounds);
+                set_bounds(right, prim_bounds);
+            }
+
+            int left_index = out.size();
+            out.push_back(left);
+            out.push_back(right);
+            out[index].first = left_index;
+            out[index].count = 0;
+
+            stack.push_back({left_index, depth + 1});
+            stack.push_back({left_index + 1, depth + 1});
+        }
+
+        for(Subtree& subtree: subtrees) {
+            std::vector<BVHNode> sub = settings.pool->wait(subtree.nodes);
+            // the root of the subtree takes the place of its node, the rest goes at the end
+            int base = out.size();
+            auto place = [&](BVHNode n) {
+                if(n.count == 0) n.first = base + n.first - 1;
+                return n;
+            };
+            for(int k = 1; k < (int)sub.size(); k++) out.push_back(place(sub[k]));
+            out[subtree.node] = place(sub[0]);
+        }
+    }
+public:
+    // nodes[0] is the root
+    std::vector<BVHNode> nodes;
+    // leaves point into this list, which points into the primitive list
+    std::vector<int> prim_indices;
+    // cost() right after the last build, to tell how much refits made the tree worse
+    float built_cost = 0;
+    double build_ms = 0;
+    BVHBuildSettings settings;
+
+    bool empty() const {
+        return nodes.empty();
+    }
+    void clear() {
+        nodes.clear();
+        prim_indices.clear();
+        built_cost = 0;
+        build_ms = 0;
+    }
+
+    // expected cost of a ray through the root with the surface area heuristic, lower is better
+    // relative to the root box so moving or scaling the whole tree does not change it
+    float cost() const {
+        if(nodes.empty()) return 0;
+        float total = 0;
+        for(const BVHNode& node: nodes) total += node_cost(node);
+        float root = node_area(nodes[0]);
+        return root > 0 ? total / root : 0;
+    }
+
+    // build the tree from the bounding box of every primitive, the way `settings` says
+    // `vertices` has the 3 corners of every primitive if they are triangles, SBVH clips them
+    // where they cross a split, without them it can only clip their boxes
+    void build(const std::vector<AABB>& prim_bounds, const std::vector<Vec3>* vertices = nullptr) {
+        auto start = std::chrono::steady_clock::now();
+        clear();
+        int n = prim_bounds.size();
+        if(n == 0) return;
+
+        if(settings.mode == BVH_BUILD_SBVH) {
+            build_sbvh(prim_bounds, vertices);
+            built_cost = cost();
+            build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return;
+        }
+        prim_indices.resize(n);
+        for(int i = 0; i < n; i++) prim_indices[i] = i;
+        std::vector<uint32_t> morton;
+        if(settings.mode == BVH_BUILD_LBVH) sort_morton(prim_bounds, morton);
+
+        nodes.reserve(2 * n / BVH_MAX_LEAF_SIZE + 1);
+        BVHNode root;
+        root.first = 0;
+        root.count = n;
+        if(settings.mode == BVH_BUILD_SAH) set_bounds(root, prim_bounds);
+        nodes.push_back(root);
+        build_subtree(prim_bounds, morton, nodes, 0);
+
+        // the LBVH builder only made the structure
+        if(settings.mode == BVH_BUILD_LBVH) built_cost = refit(prim_bounds);
+        else built_cost = cost();
+        build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    BVHStats stats() const {
+        BVHStats s;
+        s.mode = settings.mode;
+        s.nodes = nodes.size();
+        s.sah_cost = cost();
+        s.build_ms = build_ms;
+        // parents come before their children, so depths are known going forward
+        std::vector<int> depth(nodes.size(), 0);
+        int leaf_prims = 0;
+        for(int i = 0; i < (int)nodes.size(); i++) {
+            s.max_depth = std::max(s.max_depth, depth[i]);
+            if(nodes[i].count > 0) {
+                s.leaves++;
+                leaf_prims += nodes[i].count;
+                continue;
+            }
+            depth[nodes[i].first] = depth[nodes[i].first + 1] = depth[i] + 1;
+        }
+        s.average_leaf_size = s.leaves > 0 ? (float)leaf_prims / s.leaves : 0;
+        s.references = prim_indices.size();
+        return s;
+    }
+
+    // whether a tree read from somewhere else is safe to walk over `prim_count` primitives
+    // children come after their parent and inside the node list, leaves inside prim_indices,
+    // every index below prim_count and no path deeper than the traversal stack
+    bool valid(int prim_count) const {
+        int node_count = nodes.size();
+        std::vector<int> depth(node_count, 0);
+        for(int i = 0; i < node_count; i++) {
+            const BVHNode& node = nodes[i];
+            if(node.count < 0 or node.first < 0) return false;
+            if(node.count > 0) {
+                if((int64_t)node.first + node.count > (int64_t)prim_indices.size()) return false;
+                continue;
+            }
+            if(node.first <= i or node.first >= node_count - 1) return false;
+            depth[node.first] = depth[node.first + 1] = depth[i] + 1;
+            if(depth[i] + 2 >= BVH_STACK_SIZE) return false;
+        }
+        for(int prim: prim_indices)
+            if(prim < 0 or prim >= prim_count) return false;
+        return true;
+    }
+
+    // update the boxes after the primitives moved, keeping the tree structure, returns the new cost()
+    // children are always stored after their parent so one backward pass is enough
+    // the leaves of a SBVH get the whole boxes of their primitives back, which is still right but slower
+    float refit(const std::vector<AABB>& prim_bounds) {
+        float total = 0;
+        for(int i = nodes.size() - 1; i >= 0; i--) {
+            BVHNode& node = nodes[i];
+            if(node.count > 0) {
+                set_bounds(node, prim_bounds);
+                total += node_cost(node);
+                continue;
+            }
+            const BVHNode& left = nodes[node.first];
+            const BVHNode& right = nodes[node.first + 1];
+            node.box_min = Vec3(fmin(left.box_min.x, right.box_min.x), fmin(left.box_min.y, right.box_min.y), fmin(left.box_min.z, right.box_min.z));
+            node.box_max = Vec3(fmax(left.box_max.x, right.box_max.x), fmax(left.box_max.y, right.box_max.y), fmax(left.box_max.z, right.box_max.z));
+            total += node_cost(node);
+        }
+        float root = nodes.empty() ? 0 : node_area(nodes[0]);
+        return root > 0 ? total / root : 0;
+    }
+    // refit, and build again if that made the tree too slow (a rotated part of a mesh has
+    // much bigger boxes than a new split would give), returns true if it was built again
+    bool update(const std::vector<AABB>& prim_bounds) {
+        float c = refit(prim_bounds);
+        if(built_cost <= 0) built_cost = c;
+        if(c <= built_cost * BVH_REBUILD_RATIO) return false;
+        build(prim_bounds);
+        return true;
+    }
+};
+
+#endif
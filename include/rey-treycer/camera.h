@@ -5,10 +5,59 @@
 #include "ray.h"
 #include "rng.h"
 
+// everything needed to map between pixels and the world for one camera pose
+// taken with Camera::state(), only valid for the pinhole part of the camera (no aperture)
+struct CameraState {
+    Vec3 position = VEC3_ZERO;
+    Vec3 right = VEC3_ZERO;
+    Vec3 up = VEC3_ZERO;
+    Vec3 look = VEC3_ZERO;
+    float focal_length = 1;
+    int width = 0;
+    int height = 0;
+
+    bool operator==(const CameraState& s) const {
+        return position.x == s.position.x and position.y == s.position.y and position.z == s.position.z
+           and right.x == s.right.x and right.y == s.right.y and right.z == s.right.z
+           and up.x == s.up.x and up.y == s.up.y and up.z == s.up.z
+           and look.x == s.look.x and look.y == s.look.y and look.z == s.look.z
+           and focal_length == s.focal_length and width == s.width and height == s.height;
+    }
+    bool operator!=(const CameraState& s) const {
+        return !(*this == s);
+    }
+
+    // direction of the primary ray through pixel (x, y), same as Camera::init() makes
+    Vec3 pixel_direction(float x, float y) {
+        float sx = (x - 0.5f) / width - 0.5f;
+        float sy = (float)height / width * (0.5f - (y - 0.5f) / height);
+        return (right * sx + up * sy + look * focal_length).normalize();
+    }
+    // a world point in camera space: x right, y up, z depth
+    Vec3 to_camera_space(Vec3 p) {
+        Vec3 d = p - position;
+        return Vec3(d.dot(right), d.dot(up), d.dot(look));
+    }
+    // a direction in camera space, for things infinitely far away like the sky
+    Vec3 direction_to_camera_space(Vec3 d) {
+        return Vec3(d.dot(right), d.dot(up), d.dot(look));
+    }
+    // where a point in camera space (with z > 0) lands on the screen, the inverse of pixel_direction()
+    void to_screen(Vec3 v, float* x, float* y) {
+        float iz = 1 / v.z;
+        *x = (v.x * focal_length * iz + 0.5f) * width + 0.5f;
+        *y = 0.5f * height - v.y * focal_length * iz * width + 0.5f;
+    }
+};
+
 class Camera {
 private:
     // a vector to store pixels position in world to calculate ray directions
     std::vector<std::vector<Vec3>> pixel_in_world;
+    // the angle a single pixel covers, the spread of the ray cone
+    float pixel_spread_angle = 0;
+    // distance from the eye to the viewport of width 1
+    float focal_length = 1;
 public:
     Vec3 position = VEC3_ZERO;
 
@@ -62,6 +111,7 @@ public:
         new_ray.direction = direction;
         new_ray.origin = origin;
         new_ray.max_range = max_range;
+        new_ray.cone_spread = pixel_spread_angle;
 
         return new_ray;
     }
@@ -74,6 +124,8 @@ public:
         float viewport_width = 1;
         float viewport_height = (float)HEIGHT/(float)WIDTH;
         float f = 0.5f / tan(deg2rad(FOV/2));
+        focal_length = f;
+        pixel_spread_angle = viewport_width / (f * WIDTH);
 
         for(int x = 0; x < WIDTH; x++)
             for(int y = 0; y < HEIGHT; y++) {
@@ -84,6 +136,21 @@ public:
             }
     }
 
+    float get_focal_length() {
+        return focal_length;
+    }
+    CameraState state() {
+        CameraState s;
+        s.position = position;
+        s.right = get_right_direction();
+        s.up = get_up_direction();
+        s.look = get_looking_direction();
+        s.focal_length = focal_length;
+        s.width = WIDTH;
+        s.height = HEIGHT;
+        return s;
+    }
+
     void tilt(float a) {
         // clamp tilted_angle to [-max_tilt, max_tilt]
         float old_tilted_angle = tilted_angle;
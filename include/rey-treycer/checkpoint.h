@@ -0,0 +1,42 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+
+#include "camera.h"
+
+// checkpoints: the accumulation state of a progressive render in one binary file
+// written by ReyTreycer::save_checkpoint(), a render loaded with load_checkpoint() continues
+// as if it was never stopped
+
+const uint32_t CHECKPOINT_VERSION = 3;
+
+// file layout: header, then width * height of each of color, sample_count, luminance_m2,
+// albedo, normal, depth and object_id, pixel (x, y) at x + y * width
+// numbers are stored in the byte order of the machine that wrote it
+struct CheckpointHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    int32_t rendered_count;
+    int32_t ray_per_pixel;
+    // seeds the random numbers of the next frame together with ReyTreycer::random_seed
+    uint64_t frame_index;
+    uint64_t random_seed;
+    // frame_index of the first frame after the last restart
+    uint64_t first_frame;
+    float noise_estimate;
+    // the scene the samples belong to, a checkpoint is only loaded into the same view of the same scene
+    // see ReyTreycer::scene_hash()
+    uint64_t scene_hash;
+    CameraState camera;
+};
+
+// bytes of a checkpoint of width x height
+inline uint64_t checkpoint_size(int width, int height) {
+    // color, albedo and normal are Vec3, the rest 4 bytes per pixel
+    return sizeof(CheckpointHeader) + (uint64_t)width * height * (3 * sizeof(Vec3) + 4 * 4);
+}
+
+#endif
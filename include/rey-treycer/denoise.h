@@ -0,0 +1,177 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include "constant.h"
+
+// auxiliary buffers written next to the color, from the first hit of every pixel
+// stored row by row, pixel (x, y) is at x + y * width
+struct AOVBuffers {
+    int width = 0;
+    int height = 0;
+    // texture color of the first hit, the sky color if nothing was hit
+    std::vector<Vec3> albedo;
+    // normal of the first hit, the backward ray direction if nothing was hit
+    std::vector<Vec3> normal;
+    // distance to the first hit, 0 if nothing was hit
+    std::vector<float> depth;
+    // index of the first hit object in ReyTreycer::objects, -1 if nothing was hit
+    std::vector<int> object_id;
+
+    // only grows so changing the viewport back and forth does not reallocate
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        if((int)depth.size() < w * h) {
+            albedo.resize(w * h, VEC3_ZERO);
+            normal.resize(w * h, VEC3_ZERO);
+            depth.resize(w * h, 0);
+            object_id.resize(w * h, -1);
+        }
+    }
+};
+
+struct DenoiseSettings {
+    // each pass doubles the filter step, 5 passes cover 61x61 pixels
+    int iterations = 5;
+    // how much the (tonemapped) brightness may differ, halved every pass
+    float sigma_color = 0.6f;
+    // how much normals may differ, 1 - cos of the angle
+    float sigma_normal = 0.1f;
+    // how much depth may differ per pixel of step, relative to the depth
+    float sigma_depth = 0.05f;
+};
+
+// edge-avoiding à-trous wavelet filter
+// the color is divided by the albedo so only the lighting is blurred, texture detail is kept
+// neighbours are weighted down by differences in brightness, normal and depth
+// and ignored if they belong to another object
+class Denoiser {
+private:
+    int width = 0, height = 0;
+    // lighting being filtered and the result of the current pass, one plane per channel
+    std::vector<float> r, g, b, next_r, next_g, next_b;
+    // brightness used for the color weight, recomputed each pass
+    std::vector<float> edge;
+    std::vector<float> nx, ny, nz, depth, inv_depth_scale;
+    std::vector<int> object_id;
+
+    // add one tap of the kernel to the sums of a row, for pixels p0 + x and their neighbours q0 + x
+    // the sums are __restrict so the compiler knows they do not overlap the inputs and vectorizes the loop
+    void filter_tap(int p0, int q0, int from_x, int to_x, float k, float inv_color, float inv_normal,
+                    float* __restrict sum_r, float* __restrict sum_g, float* __restrict sum_b, float* __restrict sum_w) {
+        const float *in_r = r.data(), *in_g = g.data(), *in_b = b.data(), *e = edge.data();
+        const float *n_x = nx.data(), *n_y = ny.data(), *n_z = nz.data();
+        const float *z = depth.data(), *z_scale = inv_depth_scale.data();
+        const int* id = object_id.data();
+        for(int x = from_x; x < to_x; x++) {
+            int p = p0 + x, q = q0 + x;
+            float dc = e[p] - e[q];
+            float dn = 1 - (n_x[p] * n_x[q] + n_y[p] * n_y[q] + n_z[p] * n_z[q]);
+            float dz = fabsf(z[p] - z[q]) * z_scale[p];
+            float w = k * expf(-(dc * dc * inv_color + fmaxf(dn, 0) * inv_normal + dz));
+            w = id[p] == id[q] ? w : 0;
+            sum_r[x] += w * in_r[q];
+            sum_g[x] += w * in_g[q];
+            sum_b[x] += w * in_b[q];
+            sum_w[x] += w;
+        }
+    }
+
+    void filter_rows(int from_y, int to_y, int step, float sigma_color, float sigma_normal) {
+        const float kernel[5] = {1 / 16.0f, 1 / 4.0f, 3 / 8.0f, 1 / 4.0f, 1 / 16.0f};
+        const float inv_color = 1 / (sigma_color * sigma_color);
+        const float inv_normal = 1 / sigma_normal;
+        std::vector<float> sum_r(width), sum_g(width), sum_b(width), sum_w(width);
+
+        for(int y = from_y; y < to_y; y++) {
+            std::fill(sum_r.begin(), sum_r.end(), 0);
+            std::fill(sum_g.begin(), sum_g.end(), 0);
+            std::fill(sum_b.begin(), sum_b.end(), 0);
+            std::fill(sum_w.begin(), sum_w.end(), 0);
+
+            for(int ty = 0; ty < 5; ty++) {
+                int yy = y + (ty - 2) * step;
+                if(yy < 0 or yy >= height) continue;
+                for(int tx = 0; tx < 5; tx++) {
+                    int dx = (tx - 2) * step;
+                    // only the pixels whose neighbour is inside the image, so the loop is straight
+                    filter_tap(y * width, yy * width + dx, std::max(0, -dx), std::min(width, width - dx),
+                               kernel[tx] * kernel[ty], inv_color, inv_normal,
+                               sum_r.data(), sum_g.data(), sum_b.data(), sum_w.data());
+                }
+            }
+            // the center always has weight, so sum_w is never 0
+            for(int x = 0; x < width; x++) {
+                float inv = 1 / sum_w[x];
+                next_r[y * width + x] = sum_r[x] * inv;
+                next_g[y * width + x] = sum_g[x] * inv;
+                next_b[y * width + x] = sum_b[x] * inv;
+            }
+        }
+    }
+public:
+    // denoise `color` (indexed [x][y] like ReyTreycer::screen_color) into `out`
+    void run(const std::vector<std::vector<Vec3>>& color, const AOVBuffers& aov,
+             std::vector<std::vector<Vec3>>& out, DenoiseSettings settings, int thread_count = 1) {
+        width = aov.width;
+        height = aov.height;
+        int n = width * height;
+        for(std::vector<float>* v: {&r, &g, &b, &next_r, &next_g, &next_b, &edge, &nx, &ny, &nz, &depth, &inv_depth_scale})
+            v->resize(n);
+        object_id.resize(n);
+
+        // split off the albedo
+        for(int y = 0; y < height; y++)
+            for(int x = 0; x < width; x++) {
+                int p = x + y * width;
+                const Vec3& c = color[x][y];
+                const Vec3& a = aov.albedo[p];
+                r[p] = c.x / fmaxf(a.x, 1e-3f);
+                g[p] = c.y / fmaxf(a.y, 1e-3f);
+                b[p] = c.z / fmaxf(a.z, 1e-3f);
+                nx[p] = aov.normal[p].x;
+                ny[p] = aov.normal[p].y;
+                nz[p] = aov.normal[p].z;
+                depth[p] = aov.depth[p];
+                object_id[p] = aov.object_id[p];
+            }
+
+        if(thread_count < 1) thread_count = 1;
+        for(int i = 0; i < settings.iterations; i++) {
+            int step = 1 << i;
+            for(int p = 0; p < n; p++) {
+                float l = 0.2126f * r[p] + 0.7152f * g[p] + 0.0722f * b[p];
+                edge[p] = l / (1 + l);
+                inv_depth_scale[p] = 1 / (settings.sigma_depth * step * depth[p] + 1e-4f);
+            }
+
+            float sigma_color = settings.sigma_color / (1 << i);
+            int rows = (height + thread_count - 1) / thread_count;
+            std::vector<std::thread> threads;
+            for(int t = 1; t < thread_count; t++)
+                threads.push_back(std::thread(&Denoiser::filter_rows, this,
+                                              std::min(t * rows, height), std::min((t + 1) * rows, height),
+                                              step, sigma_color, settings.sigma_normal));
+            filter_rows(0, std::min(rows, height), step, sigma_color, settings.sigma_normal);
+            for(std::thread& t: threads) t.join();
+
+            r.swap(next_r);
+            g.swap(next_g);
+            b.swap(next_b);
+        }
+
+        // put the albedo back
+        for(int y = 0; y < height; y++)
+            for(int x = 0; x < width; x++) {
+                int p = x + y * width;
+                const Vec3& a = aov.albedo[p];
+                out[x][y] = Vec3(r[p] * fmaxf(a.x, 1e-3f), g[p] * fmaxf(a.y, 1e-3f), b[p] * fmaxf(a.z, 1e-3f));
+            }
+    }
+};
+
+#endif
@@ -0,0 +1,451 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "rey-treycer.h"
+
+// rendering one image with many processes, on one machine or many, over tcp
+// a RenderCoordinator splits the image into tiles and the frames into batches and hands them out to
+// the workers that connect. run_render_worker() renders them with ReyTreycer::render_region() and sends
+// the partial buffers back, which are added up into the result. workers ask for the next item by
+// sending the result of the last one, so fast workers simply get more of them
+//
+// every message is a MessageHeader followed by `size` bytes
+//   worker -> coordinator  MESSAGE_HELLO   job_key() of the scene the worker loaded
+//   coordinator -> worker  MESSAGE_WORK    a WorkItem
+//   worker -> coordinator  MESSAGE_RESULT  the id of the item, then PartialBuffer::to_bytes()
+//   coordinator -> worker  MESSAGE_DONE    nothing left, the worker disconnects
+//   coordinator -> worker  MESSAGE_REJECTED the worker has a different scene
+// numbers are in the byte order of the machine, every machine of a job needs the same one
+// posix sockets only
+
+enum MESSAGE_TYPE {
+    MESSAGE_HELLO = 1,
+    MESSAGE_WORK = 2,
+    MESSAGE_RESULT = 3,
+    MESSAGE_DONE = 4,
+    MESSAGE_REJECTED = 5,
+};
+
+struct MessageHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t size;
+};
+// a bigger message is a broken or foreign connection
+const uint64_t MAX_MESSAGE_SIZE = 1ull << 31;
+
+// pixels (x, y, width, height) for frames first_frame .. first_frame + frames - 1
+struct WorkItem {
+    uint64_t id;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    uint64_t first_frame;
+    int32_t frames;
+    int32_t reserved;
+};
+
+struct DistributedSettings {
+    // the image is handed out in square tiles of this size
+    int tile_size = 64;
+    // frames first_frame .. first_frame + frames - 1, handed out frames_per_batch at a time
+    uint64_t first_frame = 0;
+    int frames = 100;
+    int frames_per_batch = 10;
+    // a worker that does not send a result for this long is dropped and its item handed out again
+    double worker_timeout = 600;
+    // once nothing is left, idle workers also take the items that are running longest,
+    // the first result counts. one slow machine then cannot hold up the end of the job
+    bool backup_items = true;
+};
+
+struct DistributedProgress {
+    int items_done = 0;
+    int items_total = 0;
+    // connected workers and those that were lost or timed out
+    int workers = 0;
+    int workers_failed = 0;
+    // workers that loaded a different scene
+    int workers_rejected = 0;
+    double seconds = 0;
+    // estimated seconds until the job is done, 0 until the first item is done
+    double seconds_left = 0;
+};
+
+// a hash of what the samples of a render depend on, workers and coordinator must agree on it
+// the size, samples per pixel and random seed, and everything ReyTreycer::scene_hash() covers
+inline uint64_t job_key(ReyTreycer& rt) {
+    uint64_t values[5] = {(uint64_t)rt.WIDTH, (uint64_t)rt.HEIGHT, (uint64_t)rt.camera.ray_per_pixel,
+                          rt.random_seed, rt.scene_hash()};
+    return hash_bytes((const char*)values, sizeof(values));
+}
+
+#ifndef _WIN32
+
+// send all of `data`, false if the connection is gone
+inline bool send_all(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while(size > 0) {
+        ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+        if(sent <= 0) return false;
+        p += sent;
+        size -= sent;
+    }
+    return true;
+}
+// receive exactly `size` bytes, false if the connection is gone
+inline bool receive_all(int fd, void* data, size_t size) {
+    char* p = (char*)data;
+    while(size > 0) {
+        ssize_t got = recv(fd, p, size, 0);
+        if(got <= 0) return false;
+        p += got;
+        size -= got;
+    }
+    return true;
+}
+inline bool send_message(int fd, uint32_t type, const void* data, size_t size, const void* more = nullptr, size_t more_size = 0) {
+    MessageHeader header = {type, 0, size + more_size};
+    return send_all(fd, &header, sizeof(header)) and send_all(fd, data, size) and send_all(fd, more, more_size);
+}
+
+class RenderCoordinator {
+private:
+    struct Connection {
+        int fd = -1;
+        // bytes received and not handled yet
+        std::string in;
+        bool greeted = false;
+        // the item being rendered, -1 when idle
+        int item = -1;
+        double since = 0;
+    };
+    struct Item {
+        WorkItem work;
+        bool done = false;
+        // workers rendering it, more than one for backups
+        int running = 0;
+        double started = 0;
+    };
+
+    int listen_fd = -1;
+    int bound_port = 0;
+    std::vector<Connection> connections;
+    std::vector<Item> items;
+    std::deque<int> pending;
+    DistributedProgress progress;
+    DistributedSettings settings;
+    uint64_t key = 0;
+    std::chrono::steady_clock::time_point start;
+    std::atomic<bool> stopping{false};
+
+    double now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    void report() {
+        progress.seconds = now();
+        progress.workers = 0;
+        for(Connection& c: connections)
+            progress.workers += c.greeted;
+        progress.seconds_left = progress.items_done == 0 ? 0
+                              : progress.seconds * (progress.items_total - progress.items_done) / progress.items_done;
+        if(on_progress) on_progress(progress);
+    }
+
+    // give `c` the next item, a backup of a running one, or nothing while others are still running
+    void assign(Connection& c) {
+        while(!pending.empty() and items[pending.front()].done)
+            pending.pop_front();
+        int next = -1;
+        if(!pending.empty()) {
+            next = pending.front();
+            pending.pop_front();
+        }
+        else if(settings.backup_items) {
+            // the item running longest that nobody is backing up yet
+            for(int i = 0; i < (int)items.size(); i++)
+                if(!items[i].done and items[i].running == 1 and (next < 0 or items[i].started < items[next].started))
+                    next = i;
+        }
+        if(next < 0) return;
+
+        if(items[next].running == 0) items[next].started = now();
+        items[next].running++;
+        c.item = next;
+        c.since = now();
+        if(!send_message(c.fd, MESSAGE_WORK, &items[next].work, sizeof(WorkItem))) drop(c, true);
+    }
+    // close `c`, its item goes back to the queue unless someone else still renders it
+    void drop(Connection& c, bool failed) {
+        if(c.fd < 0) return;
+        if(c.item >= 0) {
+            Item& item = items[c.item];
+            item.running--;
+            if(!item.done and item.running == 0) pending.push_front(c.item);
+            c.item = -1;
+        }
+        if(failed and c.greeted) progress.workers_failed++;
+        close(c.fd);
+        c.fd = -1;
+        report();
+    }
+    // handle every complete message `c` has received
+    void handle(Connection& c) {
+        while(c.fd >= 0 and c.in.size() >= sizeof(MessageHeader)) {
+            MessageHeader header;
+            memcpy(&header, c.in.data(), sizeof(header));
+            if(header.size > MAX_MESSAGE_SIZE) return drop(c, true);
+            if(c.in.size() < sizeof(header) + header.size) return;
+            const char* data = c.in.data() + sizeof(header);
+
+            if(header.type == MESSAGE_HELLO and !c.greeted) {
+                uint64_t worker_key = 0;
+                if(header.size == 8) memcpy(&worker_key, data, 8);
+                if(worker_key != key) {
+                    progress.workers_rejected++;
+                    send_message(c.fd, MESSAGE_REJECTED, nullptr, 0);
+                    return drop(c, false);
+                }
+                c.greeted = true;
+                report();
+                assign(c);
+            }
+            else if(header.type == MESSAGE_RESULT and c.greeted and c.item >= 0 and header.size >= 8) {
+                uint64_t id;
+                memcpy(&id, data, 8);
+                PartialBuffer part;
+                Item& item = items[c.item];
+                if(id != item.work.id or !part.from_bytes(data + 8, header.size - 8)
+                   or part.x != item.work.x or part.y != item.work.y
+                   or part.width != item.work.width or part.height != item.work.height)
+                    return drop(c, true);
+                item.running--;
+                c.item = -1;
+                // a backup that finished second is thrown away
+                if(!item.done) {
+                    add_partial(result, part);
+                    item.done = true;
+                    progress.items_done++;
+                    report();
+                }
+            }
+            else return drop(c, true);
+
+            c.in.erase(0, sizeof(header) + header.size);
+            if(c.fd >= 0 and c.item < 0 and c.greeted) assign(c);
+        }
+    }
+public:
+    // everything the workers sent so far, the whole image once run() returned true
+    PartialBuffer result;
+    // called on the thread of run() whenever an item is done or a worker comes or goes
+    std::function<void(const DistributedProgress&)> on_progress;
+
+    RenderCoordinator() {}
+    RenderCoordinator(const RenderCoordinator&) = delete;
+    RenderCoordinator& operator=(const RenderCoordinator&) = delete;
+    ~RenderCoordinator() {
+        for(Connection& c: connections)
+            if(c.fd >= 0) close(c.fd);
+        if(listen_fd >= 0) close(listen_fd);
+    }
+
+    // accept workers on `port` (0 picks a free one, see port()), false if it is taken
+    bool listen(int port) {
+        listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
+        if(listen_fd < 0) return false;
+        int yes = 1, no = 0;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        // ipv4 workers too
+        setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+        sockaddr_in6 address;
+        memset(&address, 0, sizeof(address));
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(port);
+        if(bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0 or ::listen(listen_fd, 64) != 0) {
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+        socklen_t size = sizeof(address);
+        getsockname(listen_fd, (sockaddr*)&address, &size);
+        bound_port = ntohs(address.sin6_port);
+        return true;
+    }
+    int port() {
+        return bound_port;
+    }
+    // make run() return false soon, safe from any thread
+    void stop() {
+        stopping = true;
+    }
+
+    // hand out the image of `rt` (its size, camera, ray_per_pixel and seed) until every item is done
+    // the workers must have loaded the same scene, see job_key(). returns false if stopped
+    bool run(ReyTreycer& rt, DistributedSettings settings) {
+        if(listen_fd < 0) return false;
+        this->settings = settings;
+        key = job_key(rt);
+        start = std::chrono::steady_clock::now();
+        progress = DistributedProgress();
+
+        result = PartialBuffer();
+        result.image_width = rt.WIDTH;
+        result.image_height = rt.HEIGHT;
+        result.ray_per_pixel = rt.camera.ray_per_pixel;
+        result.first_frame = settings.first_frame;
+        result.end_frame = settings.first_frame;
+        result.resize(rt.WIDTH, rt.HEIGHT);
+
+        // batch after batch, so the whole image gets samples early on
+        items.clear();
+        pending.clear();
+        int size = std::max(settings.tile_size, 1), batch = std::max(settings.frames_per_batch, 1);
+        for(int frame = 0; frame < settings.frames; frame += batch)
+            for(int y = 0; y < rt.HEIGHT; y += size)
+                for(int x = 0; x < rt.WIDTH; x += size) {
+                    Item item;
+                    item.work = {(uint64_t)items.size(), x, y, std::min(size, rt.WIDTH - x), std::min(size, rt.HEIGHT - y),
+                                 settings.first_frame + frame, std::min(batch, settings.frames - frame), 0};
+                    pending.push_back(items.size());
+                    items.push_back(item);
+                }
+        progress.items_total = items.size();
+
+        char buffer[1 << 16];
+        while(progress.items_done < progress.items_total and !stopping) {
+            std::vector<pollfd> fds = {{listen_fd, POLLIN, 0}};
+            for(Connection& c: connections)
+                fds.push_back({c.fd, POLLIN, 0});
+            poll(fds.data(), fds.size(), 100);
+
+            for(int i = 1; i < (int)fds.size(); i++) {
+                Connection& c = connections[i - 1];
+                if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                ssize_t got = recv(c.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if(got <= 0) drop(c, true);
+                else {
+                    c.in.append(buffer, got);
+                    handle(c);
+                }
+            }
+            // workers that stopped answering, and idle ones that can take requeued items
+            for(Connection& c: connections) {
+                if(c.fd >= 0 and c.item >= 0 and now() - c.since > settings.worker_timeout) drop(c, true);
+                if(c.fd >= 0 and c.item < 0 and c.greeted) assign(c);
+            }
+            connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                             [](const Connection& c) { return c.fd < 0; }), connections.end());
+
+            if(fds[0].revents & POLLIN) {
+                Connection c;
+                c.fd = accept(listen_fd, nullptr, nullptr);
+                if(c.fd >= 0) {
+                    int yes = 1;
+                    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                    c.since = now();
+                    connections.push_back(c);
+                }
+            }
+        }
+
+        // tell everyone, workers still on a backup send one more result before they read it.
+        // closing with that result unread would reset the connection and lose the DONE, so wait
+        // a little for the workers to hang up first
+        std::vector<pollfd> fds;
+        for(Connection& c: connections) {
+            send_message(c.fd, MESSAGE_DONE, nullptr, 0);
+            shutdown(c.fd, SHUT_WR);
+            fds.push_back({c.fd, POLLIN, 0});
+        }
+        double deadline = now() + std::min(settings.worker_timeout, 10.0);
+        int open = fds.size();
+        while(open > 0 and now() < deadline) {
+            poll(fds.data(), fds.size(), 100);
+            for(pollfd& f: fds)
+                if(f.fd >= 0 and (f.revents & (POLLIN | POLLHUP | POLLERR)) and recv(f.fd, buffer, sizeof(buffer), MSG_DONTWAIT) <= 0) {
+                    f.fd = -1;
+                    open--;
+                }
+        }
+        for(Connection& c: connections)
+            close(c.fd);
+        connections.clear();
+        return progress.items_done == progress.items_total;
+    }
+};
+
+// connect to the coordinator on host:port and render what it hands out until it says it is done
+// `rt` must hold the same scene as the coordinator's. returns false if the connection
+// failed or was lost before that, with the reason in `error`
+inline bool run_render_worker(ReyTreycer& rt, std::string host, int port, std::string* error = nullptr) {
+    auto fail = [error](std::string reason) {
+        if(error != nullptr) *error = reason;
+        return false;
+    };
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if(getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+        return fail("cannot resolve " + host);
+    int fd = -1;
+    for(addrinfo* a = addresses; a != nullptr and fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if(fd >= 0 and connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if(fd < 0) return fail("cannot connect to " + host + ':' + std::to_string(port));
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    uint64_t key = job_key(rt);
+    bool ok = send_message(fd, MESSAGE_HELLO, &key, sizeof(key));
+    while(ok) {
+        MessageHeader header;
+        if(!receive_all(fd, &header, sizeof(header))) break;
+        if(header.type == MESSAGE_DONE or header.type == MESSAGE_REJECTED) {
+            close(fd);
+            return header.type == MESSAGE_DONE or fail("the coordinator renders a different scene");
+        }
+        WorkItem work;
+        if(header.type != MESSAGE_WORK or header.size != sizeof(work) or !receive_all(fd, &work, sizeof(work))) break;
+
+        RenderRegion region;
+        region.x = work.x;
+        region.y = work.y;
+        region.width = work.width;
+        region.height = work.height;
+        std::string bytes = rt.render_region(region, work.first_frame, work.frames).to_bytes();
+        ok = send_message(fd, MESSAGE_RESULT, &work.id, sizeof(work.id), bytes.data(), bytes.size());
+    }
+    close(fd);
+    return fail("lost the connection to the coordinator");
+}
+
+#endif
+
+#endif
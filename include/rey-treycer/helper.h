@@ -2,6 +2,7 @@
 #define HELPER_H
 
 #include "objects.h"
+#include "obj_loader.h"
 
 #include <fstream>
 #include <iostream>
@@ -37,14 +38,29 @@ inline std::vector<int> get_dividers(int a) {
     return dividers;
 }
 
-// TODO: add more tonemapping methods
 enum TONEMAPPING {
     TONEMAP_RGB_CLAMPING = 0,
+    TONEMAP_REINHARD = 1,
+    TONEMAP_ACES = 2,
 };
+// per channel curves, postprocess.h runs them over whole images
+inline float tonemap_reinhard(float v) {
+    v = fmaxf(v, 0);
+    return v / (1 + v);
+}
+// Narkowicz's fit of the ACES filmic curve
+inline float tonemap_aces(float v) {
+    v = fmaxf(v, 0);
+    return fminf(v * (2.51f * v + 0.03f) / (v * (2.43f * v + 0.59f) + 0.14f), 1);
+}
 inline Vec3 tonemap(Vec3 v, int style) {
     switch(style) {
         case TONEMAP_RGB_CLAMPING:
             return Vec3(fmin(v.x, 1), fmin(v.y, 1), fmin(v.z, 1));
+        case TONEMAP_REINHARD:
+            return Vec3(tonemap_reinhard(v.x), tonemap_reinhard(v.y), tonemap_reinhard(v.z));
+        case TONEMAP_ACES:
+            return Vec3(tonemap_aces(v.x), tonemap_aces(v.y), tonemap_aces(v.z));
         default:
             return v;
     }
@@ -53,87 +69,41 @@ inline Vec3 gamma_correct(Vec3 color, float t) {
     return Vec3(pow(color.x, t), pow(color.y, t), pow(color.z, t));
 }
 
-// load a mesh from a *.obj file, simplified
-inline Mesh load_mesh_from(std::string filename) {
+// turn indexed buffers into the triangles of a mesh, with a BVH built the way `bvh_settings` says
+inline Mesh mesh_from_indexed(const IndexedMesh& m, const BVHBuildSettings& bvh_settings = BVHBuildSettings()) {
     Mesh out;
-
-    std::ifstream f(filename);
-    if (!f.is_open()) {
-        std::cout << "failed to load file\n";
-        return out;
-    }
-
-    bool has_texture = false;
-
-    // local cache of verts
-    std::vector<Vec3> verts;
-    std::vector<Vec3> texs;
-
-    while (!f.eof()) {
-        char line[128];
-        f.getline(line, 128);
-
-        std::stringstream s;
-        s << line;
-        char junk;
-
-        if (line[0] == 'v') {
-            Vec3 v = VEC3_ZERO;
-            if(line[1] == 't') {
-                has_texture = true;
-                s >> junk >> junk >> v.x >> v.y;
-                v.x = 1 - v.x;
-                v.y = 1 - v.y;
-                texs.push_back(v);
-            }
-            else {
-                s >> junk >> v.x >> v.y >> v.z;
-                verts.push_back(v);
-            }
-        }
-        else if(line[0] == 'f') {
-            if(has_texture) {
-                s >> junk;
-
-                std::string tokens[6];
-                int nTokenCount = -1;
-
-                while (!s.eof()) {
-                    char c = s.get();
-                    if (c == ' ' || c == '/')
-                        nTokenCount++;
-                    else
-                        tokens[nTokenCount].append(1, c);
-                }
-
-                tokens[nTokenCount].pop_back();
-
-                Triangle tri;
-                tri.vert[0] = verts[std::stoi(tokens[0]) - 1];
-                tri.vert[1] = verts[std::stoi(tokens[2]) - 1];
-                tri.vert[2] = verts[std::stoi(tokens[4]) - 1];
-
-                tri.vert_texture[0] = texs[std::stoi(tokens[1]) - 1];
-                tri.vert_texture[1] = texs[std::stoi(tokens[3]) - 1];
-                tri.vert_texture[2] = texs[std::stoi(tokens[5]) - 1];
-                out.default_tris.push_back(tri);
-                out.tris.push_back(tri);
-            }
-            else {
-                int f[3];
-                s >> junk >> f[0] >> f[1] >> f[2];
-                Triangle tri;
-                tri.vert[0] = verts[f[0] - 1];
-                tri.vert[1] = verts[f[1] - 1];
-                tri.vert[2] = verts[f[2] - 1];
-                out.default_tris.push_back(tri);
-                out.tris.push_back(tri);
+    out.bvh.settings = bvh_settings;
+
+    int tri_count = m.indices.size() / 3;
+    out.tris.resize(tri_count);
+    for(int i = 0; i < tri_count; i++) {
+        Triangle& tri = out.tris[i];
+        for(int j = 0; j < 3; j++) {
+            VertexIndex c = m.indices[i * 3 + j];
+            tri.vert[j] = m.positions[c.v];
+            if(c.vt != -1) {
+                Vec3 vt = m.uvs[c.vt];
+                tri.vert_texture[j] = Vec3(1 - vt.x, 1 - vt.y, 0);
             }
         }
     }
+    out.default_tris = out.tris;
 
     out.calculate_AABB();
+    // the pool may be gone by the time the tree is built again
+    out.bvh.settings.pool = nullptr;
     return out;
 }
 
+// load a mesh from a *.obj file
+// see `load_obj()` in obj_loader.h for the supported syntax
+inline Mesh load_mesh_from(std::string filename, int thread_count = 1, const BVHBuildSettings& bvh_settings = BVHBuildSettings()) {
+    IndexedMesh m;
+    if(!load_obj(filename, m, thread_count)) {
+        std::cout << "failed to load file\n";
+        return Mesh();
+    }
+    return mesh_from_indexed(m, bvh_settings);
+}
+
 #endif
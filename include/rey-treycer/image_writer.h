@@ -0,0 +1,313 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "postprocess.h"
+
+// writing images a tile at a time, so a finished tile can go to disk right away
+// and the whole image never has to be converted in memory
+//
+//   PFMWriter   float rgb, any tile order, a tile can be written again
+//   EXRWriter   uncompressed float OpenEXR scanlines, any tile order, a tile can be written again
+//   PNGWriter   8 bit through a PostProcessor, rows are flushed as soon as every row above is complete,
+//               every pixel must be written exactly once
+//
+// numbers are written in the byte order of the machine, both float formats expect little endian
+// every writer can be called from several threads at once
+
+class TileSink {
+public:
+    virtual ~TileSink() {}
+    // create the file for an image of width x height, false if it cannot be written
+    virtual bool begin(std::string filename, int width, int height) = 0;
+    // write the rectangle (x, y, w, h) of `colors`, indexed [x][y] like ReyTreycer::screen_color
+    virtual void write_tile(const std::vector<std::vector<Vec3>>& colors, int x, int y, int w, int h) = 0;
+    // finish and close the file, false if anything failed
+    virtual bool finish() = 0;
+    // true if tiles can come in any order and more than once
+    virtual bool random_access() = 0;
+};
+
+// base of the float formats, the file is laid out once and tiles are written at their offsets
+class RandomAccessImageWriter : public TileSink {
+protected:
+    std::fstream file;
+    std::mutex mutex;
+    int width = 0, height = 0;
+    bool failed = false;
+
+    // lay out the file: write the header and grow the file to its final size
+    bool create(std::string filename, const std::string& header, uint64_t size) {
+        file.open(filename, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+        if(!file.is_open()) return false;
+        file.write(header.data(), header.size());
+        file.seekp(size - 1);
+        file.put(0);
+        failed = !file.good();
+        return !failed;
+    }
+    void write_at(uint64_t offset, const void* data, size_t size) {
+        file.seekp(offset);
+        file.write((const char*)data, size);
+        if(!file.good()) failed = true;
+    }
+public:
+    bool finish() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!file.is_open()) return false;
+        file.flush();
+        bool ok = !failed and file.good();
+        file.close();
+        return ok;
+    }
+    bool random_access() override {
+        return true;
+    }
+};
+
+// portable float map, rgb floats stored bottom row first
+class PFMWriter : public RandomAccessImageWriter {
+private:
+    uint64_t data_offset = 0;
+public:
+    bool begin(std::string filename, int width, int height) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->width = width;
+        this->height = height;
+        // a negative scale means little endian
+        std::string header = "PF\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n-1.0\n";
+        data_offset = header.size();
+        return create(filename, header, data_offset + (uint64_t)width * height * 12);
+    }
+    void write_tile(const std::vector<std::vector<Vec3>>& colors, int x, int y, int w, int h) override {
+        std::vector<float> row(w * 3);
+        std::lock_guard<std::mutex> lock(mutex);
+        for(int j = y; j < y + h; j++) {
+            for(int i = 0; i < w; i++) {
+                const Vec3& c = colors[x + i][j];
+                row[i * 3] = c.x; row[i * 3 + 1] = c.y; row[i * 3 + 2] = c.z;
+            }
+            write_at(data_offset + ((uint64_t)(height - 1 - j) * width + x) * 12, row.data(), row.size() * 4);
+        }
+    }
+};
+
+// OpenEXR scanline image without compression, channels B, G, R as 32 bit floats
+// without compression every chunk is one scanline of the same size, so the offset table
+// is known before any pixel is written
+class EXRWriter : public RandomAccessImageWriter {
+private:
+    uint64_t chunks_offset = 0;
+    uint64_t chunk_size = 0;
+
+    template<class T>
+    static void put(std::string& s, T value) {
+        s.append((const char*)&value, sizeof(T));
+    }
+    static void attribute(std::string& s, const char* name, const char* type, const std::string& value) {
+        s.append(name, strlen(name) + 1);
+        s.append(type, strlen(type) + 1);
+        put<int32_t>(s, value.size());
+        s += value;
+    }
+public:
+    bool begin(std::string filename, int width, int height) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->width = width;
+        this->height = height;
+
+        std::string header;
+        put<int32_t>(header, 20000630);
+        // version 2, single part scanline file
+        put<int32_t>(header, 2);
+
+        // channels are sorted by name
+        std::string channels;
+        for(const char* name: {"B", "G", "R"}) {
+            channels.append(name, 2);
+            // FLOAT, not linear, 3 reserved bytes, x and y sampling
+            put<int32_t>(channels, 2);
+            put<int32_t>(channels, 0);
+            put<int32_t>(channels, 1);
+            put<int32_t>(channels, 1);
+        }
+        channels.push_back(0);
+        attribute(header, "channels", "chlist", channels);
+        attribute(header, "compression", "compression", std::string(1, 0));
+
+        std::string window;
+        put<int32_t>(window, 0); put<int32_t>(window, 0);
+        put<int32_t>(window, width - 1); put<int32_t>(window, height - 1);
+        attribute(header, "dataWindow", "box2i", window);
+        attribute(header, "displayWindow", "box2i", window);
+        // increasing y
+        attribute(header, "lineOrder", "lineOrder", std::string(1, 0));
+        std::string one, center;
+        put<float>(one, 1);
+        put<float>(center, 0); put<float>(center, 0);
+        attribute(header, "pixelAspectRatio", "float", one);
+        attribute(header, "screenWindowCenter", "v2f", center);
+        attribute(header, "screenWindowWidth", "float", one);
+        header.push_back(0);
+
+        // offset table, then every chunk is: y, size of the data, B, G and R of the scanline
+        chunks_offset = header.size() + (uint64_t)height * 8;
+        chunk_size = 8 + (uint64_t)width * 12;
+        for(int y = 0; y < height; y++)
+            put<uint64_t>(header, chunks_offset + y * chunk_size);
+        if(!create(filename, header, chunks_offset + height * chunk_size)) return false;
+
+        // the chunk headers, the pixels are filled in by the tiles
+        for(int y = 0; y < height; y++) {
+            int32_t chunk[2] = {y, (int32_t)(width * 12)};
+            write_at(chunks_offset + y * chunk_size, chunk, 8);
+        }
+        return !failed;
+    }
+    void write_tile(const std::vector<std::vector<Vec3>>& colors, int x, int y, int w, int h) override {
+        std::vector<float> b(w), g(w), r(w);
+        std::lock_guard<std::mutex> lock(mutex);
+        for(int j = y; j < y + h; j++) {
+            for(int i = 0; i < w; i++) {
+                const Vec3& c = colors[x + i][j];
+                b[i] = c.z; g[i] = c.y; r[i] = c.x;
+            }
+            uint64_t line = chunks_offset + j * chunk_size + 8 + (uint64_t)x * 4;
+            write_at(line, b.data(), w * 4);
+            write_at(line + width * 4, g.data(), w * 4);
+            write_at(line + width * 8, r.data(), w * 4);
+        }
+    }
+};
+
+// 8 bit rgb png, compressed with stored (uncompressed) deflate blocks so rows can be written
+// as they become complete without keeping the image around
+class PNGWriter : public TileSink {
+private:
+    std::ofstream file;
+    std::mutex mutex;
+    int width = 0, height = 0;
+    bool failed = false;
+    // rows that are not complete or not flushed yet, with the number of pixels written into them
+    std::map<int, std::vector<unsigned char>> rows;
+    std::map<int, int> row_pixels;
+    int next_row = 0;
+    uint32_t adler_a = 1, adler_b = 0;
+    uint32_t crc_table[256];
+
+    uint32_t crc(const std::string& data) {
+        uint32_t c = 0xffffffffu;
+        for(unsigned char byte: data) c = crc_table[(c ^ byte) & 0xff] ^ (c >> 8);
+        return c ^ 0xffffffffu;
+    }
+    static void put_be32(std::string& s, uint32_t v) {
+        for(int shift = 24; shift >= 0; shift -= 8) s.push_back((char)(v >> shift));
+    }
+    // `data` starts with the 4 byte chunk type
+    void write_chunk(const std::string& data) {
+        std::string length, check;
+        put_be32(length, data.size() - 4);
+        put_be32(check, crc(data));
+        file << length << data << check;
+        if(!file.good()) failed = true;
+    }
+    // flush the complete rows at the top as one IDAT chunk of stored deflate blocks
+    void flush_rows() {
+        std::string data = "IDAT";
+        std::string raw;
+        while(next_row < height and row_pixels[next_row] == width) {
+            raw.push_back(0); // no filter
+            raw.append((const char*)rows[next_row].data(), width * 3);
+            rows.erase(next_row);
+            row_pixels.erase(next_row);
+            next_row++;
+        }
+        if(raw.empty()) return;
+        for(unsigned char byte: raw) {
+            adler_a = (adler_a + byte) % 65521;
+            adler_b = (adler_b + adler_a) % 65521;
+        }
+        for(size_t start = 0; start < raw.size(); start += 65535) {
+            uint16_t size = std::min<size_t>(65535, raw.size() - start);
+            bool last = next_row == height and start + size == raw.size();
+            data.push_back(last);
+            data.push_back(size & 0xff); data.push_back(size >> 8);
+            data.push_back(~size & 0xff); data.push_back((uint16_t)~size >> 8);
+            data.append(raw, start, size);
+        }
+        write_chunk(data);
+    }
+public:
+    // tonemapping and encoding of the pixels, set before begin()
+    PostProcessor post;
+
+    PNGWriter() {
+        for(uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for(int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            crc_table[n] = c;
+        }
+    }
+
+    bool begin(std::string filename, int width, int height) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->width = width;
+        this->height = height;
+        rows.clear();
+        row_pixels.clear();
+        next_row = 0;
+        adler_a = 1; adler_b = 0;
+        failed = false;
+        // build the table now so the threads writing tiles only read it
+        post.prepare();
+
+        file.open(filename, std::ios::binary | std::ios::trunc);
+        if(!file.is_open()) return false;
+        file << "\x89PNG\r\n\x1a\n";
+        std::string header = "IHDR";
+        put_be32(header, width);
+        put_be32(header, height);
+        // 8 bit rgb, deflate, no filter choice, not interlaced
+        header += std::string("\x08\x02\x00\x00\x00", 5);
+        write_chunk(header);
+        // zlib header: deflate with a 32K window, no dictionary
+        write_chunk(std::string("IDAT\x78\x01", 6));
+        return !failed;
+    }
+    void write_tile(const std::vector<std::vector<Vec3>>& colors, int x, int y, int w, int h) override {
+        std::vector<unsigned char> pixels(w * h * 3);
+        post.convert(colors, x, y, w, h, pixels.data(), w * 3, PIXEL_RGB8);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for(int j = 0; j < h; j++) {
+            std::vector<unsigned char>& row = rows[y + j];
+            if(row.empty()) row.resize(width * 3);
+            memcpy(row.data() + x * 3, pixels.data() + j * w * 3, w * 3);
+            row_pixels[y + j] += w;
+        }
+        flush_rows();
+    }
+    bool finish() override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!file.is_open()) return false;
+        bool complete = next_row == height;
+        std::string check = "IDAT";
+        put_be32(check, adler_b << 16 | adler_a);
+        write_chunk(check);
+        write_chunk("IEND");
+        file.close();
+        return complete and !failed;
+    }
+    bool random_access() override {
+        return false;
+    }
+};
+
+#endif
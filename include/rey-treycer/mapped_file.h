@@ -0,0 +1,114 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// a read only view of a whole file
+// on posix systems the file is memory-mapped so pages are only read when touched
+// elsewhere the file is simply read into memory
+class MappedFile {
+private:
+    const char* mapped = nullptr;
+    size_t mapped_size = 0;
+    // used when mmap is not available or the file is empty
+    std::vector<char> buffer;
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(std::string filename) {
+        close();
+#ifndef _WIN32
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        mapped_size = st.st_size;
+        if(mapped_size > 0) {
+            void* p = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p == MAP_FAILED) {
+                ::close(fd);
+                mapped_size = 0;
+                return false;
+            }
+            mapped = (const char*)p;
+        }
+        // the mapping stays valid after closing the descriptor
+        ::close(fd);
+        return true;
+#else
+        std::ifstream f(filename, std::ios::binary | std::ios::ate);
+        if(!f.is_open()) return false;
+        buffer.resize(f.tellg());
+        f.seekg(0);
+        f.read(buffer.data(), buffer.size());
+        return true;
+#endif
+    }
+    void close() {
+#ifndef _WIN32
+        if(mapped != nullptr)
+            munmap((void*)mapped, mapped_size);
+#endif
+        mapped = nullptr;
+        mapped_size = 0;
+        buffer.clear();
+    }
+
+    const char* data() const {
+        return mapped != nullptr ? mapped : buffer.data();
+    }
+    size_t size() const {
+        return mapped != nullptr ? mapped_size : buffer.size();
+    }
+    bool is_open() const {
+        return mapped != nullptr or !buffer.empty();
+    }
+};
+
+// 64 bit FNV-1a, fed 8 bytes at a time
+inline uint64_t hash_bytes(const char* data, size_t size) {
+    uint64_t h = 14695981039346656037ull;
+    size_t i = 0;
+    for(; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 1099511628211ull;
+    }
+    for(; i < size; i++)
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+    return h;
+}
+
+// a name next to `filename` to write a file into before renaming it over `filename`
+// unique per process and call, so writers that build the same file at once never share one
+inline std::string temporary_name(std::string filename) {
+    static thread_local std::mt19937_64 rng(std::random_device{}());
+    std::string suffix = std::to_string(rng());
+#ifndef _WIN32
+    suffix = std::to_string(getpid()) + "." + suffix;
+#endif
+    return filename + "." + suffix + ".tmp";
+}
+
+#endif
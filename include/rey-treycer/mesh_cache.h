@@ -0,0 +1,192 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "helper.h"
+#include "mapped_file.h"
+
+// compiled meshes: everything load_mesh_from() would compute from an *.obj file
+// (indexed buffers, triangles and their BVH) stored in one binary file next to the source
+// later loads map that file instead of parsing and building anything
+
+const uint32_t COMPILED_MESH_VERSION = 2;
+
+// file layout: header, then the arrays in the order of their counts
+struct CompiledMeshHeader {
+    char magic[4];
+    uint32_t version;
+    // hash and size of the *.obj file this was compiled from
+    uint64_t source_hash;
+    uint64_t source_size;
+    uint64_t position_count;
+    uint64_t uv_count;
+    uint64_t normal_count;
+    uint64_t index_count;
+    uint64_t triangle_count;
+    uint64_t node_count;
+    uint64_t prim_index_count;
+    // BVH_BUILD_MODE of the tree, a cache of the other mode is compiled again
+    uint32_t bvh_mode;
+    uint32_t reserved;
+};
+// a triangle without its material pointer
+struct CompiledTriangle {
+    Vec3 vert[3] = {VEC3_ZERO, VEC3_ZERO, VEC3_ZERO};
+    Vec3 vert_texture[3] = {VEC3_ZERO, VEC3_ZERO, VEC3_ZERO};
+};
+
+// write a compiled mesh, the mesh must have its triangles in the loaded (untransformed) state
+inline bool write_compiled_mesh(std::string filename, uint64_t source_hash, uint64_t source_size,
+                                const IndexedMesh& indexed, Mesh& mesh) {
+    CompiledMeshHeader header;
+    memcpy(header.magic, "RTMC", 4);
+    header.version = COMPILED_MESH_VERSION;
+    header.source_hash = source_hash;
+    header.source_size = source_size;
+    header.position_count = indexed.positions.size();
+    header.uv_count = indexed.uvs.size();
+    header.normal_count = indexed.normals.size();
+    header.index_count = indexed.indices.size();
+    header.triangle_count = mesh.tris.size();
+    header.node_count = mesh.bvh.nodes.size();
+    header.prim_index_count = mesh.bvh.prim_indices.size();
+    header.bvh_mode = mesh.bvh.settings.mode;
+    header.reserved = 0;
+
+    std::vector<CompiledTriangle> tris(mesh.tris.size());
+    for(int i = 0; i < (int)tris.size(); i++)
+        for(int j = 0; j < 3; j++) {
+            tris[i].vert[j] = mesh.tris[i].vert[j];
+            tris[i].vert_texture[j] = mesh.tris[i].vert_texture[j];
+        }
+
+    // write to a temporary file first so a crash never leaves a broken cache behind
+    std::string tmp_name = temporary_name(filename);
+    std::ofstream f(tmp_name, std::ios::binary);
+    if(!f.is_open()) return false;
+    f.write((const char*)&header, sizeof(header));
+    f.write((const char*)indexed.positions.data(), indexed.positions.size() * sizeof(Vec3));
+    f.write((const char*)indexed.uvs.data(), indexed.uvs.size() * sizeof(Vec3));
+    f.write((const char*)indexed.normals.data(), indexed.normals.size() * sizeof(Vec3));
+    f.write((const char*)indexed.indices.data(), indexed.indices.size() * sizeof(VertexIndex));
+    f.write((const char*)tris.data(), tris.size() * sizeof(CompiledTriangle));
+    f.write((const char*)mesh.bvh.nodes.data(), mesh.bvh.nodes.size() * sizeof(BVHNode));
+    f.write((const char*)mesh.bvh.prim_indices.data(), mesh.bvh.prim_indices.size() * sizeof(int));
+    f.close();
+    if(!f.good() or std::rename(tmp_name.c_str(), filename.c_str()) != 0) {
+        std::remove(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+// read a compiled mesh, returns false if it is missing, outdated, does not belong to the source
+// or has a tree of another mode than `bvh_settings`
+inline bool read_compiled_mesh(std::string filename, uint64_t source_hash, uint64_t source_size,
+                               Mesh& mesh, IndexedMesh* indexed = nullptr,
+                               const BVHBuildSettings& bvh_settings = BVHBuildSettings()) {
+    MappedFile file;
+    if(!file.open(filename) or file.size() < sizeof(CompiledMeshHeader)) return false;
+
+    CompiledMeshHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if(memcmp(header.magic, "RTMC", 4) != 0 or header.version != COMPILED_MESH_VERSION
+       or header.source_hash != source_hash or header.source_size != source_size
+       or header.bvh_mode != (uint32_t)bvh_settings.mode)
+        return false;
+
+    size_t expected = sizeof(header)
+                    + (header.position_count + header.uv_count + header.normal_count) * sizeof(Vec3)
+                    + header.index_count * sizeof(VertexIndex)
+                    + header.triangle_count * sizeof(CompiledTriangle)
+                    + header.node_count * sizeof(BVHNode)
+                    + header.prim_index_count * sizeof(int);
+    if(file.size() != expected) return false;
+
+    const char* p = file.data() + sizeof(header);
+    // fill is only there because Vec3 has no default constructor
+    auto read_array = [&p](auto& out, uint64_t count, auto fill) {
+        out.resize(count, fill);
+        if(count > 0) memcpy((void*)out.data(), p, count * sizeof(out[0]));
+        p += count * sizeof(out[0]);
+    };
+
+    IndexedMesh m;
+    read_array(m.positions, header.position_count, VEC3_ZERO);
+    read_array(m.uvs, header.uv_count, VEC3_ZERO);
+    read_array(m.normals, header.normal_count, VEC3_ZERO);
+    read_array(m.indices, header.index_count, VertexIndex());
+    if(indexed != nullptr) *indexed = std::move(m);
+
+    const CompiledTriangle* tris = (const CompiledTriangle*)p;
+    p += header.triangle_count * sizeof(CompiledTriangle);
+    mesh.tris.resize(header.triangle_count);
+    for(int i = 0; i < (int)header.triangle_count; i++) {
+        CompiledTriangle t;
+        memcpy((void*)&t, tris + i, sizeof(t));
+        for(int j = 0; j < 3; j++) {
+            mesh.tris[i].vert[j] = t.vert[j];
+            mesh.tris[i].vert_texture[j] = t.vert_texture[j];
+        }
+    }
+    mesh.default_tris = mesh.tris;
+
+    read_array(mesh.bvh.nodes, header.node_count, BVHNode());
+    read_array(mesh.bvh.prim_indices, header.prim_index_count, 0);
+    // the hash only covers the source, a damaged cache must not send traversal out of bounds
+    if(!mesh.bvh.valid(header.triangle_count)) {
+        mesh = Mesh();
+        return false;
+    }
+    mesh.bvh.settings = bvh_settings;
+    mesh.bvh.settings.pool = nullptr;
+    mesh.bvh.built_cost = mesh.bvh.cost();
+
+    // the root box is the mesh box
+    AABB box;
+    for(const Triangle& tri: mesh.tris)
+        for(int j = 0; j < 3; j++) box.grow(tri.vert[j]);
+    mesh.AABB_min = box.min;
+    mesh.AABB_max = box.max;
+    // the boxes and the tree match the triangles already
+    mesh.dirty &= ~DIRTY_BOUNDS;
+    return true;
+}
+
+// load a mesh from a *.obj file through its compiled cache `<filename>.<mode>.rtmesh`, e.g. model.obj.sah.rtmesh
+// every BVH mode has a cache of its own, so using one model with several modes does not rewrite them
+// the cache is (re)written whenever it is missing or the content of the source changed
+// `bvh_settings` are also used for later rebuilds
+inline Mesh load_compiled_mesh(std::string filename, IndexedMesh* indexed = nullptr, int thread_count = 1,
+                               const BVHBuildSettings& bvh_settings = BVHBuildSettings()) {
+    Mesh out;
+
+    MappedFile source;
+    if(!source.open(filename)) {
+        std::cout << "failed to load file\n";
+        return out;
+    }
+    uint64_t source_size = source.size();
+    uint64_t source_hash = hash_bytes(source.data(), source.size());
+    source.close();
+
+    std::string cache_name = filename + "." + bvh_mode_name(bvh_settings.mode) + ".rtmesh";
+    if(read_compiled_mesh(cache_name, source_hash, source_size, out, indexed, bvh_settings))
+        return out;
+
+    IndexedMesh m;
+    if(!load_obj(filename, m, thread_count)) {
+        std::cout << "failed to load file\n";
+        return out;
+    }
+    out = mesh_from_indexed(m, bvh_settings);
+    write_compiled_mesh(cache_name, source_hash, source_size, m, out);
+    if(indexed != nullptr) *indexed = std::move(m);
+    return out;
+}
+
+#endif
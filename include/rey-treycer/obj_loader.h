@@ -0,0 +1,213 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include <charconv>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "constant.h"
+#include "mapped_file.h"
+
+// a mesh as it is stored in an *.obj file: shared vertex data and per corner indices
+struct VertexIndex {
+    // 0 based indices, -1 if the corner does not have that attribute
+    int v = -1;
+    int vt = -1;
+    int vn = -1;
+};
+struct IndexedMesh {
+    std::vector<Vec3> positions;
+    // texture coordinates in x and y, being Vec3 because im lazy to implement Vec2
+    std::vector<Vec3> uvs;
+    std::vector<Vec3> normals;
+    // 3 corners per triangle, polygons are triangulated as fans
+    std::vector<VertexIndex> indices;
+};
+
+// the result of parsing one part of the file
+struct ObjChunk {
+    IndexedMesh mesh;
+    // corners using negative (relative) indices, they need the vertex counts of the previous chunks
+    // stored as (corner index, attribute) with attribute 0: v, 1: vt, 2: vn
+    std::vector<std::pair<int, int>> relative;
+};
+
+inline const char* obj_skip_spaces(const char* p, const char* end) {
+    while(p < end and (*p == ' ' or *p == '\t' or *p == '\r')) p++;
+    return p;
+}
+inline const char* obj_parse_float(const char* p, const char* end, float* out) {
+    p = obj_skip_spaces(p, end);
+    if(p < end and *p == '+') p++;
+    auto res = std::from_chars(p, end, *out);
+    if(res.ec != std::errc()) *out = 0;
+    return res.ptr;
+}
+
+// parse the lines in [begin, end), begin must be at the start of a line
+inline void parse_obj_chunk(const char* begin, const char* end, ObjChunk& chunk) {
+    IndexedMesh& m = chunk.mesh;
+    // corners of the current face before triangulation
+    std::vector<VertexIndex> face;
+    std::vector<int> face_relative;
+
+    const char* p = begin;
+    while(p < end) {
+        const char* line_end = p;
+        while(line_end < end and *line_end != '\n') line_end++;
+
+        p = obj_skip_spaces(p, line_end);
+        if(p + 1 < line_end and p[0] == 'v' and (p[1] == ' ' or p[1] == '\t')) {
+            Vec3 v = VEC3_ZERO;
+            p = obj_parse_float(p + 1, line_end, &v.x);
+            p = obj_parse_float(p, line_end, &v.y);
+            p = obj_parse_float(p, line_end, &v.z);
+            m.positions.push_back(v);
+        }
+        else if(p + 2 < line_end and p[0] == 'v' and p[1] == 't') {
+            Vec3 v = VEC3_ZERO;
+            p = obj_parse_float(p + 2, line_end, &v.x);
+            p = obj_parse_float(p, line_end, &v.y);
+            m.uvs.push_back(v);
+        }
+        else if(p + 2 < line_end and p[0] == 'v' and p[1] == 'n') {
+            Vec3 v = VEC3_ZERO;
+            p = obj_parse_float(p + 2, line_end, &v.x);
+            p = obj_parse_float(p, line_end, &v.y);
+            p = obj_parse_float(p, line_end, &v.z);
+            m.normals.push_back(v);
+        }
+        else if(p + 1 < line_end and p[0] == 'f' and (p[1] == ' ' or p[1] == '\t')) {
+            face.clear();
+            face_relative.clear();
+            p++;
+            // each corner is v, v/vt, v//vn or v/vt/vn
+            while(true) {
+                p = obj_skip_spaces(p, line_end);
+                if(p >= line_end) break;
+
+                VertexIndex corner;
+                // bit a is set if attribute a uses a negative (relative) index
+                int relative_mask = 0;
+                int* attributes[3] = {&corner.v, &corner.vt, &corner.vn};
+                int counts[3] = {(int)m.positions.size(), (int)m.uvs.size(), (int)m.normals.size()};
+                for(int a = 0; a < 3; a++) {
+                    int idx = 0;
+                    auto res = std::from_chars(p, line_end, idx);
+                    if(res.ec == std::errc()) {
+                        p = res.ptr;
+                        // positive indices are 1 based, negative ones count back from the last vertex
+                        // the relative ones are fixed once the vertex counts of previous chunks are known
+                        if(idx > 0) *attributes[a] = idx - 1;
+                        else if(idx < 0) {
+                            *attributes[a] = counts[a] + idx;
+                            relative_mask |= 1 << a;
+                        }
+                    }
+                    if(p < line_end and *p == '/') p++;
+                    else break;
+                }
+                // skip garbage so a bad token can not stall the loop
+                while(p < line_end and *p != ' ' and *p != '\t' and *p != '\r') p++;
+
+                if(corner.v != -1 or (relative_mask & 1)) {
+                    face.push_back(corner);
+                    face_relative.push_back(relative_mask);
+                }
+            }
+            // fan triangulation
+            for(int i = 1; i + 1 < (int)face.size(); i++) {
+                int corners[3] = {0, i, i + 1};
+                for(int c: corners) {
+                    for(int a = 0; a < 3; a++)
+                        if(face_relative[c] & (1 << a))
+                            chunk.relative.push_back({(int)m.indices.size(), a});
+                    m.indices.push_back(face[c]);
+                }
+            }
+        }
+
+        p = line_end + 1;
+    }
+}
+
+// load an *.obj file into indexed buffers
+// the file is memory-mapped and cut into thread_count chunks at line boundaries that are parsed in parallel
+// returns false if the file can not be opened
+inline bool load_obj(std::string filename, IndexedMesh& out, int thread_count = 1) {
+    out = IndexedMesh();
+
+    MappedFile file;
+    if(!file.open(filename)) return false;
+    const char* data = file.data();
+    const char* end = data + file.size();
+
+    // small files are not worth the threads
+    if(file.size() < (1 << 20)) thread_count = 1;
+    if(thread_count < 1) thread_count = 1;
+
+    std::vector<const char*> bounds = {data};
+    for(int i = 1; i < thread_count; i++) {
+        const char* p = data + file.size() * i / thread_count;
+        if(p < bounds.back()) p = bounds.back();
+        while(p < end and *(p - 1) != '\n') p++;
+        bounds.push_back(p);
+    }
+    bounds.push_back(end);
+
+    std::vector<ObjChunk> chunks(thread_count);
+    if(thread_count == 1)
+        parse_obj_chunk(data, end, chunks[0]);
+    else {
+        std::vector<std::thread> threads;
+        for(int i = 0; i < thread_count; i++)
+            threads.push_back(std::thread(parse_obj_chunk, bounds[i], bounds[i + 1], std::ref(chunks[i])));
+        for(auto& t: threads) t.join();
+    }
+
+    // stitch the chunks together
+    size_t counts[4] = {0, 0, 0, 0};
+    for(ObjChunk& c: chunks) {
+        counts[0] += c.mesh.positions.size();
+        counts[1] += c.mesh.uvs.size();
+        counts[2] += c.mesh.normals.size();
+        counts[3] += c.mesh.indices.size();
+    }
+    out.positions.reserve(counts[0]);
+    out.uvs.reserve(counts[1]);
+    out.normals.reserve(counts[2]);
+    out.indices.reserve(counts[3]);
+
+    for(ObjChunk& c: chunks) {
+        int base[3] = {(int)out.positions.size(), (int)out.uvs.size(), (int)out.normals.size()};
+        for(auto& r: c.relative) {
+            VertexIndex& corner = c.mesh.indices[r.first];
+            int* attributes[3] = {&corner.v, &corner.vt, &corner.vn};
+            *attributes[r.second] += base[r.second];
+        }
+        out.positions.insert(out.positions.end(), c.mesh.positions.begin(), c.mesh.positions.end());
+        out.uvs.insert(out.uvs.end(), c.mesh.uvs.begin(), c.mesh.uvs.end());
+        out.normals.insert(out.normals.end(), c.mesh.normals.begin(), c.mesh.normals.end());
+        out.indices.insert(out.indices.end(), c.mesh.indices.begin(), c.mesh.indices.end());
+    }
+
+    // drop triangles that point outside of the buffers instead of crashing later
+    int n = 0;
+    for(int i = 0; i + 2 < (int)out.indices.size(); i += 3) {
+        bool valid = true;
+        for(int k = 0; k < 3; k++) {
+            VertexIndex c = out.indices[i + k];
+            if(c.v < 0 or c.v >= (int)out.positions.size()) valid = false;
+            if(c.vt >= (int)out.uvs.size() or c.vt < -1) valid = false;
+            if(c.vn >= (int)out.normals.size() or c.vn < -1) valid = false;
+        }
+        if(!valid) continue;
+        for(int k = 0; k < 3; k++) out.indices[n++] = out.indices[i + k];
+    }
+    out.indices.resize(n);
+
+    return true;
+}
+
+#endif
@@ -1,9 +1,13 @@
 #ifndef OBJECTS_H
 #define OBJECTS_H
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <vector>
 #include "transformation.h"
 #include "material.h"
+#include "bvh.h"
 
 class Triangle {
 public:
@@ -12,6 +16,183 @@ public:
     Vec3 vert_texture[3] = {VEC3_ZERO, VEC3_ZERO, VEC3_ZERO};
     Material* material;
 };
+
+// triangles per block of a TriangleArena, bigger meshes get a block of their own size
+const int TRIANGLE_BLOCK_SIZE = 4096;
+
+// storage for the triangles of many meshes, see Scene
+// meshes get contiguous ranges out of big blocks, a range never moves until reset()
+// triangles are never destroyed one by one, reset() only rewinds the blocks
+// not thread safe
+class TriangleArena {
+private:
+    struct Block {
+        std::unique_ptr<Triangle[]> triangles;
+        int size = 0;
+        int used = 0;
+    };
+    std::vector<Block> blocks;
+    // blocks before this one are full, or too full for the last range asked for
+    int current = 0;
+public:
+    TriangleArena() {}
+    TriangleArena(const TriangleArena&) = delete;
+    TriangleArena& operator=(const TriangleArena&) = delete;
+
+    // n contiguous triangles, valid until reset()
+    Triangle* allocate(int n) {
+        while(current < (int)blocks.size() and blocks[current].size - blocks[current].used < n)
+            current++;
+        if(current == (int)blocks.size()) {
+            Block block;
+            block.size = std::max(n, TRIANGLE_BLOCK_SIZE);
+            block.triangles.reset(new Triangle[block.size]);
+            blocks.push_back(std::move(block));
+        }
+        Block& block = blocks[current];
+        Triangle* range = block.triangles.get() + block.used;
+        block.used += n;
+        return range;
+    }
+    // forget every range but keep the blocks for the next ones
+    void reset() {
+        for(Block& block: blocks) block.used = 0;
+        current = 0;
+    }
+    // same as reset() but also give the memory back
+    void release() {
+        blocks.clear();
+        current = 0;
+    }
+};
+
+// the triangles of a mesh, used like a std::vector<Triangle>
+// a list bound to a TriangleArena (the meshes of a Scene) keeps its triangles in a range of it,
+// any other list in a vector of its own
+// assigning copies the triangles into wherever the assigned list keeps them
+class TriangleList {
+private:
+    TriangleArena* arena = nullptr;
+    std::vector<Triangle> storage;
+    Triangle* first = nullptr;
+    int count = 0;
+    int capacity = 0;
+
+    // make room for n triangles, the first `keep` ones stay
+    // a range of the arena that is outgrown is left behind until the arena is reset
+    void reserve(int n, int keep) {
+        if(arena == nullptr) {
+            storage.resize(n);
+            first = storage.data();
+        }
+        else if(n > capacity) {
+            Triangle* range = arena->allocate(n);
+            std::copy(first, first + keep, range);
+            first = range;
+            capacity = n;
+        }
+    }
+    void assign(const Triangle* triangles, int n) {
+        reserve(n, 0);
+        std::copy(triangles, triangles + n, first);
+        count = n;
+    }
+public:
+    TriangleList() {}
+    TriangleList(const TriangleList& l) {
+        assign(l.first, l.count);
+    }
+    TriangleList(TriangleList&& l): arena(l.arena), storage(std::move(l.storage)),
+                                    first(l.first), count(l.count), capacity(l.capacity) {
+        l.first = nullptr;
+        l.count = l.capacity = 0;
+    }
+    TriangleList& operator=(const TriangleList& l) {
+        if(this != &l) assign(l.first, l.count);
+        return *this;
+    }
+    TriangleList& operator=(TriangleList&& l) {
+        if(this == &l) return *this;
+        // two lists with their own vectors can just swap them
+        if(arena != nullptr or l.arena != nullptr) return *this = l;
+        storage = std::move(l.storage);
+        first = l.first;
+        count = l.count;
+        capacity = l.capacity;
+        l.first = nullptr;
+        l.count = l.capacity = 0;
+        return *this;
+    }
+
+    // keep the triangles in `a` from now on, the current ones are moved there
+    void bind(TriangleArena* a) {
+        std::vector<Triangle> old;
+        old.swap(storage);
+        const Triangle* triangles = first;
+        int n = count;
+        arena = a;
+        first = nullptr;
+        count = capacity = 0;
+        assign(triangles, n);
+    }
+    // added triangles are default ones
+    void resize(int n) {
+        reserve(n, std::min(count, n));
+        if(arena != nullptr)
+            for(int i = count; i < n; i++) first[i] = Triangle();
+        count = n;
+    }
+    void clear() {
+        resize(0);
+    }
+    size_t size() const {
+        return count;
+    }
+    bool empty() const {
+        return count == 0;
+    }
+    Triangle& operator[](size_t i) {
+        return first[i];
+    }
+    const Triangle& operator[](size_t i) const {
+        return first[i];
+    }
+    Triangle* data() {
+        return first;
+    }
+    Triangle* begin() {
+        return first;
+    }
+    Triangle* end() {
+        return first + count;
+    }
+    const Triangle* begin() const {
+        return first;
+    }
+    const Triangle* end() const {
+        return first + count;
+    }
+};
+// what changed on an object, see Object::dirty
+enum OBJECT_DIRTY {
+    DIRTY_TRANSFORM = 1,
+    // the triangles were changed, calculate_AABB() sets it
+    DIRTY_GEOMETRY = 2,
+    DIRTY_MATERIAL = 4,
+    // the boxes do not match the triangles yet, cleared by calculate_AABB()
+    DIRTY_BOUNDS = 8,
+    DIRTY_ALL = 15,
+};
+// OBJECT_DIRTY flags that can be set and taken at the same time, copied with the object
+struct DirtyFlags: std::atomic<int> {
+    DirtyFlags(): std::atomic<int>(DIRTY_ALL) {}
+    DirtyFlags(const DirtyFlags& f): std::atomic<int>(f.load()) {}
+    DirtyFlags& operator=(const DirtyFlags& f) {
+        store(f.load());
+        return *this;
+    }
+};
+
 class Object {
 protected:
     Vec3 localx = Vec3(1, 0, 0);
@@ -23,12 +204,12 @@ protected:
     Material material;
 public:
     bool visible = true;
-    // mesh variable
-    Vec3 AABB_min = VEC3_ZERO;
-    Vec3 AABB_max = VEC3_ZERO;
-    std::vector<Triangle> tris;
-    // the default triangles use to restore rotation (because i dont know matrix maths lol)
-    std::vector<Triangle> default_tris;
+    // index in ReyTreycer::objects, set at the start of every frame
+    int id = -1;
+    // OBJECT_DIRTY flags of what changed since the last frame, set by the setters
+    // the renderer takes them with take_changes() at the start of every frame
+    // objects are only changed between frames, a flag set while one starts still makes the next one see it
+    DirtyFlags dirty;
 
     virtual void set_position(Vec3 p) {
         return;
@@ -44,8 +225,9 @@ public:
     }
     virtual void set_material(Material mat) {
         material = mat;
+        dirty |= DIRTY_MATERIAL;
     };
-    Material get_material() {
+    const Material& get_material() {
         return material;
     }
     virtual void set_radius(float r) {
@@ -66,6 +248,16 @@ public:
     virtual void calculate_AABB() {
         return;
     }
+    // the flags set since the last call, cleared in the same step so none get lost
+    // the boxes of a moved object are calculated again first
+    int take_changes() {
+        int changes = dirty.exchange(0);
+        if(changes & DIRTY_BOUNDS) {
+            calculate_AABB();
+            changes |= dirty.exchange(0);
+        }
+        return changes & ~DIRTY_BOUNDS;
+    }
 };
 class Sphere: public Object {
 private:
@@ -73,12 +265,15 @@ private:
 public:
     void set_position(Vec3 p) {
         position = p;
+        dirty |= DIRTY_TRANSFORM;
     }
     void set_rotation(Vec3 a) {
         rotation = a;
+        dirty |= DIRTY_TRANSFORM;
     }
     void set_radius(float r) {
         radius = r;
+        dirty |= DIRTY_TRANSFORM;
     }
     float get_radius() {
         return radius;
@@ -92,28 +287,55 @@ class Mesh: public Object {
 private:
     Vec3 scale = Vec3(1, 1, 1);
 public:
+    Vec3 AABB_min = VEC3_ZERO;
+    Vec3 AABB_max = VEC3_ZERO;
+    TriangleList tris;
+    // the default triangles use to restore rotation (because i dont know matrix maths lol)
+    TriangleList default_tris;
+    // hierarchy over tris, built by calculate_AABB()
+    BVH bvh;
+
     void update_material() {
         for(int i = 0; i < (int)tris.size(); i++) {
             tris[i].material = &material;
             default_tris[i].material = &material;
         }
+        dirty |= DIRTY_MATERIAL;
     }
     // calculate Axis Aligned Bounding Box to optimize ray-mesh intersection
+    // also builds the BVH over the triangles, or only refits it if it already matches them
+    // the renderer calls it for meshes moved with set_position(), set_rotation() and set_scale(),
+    // call it after changing tris directly
     void calculate_AABB() {
-        Vec3 min =  Vec3(INFINITY, INFINITY, INFINITY);
-        Vec3 max = -Vec3(INFINITY, INFINITY, INFINITY);
-        for(auto tri: tris)
-            for(int i = 0; i < 3; i++) {
-                min.x = fmin(min.x, tri.vert[i].x);
-                min.y = fmin(min.y, tri.vert[i].y);
-                min.z = fmin(min.z, tri.vert[i].z);
-                
-                max.x = fmax(max.x, tri.vert[i].x);
-                max.y = fmax(max.y, tri.vert[i].y);
-                max.z = fmax(max.z, tri.vert[i].z);
-            }
-        AABB_min = min;
-        AABB_max = max;
+        std::vector<AABB> bounds(tris.size());
+        AABB box;
+        for(int i = 0; i < (int)tris.size(); i++) {
+            for(int j = 0; j < 3; j++)
+                bounds[i].grow(tris[i].vert[j]);
+            box.grow(bounds[i]);
+        }
+        AABB_min = box.min;
+        AABB_max = box.max;
+
+        // transforms only move the vertices, the structure of the tree is still valid
+        // until it got much worse than a new one, see BVH::update()
+        // a SBVH has boxes of clipped triangles that a refit would lose, it is built again with the corners
+        if((int)tris.size() < BVH_MIN_PRIMS)
+            bvh.clear();
+        else if(bvh.settings.mode == BVH_BUILD_SBVH) {
+            std::vector<Vec3> vertices;
+            vertices.reserve(3 * tris.size());
+            for(const Triangle& tri: tris)
+                for(int j = 0; j < 3; j++) vertices.push_back(tri.vert[j]);
+            bvh.build(bounds, &vertices);
+        }
+        else if(bvh.prim_indices.size() == tris.size() and !bvh.empty())
+            bvh.update(bounds);
+        else
+            bvh.build(bounds);
+        // whoever recalculates the boxes changed the triangles
+        dirty &= ~DIRTY_BOUNDS;
+        dirty |= DIRTY_GEOMETRY;
     }
     void set_position(Vec3 p) {
         for(int i = 0; i < (int)tris.size(); i++) {
@@ -121,6 +343,7 @@ public:
                 tris[i].vert[j] += -position + p;
         }
         position = p;
+        dirty |= DIRTY_TRANSFORM | DIRTY_BOUNDS;
     }
     void set_rotation(Vec3 a) {
         // reset
@@ -135,6 +358,7 @@ public:
             }
         }
         rotation = a;
+        dirty |= DIRTY_TRANSFORM | DIRTY_BOUNDS;
     }
     void set_scale(Vec3 v) {
         if(scale.x == 0) scale.x = 1;
@@ -149,12 +373,14 @@ public:
                 *pos += position;
             }
         scale = v;
+        dirty |= DIRTY_TRANSFORM | DIRTY_BOUNDS;
     }
     Vec3 get_scale() {
         return scale;
     }
     void set_material(Material mat) {
         material = mat;
+        dirty |= DIRTY_MATERIAL;
     }
     bool is_sphere() {
         return false;
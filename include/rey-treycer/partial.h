@@ -0,0 +1,296 @@
+#ifndef PARTIAL_H
+#define PARTIAL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "denoise.h"
+#include "image_writer.h"
+#include "mapped_file.h"
+
+// partial buffers: a rectangle of the image and a range of frames, rendered on its own by
+// ReyTreycer::render_region(), so one image can be split over processes or machines with plain files
+// merge_partials() puts them back together, parts that cover different pixels are copied and
+// parts that cover the same pixels with different frames are averaged by their sample counts
+
+const uint32_t PARTIAL_BUFFER_VERSION = 1;
+
+// a rectangle of the image, width or height 0 means the whole image
+struct RenderRegion {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// file layout: header, then width * height of each of color, sample_count, luminance_m2,
+// albedo, normal, depth and object_id, numbers in the byte order of the machine that wrote it
+struct PartialHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t image_width;
+    int32_t image_height;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    uint64_t first_frame;
+    uint64_t end_frame;
+    int32_t frame_count;
+    int32_t ray_per_pixel;
+};
+
+struct PartialBuffer {
+    // size of the whole image
+    int image_width = 0;
+    int image_height = 0;
+    // the rectangle of the image this buffer holds
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    // the frames were drawn with the random numbers of frames first_frame .. end_frame - 1
+    // (ReyTreycer::frame_index), frame_count of them finished
+    uint64_t first_frame = 0;
+    uint64_t end_frame = 0;
+    int frame_count = 0;
+    int ray_per_pixel = 1;
+
+    // pixel (x + i, y + j) is at i + j * width, like ReyTreycer::sample_count but for the rectangle
+    std::vector<Vec3> color;
+    std::vector<int> sample_count;
+    std::vector<float> luminance_m2;
+    AOVBuffers aov;
+
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        color.assign(w * h, VEC3_ZERO);
+        sample_count.assign(w * h, 0);
+        luminance_m2.assign(w * h, 0);
+        aov = AOVBuffers();
+        aov.resize(w, h);
+    }
+
+    // the buffer as it is stored in a file
+    std::string to_bytes() const {
+        PartialHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "RTPB", 4);
+        header.version = PARTIAL_BUFFER_VERSION;
+        header.image_width = image_width;
+        header.image_height = image_height;
+        header.x = x;
+        header.y = y;
+        header.width = width;
+        header.height = height;
+        header.first_frame = first_frame;
+        header.end_frame = end_frame;
+        header.frame_count = frame_count;
+        header.ray_per_pixel = ray_per_pixel;
+
+        size_t n = width * height;
+        std::string bytes;
+        bytes.reserve(sizeof(header) + n * (3 * sizeof(Vec3) + 4 * 4));
+        bytes.append((const char*)&header, sizeof(header));
+        bytes.append((const char*)color.data(), n * sizeof(Vec3));
+        bytes.append((const char*)sample_count.data(), n * sizeof(int));
+        bytes.append((const char*)luminance_m2.data(), n * sizeof(float));
+        bytes.append((const char*)aov.albedo.data(), n * sizeof(Vec3));
+        bytes.append((const char*)aov.normal.data(), n * sizeof(Vec3));
+        bytes.append((const char*)aov.depth.data(), n * sizeof(float));
+        bytes.append((const char*)aov.object_id.data(), n * sizeof(int));
+        return bytes;
+    }
+    // read a buffer made by to_bytes(), false if it is broken or from another version
+    bool from_bytes(const char* data, size_t size) {
+        PartialHeader header;
+        if(size < sizeof(header)) return false;
+        memcpy(&header, data, sizeof(header));
+        if(memcmp(header.magic, "RTPB", 4) != 0 or header.version != PARTIAL_BUFFER_VERSION
+           or header.width < 0 or header.height < 0
+           or size != sizeof(header) + (uint64_t)header.width * header.height * (3 * sizeof(Vec3) + 4 * 4))
+            return false;
+
+        image_width = header.image_width;
+        image_height = header.image_height;
+        x = header.x;
+        y = header.y;
+        first_frame = header.first_frame;
+        end_frame = header.end_frame;
+        frame_count = header.frame_count;
+        ray_per_pixel = header.ray_per_pixel;
+        resize(header.width, header.height);
+
+        size_t n = width * height;
+        const char* p = data + sizeof(header);
+        auto read = [&p](void* to, size_t bytes) {
+            memcpy(to, p, bytes);
+            p += bytes;
+        };
+        read(color.data(), n * sizeof(Vec3));
+        read(sample_count.data(), n * sizeof(int));
+        read(luminance_m2.data(), n * sizeof(float));
+        read(aov.albedo.data(), n * sizeof(Vec3));
+        read(aov.normal.data(), n * sizeof(Vec3));
+        read(aov.depth.data(), n * sizeof(float));
+        read(aov.object_id.data(), n * sizeof(int));
+        return true;
+    }
+
+    // write the buffer to `filename`, false if it could not be written
+    bool save(std::string filename) const {
+        // write to a temporary file first so a process killed while writing leaves no broken part
+        std::string tmp_name = temporary_name(filename);
+        std::ofstream f(tmp_name, std::ios::binary);
+        if(!f.is_open()) return false;
+        std::string bytes = to_bytes();
+        f.write(bytes.data(), bytes.size());
+        f.close();
+        if(!f.good() or std::rename(tmp_name.c_str(), filename.c_str()) != 0) {
+            std::remove(tmp_name.c_str());
+            return false;
+        }
+        return true;
+    }
+    // read a buffer written by save(), false if it is missing, broken or from another version
+    bool load(std::string filename) {
+        MappedFile file;
+        return file.open(filename) and from_bytes(file.data(), file.size());
+    }
+};
+
+// add the samples of `part` to `out`, `part` must lie inside the rectangle of `out`
+// every pixel becomes the sample weighted average of both, and its brightness variance is
+// combined like two halves of one running variance
+inline void add_partial(PartialBuffer& out, const PartialBuffer& part) {
+    auto luminance = [](Vec3 c) {
+        return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    };
+    out.first_frame = std::min(out.first_frame, part.first_frame);
+    out.end_frame = std::max(out.end_frame, part.end_frame);
+    for(int j = 0; j < part.height; j++)
+        for(int i = 0; i < part.width; i++) {
+            int q = i + j * part.width;
+            int p = part.x - out.x + i + (part.y - out.y + j) * out.width;
+            int nb = part.sample_count[q];
+            if(nb == 0) continue;
+            int na = out.sample_count[p];
+            float w = (float)nb / (na + nb);
+
+            float mean_a = luminance(out.color[p]), mean_b = luminance(part.color[q]);
+            float delta = mean_b - mean_a;
+            out.luminance_m2[p] = na == 0 ? part.luminance_m2[q]
+                                : out.luminance_m2[p] + part.luminance_m2[q] + delta * delta * na * w;
+            out.color[p] = out.color[p] * (1 - w) + part.color[q] * w;
+            out.sample_count[p] = na + nb;
+            // frames per pixel of the best covered pixel
+            out.frame_count = std::max(out.frame_count, na + nb);
+
+            out.aov.albedo[p] = out.aov.albedo[p] * (1 - w) + part.aov.albedo[q] * w;
+            out.aov.normal[p] = out.aov.normal[p] * (1 - w) + part.aov.normal[q] * w;
+            // the first hit of the part with more samples
+            if(w >= 0.5f) {
+                out.aov.depth[p] = part.aov.depth[q];
+                out.aov.object_id[p] = part.aov.object_id[q];
+            }
+        }
+}
+
+// merge `parts` into `out`, which covers the smallest rectangle around all of them
+// so parts that make up a rectangle merge into a part that can be merged further
+// the merge of frames 0..49 and 50..99 is what one render of frames 0..99 would be, see add_partial()
+// pixels no part covers have a sample_count of 0
+// returns false with the reason in `error` if the parts do not belong together, or two parts
+// cover the same pixels with the same frames
+inline bool merge_partials(const std::vector<PartialBuffer>& parts, PartialBuffer& out, std::string* error = nullptr) {
+    auto fail = [error](std::string reason) {
+        if(error != nullptr) *error = reason;
+        return false;
+    };
+    if(parts.empty()) return fail("no parts");
+    const PartialBuffer& first = parts[0];
+    for(int i = 0; i < (int)parts.size(); i++) {
+        const PartialBuffer& a = parts[i];
+        if(a.image_width != first.image_width or a.image_height != first.image_height)
+            return fail("part " + std::to_string(i) + " is from an image of a different size");
+        if(a.ray_per_pixel != first.ray_per_pixel)
+            return fail("part " + std::to_string(i) + " has a different ray_per_pixel");
+        if(a.x < 0 or a.y < 0 or a.x + a.width > a.image_width or a.y + a.height > a.image_height)
+            return fail("part " + std::to_string(i) + " is outside of the image");
+        for(int j = 0; j < i; j++) {
+            const PartialBuffer& b = parts[j];
+            bool pixels_overlap = a.x < b.x + b.width and b.x < a.x + a.width and a.y < b.y + b.height and b.y < a.y + a.height;
+            bool frames_overlap = a.first_frame < b.end_frame and b.first_frame < a.end_frame;
+            if(pixels_overlap and frames_overlap)
+                return fail("parts " + std::to_string(j) + " and " + std::to_string(i) + " share pixels and frames");
+        }
+    }
+
+    out.image_width = first.image_width;
+    out.image_height = first.image_height;
+    out.ray_per_pixel = first.ray_per_pixel;
+    out.first_frame = first.first_frame;
+    out.end_frame = first.end_frame;
+    out.frame_count = 0;
+    int to_x = first.x + first.width, to_y = first.y + first.height;
+    out.x = first.x;
+    out.y = first.y;
+    for(const PartialBuffer& part: parts) {
+        out.x = std::min(out.x, part.x);
+        out.y = std::min(out.y, part.y);
+        to_x = std::max(to_x, part.x + part.width);
+        to_y = std::max(to_y, part.y + part.height);
+    }
+    out.resize(to_x - out.x, to_y - out.y);
+
+    for(const PartialBuffer& part: parts)
+        add_partial(out, part);
+    return true;
+}
+
+// write `part` as an image of the whole image to `filename`, the type comes from the extension:
+// .png, .pfm, .exr, or .rtp for the buffer itself. pixels outside of the part are black
+// `denoise` runs the denoiser over the part first. false if the file could not be written
+inline bool save_partial_image(const PartialBuffer& part, std::string filename, bool denoise = false, int thread_count = 1) {
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+    if(extension == "rtp") return part.save(filename);
+
+    PFMWriter pfm;
+    EXRWriter exr;
+    PNGWriter png;
+    TileSink* sink = nullptr;
+    if(extension == "pfm") sink = &pfm;
+    else if(extension == "exr") sink = &exr;
+    else if(extension == "png") sink = &png;
+    else return false;
+
+    std::vector<std::vector<Vec3>> color(part.width, std::vector<Vec3>(part.height, VEC3_ZERO));
+    for(int x = 0; x < part.width; x++)
+        for(int y = 0; y < part.height; y++)
+            color[x][y] = part.color[x + y * part.width];
+    if(denoise) {
+        std::vector<std::vector<Vec3>> denoised = color;
+        Denoiser denoiser;
+        denoiser.run(color, part.aov, denoised, DenoiseSettings(), thread_count);
+        color.swap(denoised);
+    }
+    // the rest of the image is black
+    std::vector<std::vector<Vec3>> image(part.image_width, std::vector<Vec3>(part.image_height, VEC3_ZERO));
+    for(int x = 0; x < part.width; x++)
+        std::copy(color[x].begin(), color[x].end(), image[part.x + x].begin() + part.y);
+    if(!sink->begin(filename, part.image_width, part.image_height)) return false;
+    // in rows of tiles so a PNGWriter can flush as it goes
+    const int TILE = 64;
+    for(int y = 0; y < part.image_height; y += TILE)
+        for(int x = 0; x < part.image_width; x += TILE)
+            sink->write_tile(image, x, y, std::min(TILE, part.image_width - x), std::min(TILE, part.image_height - y));
+    return sink->finish();
+}
+
+#endif
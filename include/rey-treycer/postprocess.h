@@ -0,0 +1,148 @@
+#ifndef POSTPROCESS_H
+#define POSTPROCESS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "helper.h"
+
+// turning the linear colors of ReyTreycer into 8 bit pixels
+// exposure and tonemapping run over a whole column at once in straight loops the compiler vectorizes,
+// the encoding curve (gamma or sRGB) is a table lookup, 64x64 blocks at a time so the output is
+// written row by row although the input is stored column by column
+
+struct PostProcessSettings {
+    int tonemapping = TONEMAP_RGB_CLAMPING;
+    // in stops, colors are multiplied by 2^exposure before tonemapping
+    float exposure = 0;
+    // encode with the sRGB curve, otherwise with pow(color, gamma)
+    bool srgb = false;
+    float gamma = 1;
+};
+
+enum PIXEL_LAYOUT {
+    // r, g, b bytes
+    PIXEL_RGB8 = 0,
+    // b, g, r, a bytes, which is SDL_PIXELFORMAT_ARGB8888 on little endian machines
+    PIXEL_BGRA8 = 1,
+};
+
+// entries of the encoding table, exact to one step of 255 for sRGB and gamma >= 1
+// gamma below 1 is steep near black and loses a few steps there
+const int ENCODE_LUT_SIZE = 16384;
+// pixels are converted in square blocks of this size
+const int ENCODE_BLOCK = 64;
+
+class PostProcessor {
+private:
+    unsigned char lut[ENCODE_LUT_SIZE];
+    PostProcessSettings lut_settings;
+    bool lut_built = false;
+
+    // exposure and tonemapping of n pixels into 3 * n indices of the table
+    // a Vec3 is 3 packed floats so the column is read as one flat float array
+    template<int STYLE>
+    static void tonemap_column(const Vec3* in, int n, float scale, int* __restrict out) {
+        static_assert(sizeof(Vec3) == 3 * sizeof(float), "Vec3 must be 3 packed floats");
+        const float* __restrict channel = reinterpret_cast<const float*>(in);
+        const float steps = ENCODE_LUT_SIZE - 1;
+        for(int i = 0; i < n * 3; i++) {
+            // keep infinite colors finite, the curves would turn them into inf / inf
+            float v = fminf(channel[i] * scale, 1e4f);
+            if(STYLE == TONEMAP_REINHARD) v = tonemap_reinhard(v);
+            else if(STYLE == TONEMAP_ACES) v = tonemap_aces(v);
+            // every index has to stay inside the table, whatever the curve returned
+            v = fminf(fmaxf(v, 0), 1);
+            out[i] = v * steps;
+        }
+    }
+
+    // look up the table for the 3 * n indices of column x of a block and put the bytes into its rows
+    // bytes may alias anything, __restrict tells the compiler they do not
+    template<int BYTES>
+    static void encode_column(const int* __restrict index, int n, const unsigned char* __restrict table,
+                              unsigned char* __restrict rows, int x) {
+        // bgra for 4 bytes, rgb for 3
+        const int r = BYTES == 4 ? 2 : 0, b = 2 - r;
+        unsigned char* __restrict pixel = rows + x * BYTES;
+        for(int y = 0; y < n; y++, pixel += ENCODE_BLOCK * BYTES) {
+            pixel[r] = table[index[y * 3 + 0]];
+            pixel[1] = table[index[y * 3 + 1]];
+            pixel[b] = table[index[y * 3 + 2]];
+            if(BYTES == 4) pixel[3] = 255;
+        }
+    }
+
+    // encode the columns from_x..to_x, block by block so the tonemapping reads whole column pieces
+    // and the output is still written row by row
+    template<int BYTES>
+    void encode_columns(const std::vector<std::vector<Vec3>>& colors, int from_x, int to_x, int from_y, int height,
+                        unsigned char* out, int pitch, int out_x) {
+        int index[ENCODE_BLOCK * 3];
+        // the encoded block, row by row
+        unsigned char rows[ENCODE_BLOCK * ENCODE_BLOCK * BYTES];
+        float scale = exp2f(settings.exposure);
+
+        for(int bx = from_x; bx < to_x; bx += ENCODE_BLOCK)
+            for(int by = 0; by < height; by += ENCODE_BLOCK) {
+                int w = std::min(ENCODE_BLOCK, to_x - bx), h = std::min(ENCODE_BLOCK, height - by);
+                for(int x = 0; x < w; x++) {
+                    const Vec3* column = colors[bx + x].data() + from_y + by;
+                    switch(settings.tonemapping) {
+                        case TONEMAP_REINHARD: tonemap_column<TONEMAP_REINHARD>(column, h, scale, index); break;
+                        case TONEMAP_ACES: tonemap_column<TONEMAP_ACES>(column, h, scale, index); break;
+                        default: tonemap_column<TONEMAP_RGB_CLAMPING>(column, h, scale, index); break;
+                    }
+                    encode_column<BYTES>(index, h, lut, rows, x);
+                }
+                unsigned char* block = out + by * pitch + (bx - from_x + out_x) * BYTES;
+                for(int y = 0; y < h; y++)
+                    std::memcpy(block + y * pitch, rows + y * ENCODE_BLOCK * BYTES, w * BYTES);
+            }
+    }
+public:
+    PostProcessSettings settings;
+
+    // rebuild the encoding table if the curve in `settings` changed
+    void prepare() {
+        if(lut_built and lut_settings.srgb == settings.srgb and lut_settings.gamma == settings.gamma) return;
+        for(int i = 0; i < ENCODE_LUT_SIZE; i++) {
+            float v = i / (ENCODE_LUT_SIZE - 1.0f);
+            if(settings.srgb) v = v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1 / 2.4f) - 0.055f;
+            else v = powf(v, settings.gamma);
+            lut[i] = fminf(fmaxf(v, 0), 1) * 255 + 0.5f;
+        }
+        lut_settings = settings;
+        lut_built = true;
+    }
+
+    // convert the rectangle (from_x, from_y, width, height) of `colors` (indexed [x][y]) into `out`
+    // pixel (from_x, from_y) goes to out[0], rows are `pitch` bytes apart
+    // the columns are split over `thread_count` threads
+    void convert(const std::vector<std::vector<Vec3>>& colors, int from_x, int from_y, int width, int height,
+                 unsigned char* out, int pitch, int layout, int thread_count = 1) {
+        prepare();
+        thread_count = std::max(1, std::min(thread_count, width / ENCODE_BLOCK));
+        int columns = (width + thread_count - 1) / thread_count;
+        auto part = [&](int t) {
+            int x0 = std::min(from_x + t * columns, from_x + width), x1 = std::min(x0 + columns, from_x + width);
+            if(layout == PIXEL_BGRA8) encode_columns<4>(colors, x0, x1, from_y, height, out, pitch, x0 - from_x);
+            else encode_columns<3>(colors, x0, x1, from_y, height, out, pitch, x0 - from_x);
+        };
+        std::vector<std::thread> threads;
+        for(int t = 1; t < thread_count; t++)
+            threads.push_back(std::thread(part, t));
+        part(0);
+        for(std::thread& t: threads) t.join();
+    }
+    // the whole image as tightly packed rgb rows, `out` holds width * height * 3 bytes
+    void to_rgb8(const std::vector<std::vector<Vec3>>& colors, int width, int height,
+                 unsigned char* out, int thread_count = 1) {
+        convert(colors, 0, 0, width, height, out, width * 3, PIXEL_RGB8, thread_count);
+    }
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include <vector>
+
+#include "objects.h"
+
+// how many spheres are tested against a ray at once
+// the sphere arrays are padded to a multiple of this so the batch loop has no tail
+const int SPHERE_BATCH = 8;
+
+// all visible spheres packed as a structure of arrays
+// a ray is tested against a whole batch with one straight loop the compiler turns into SIMD
+struct SphereArray {
+    std::vector<float> center_x, center_y, center_z;
+    std::vector<float> radius;
+    // the objects, their material and rotation are only read for the closest hit
+    std::vector<Sphere*> objects;
+    // number of real spheres, the rest is padding
+    int count = 0;
+
+    void clear() {
+        center_x.clear(); center_y.clear(); center_z.clear();
+        radius.clear();
+        objects.clear();
+        count = 0;
+    }
+    void add(Sphere* sphere) {
+        Vec3 c = sphere->get_position();
+        center_x.push_back(c.x); center_y.push_back(c.y); center_z.push_back(c.z);
+        radius.push_back(sphere->get_radius());
+        objects.push_back(sphere);
+        count++;
+    }
+    // pad the last batch, call once after all spheres were added
+    // padding spheres have no radius and are never reported as a hit
+    void pad() {
+        int padded = (count + SPHERE_BATCH - 1) / SPHERE_BATCH * SPHERE_BATCH;
+        center_x.resize(padded, 0); center_y.resize(padded, 0); center_z.resize(padded, 0);
+        radius.resize(padded, 0);
+        objects.resize(padded, nullptr);
+    }
+};
+
+// the visible objects of a scene grouped by type
+// so a ray is dispatched once per type instead of once per object
+struct PrimitiveArrays {
+    SphereArray spheres;
+    std::vector<Mesh*> meshes;
+
+    void clear() {
+        spheres.clear();
+        meshes.clear();
+    }
+    // rebuild from the object list, call after objects were added, removed, moved or hidden
+    void build(const std::vector<Object*>& objects) {
+        clear();
+        for(Object* obj: objects) {
+            if(!obj->visible) continue;
+            if(obj->is_sphere())
+                spheres.add(static_cast<Sphere*>(obj));
+            else
+                meshes.push_back(static_cast<Mesh*>(obj));
+        }
+        spheres.pad();
+    }
+};
+
+#endif
@@ -1,8 +1,11 @@
 #ifndef RAY_H
 #define RAY_H
 
-#include "objects.h"
+#include <algorithm>
+
+#include "primitives.h"
 #include "helper.h"
+#include "rng.h"
 
 struct HitInfo {
     bool did_hit = false;
@@ -11,6 +14,8 @@ struct HitInfo {
     bool front_face = true;
     Vec3 normal = VEC3_ZERO;
     float u, v;
+    // how many uv units a world unit covers at the hit point, for texture filtering
+    float uv_density = 0;
     Material material;
     Object* object = nullptr;
 };
@@ -19,7 +24,11 @@ struct Ray {
     Vec3 direction = VEC3_ZERO;
     Vec3 origin = VEC3_ZERO;
     float max_range = 50.0f;
-    HitInfo cast_to_sphere(Object* sphere, bool calculate_uv) {
+    // a ray cone used as a cheap ray differential to pick texture mip levels
+    // cone_width is the footprint width at the origin, it grows by cone_spread per unit of distance
+    float cone_width = 0;
+    float cone_spread = 0;
+    HitInfo cast_to_sphere(Sphere* sphere, bool calculate_uv) {
         HitInfo h;
 
         Vec3 centre = sphere->get_position();
@@ -47,7 +56,7 @@ struct Ray {
             return h;
         
         // there is no way a non transparent sphere can have a light ray inside it
-        Material mat = sphere->get_material();
+        const Material& mat = sphere->get_material();
         bool transparent = mat.transparent or mat.smoke;
         if(!transparent and inside_object) return h;
 
@@ -79,6 +88,8 @@ struct Ray {
 
                 h.u = phi / (2 * M_PI);
                 h.v = theta / M_PI;
+                // u spans the equator (2 pi r) and v spans half of a great circle (pi r)
+                h.uv_density = 1 / (M_PI * radius * sqrtf(2));
             }
 
             h.material = sphere->get_material();
@@ -90,6 +101,52 @@ struct Ray {
         return h;
     }
 
+    // closest hit among all spheres of the array that is nearer than `closest_distance`
+    // each batch is first tested in one branchless loop that gives a distance no farther than the real hit
+    // only the spheres that pass are tested again with cast_to_sphere() for the exact hit
+    HitInfo cast_to_spheres(const SphereArray& spheres, float closest_distance) {
+        HitInfo closest;
+        closest.distance = closest_distance;
+
+        const float a = direction.squared_length();
+        const float inv_a = 1 / a;
+        for(int base = 0; base < spheres.count; base += SPHERE_BATCH) {
+            const float* cx = &spheres.center_x[base];
+            const float* cy = &spheres.center_y[base];
+            const float* cz = &spheres.center_z[base];
+            const float* r = &spheres.radius[base];
+
+            float candidate[SPHERE_BATCH];
+            for(int k = 0; k < SPHERE_BATCH; k++) {
+                float ox = origin.x - cx[k], oy = origin.y - cy[k], oz = origin.z - cz[k];
+                float b = ox * direction.x + oy * direction.y + oz * direction.z;
+                float c = ox * ox + oy * oy + oz * oz - r[k] * r[k];
+                float discriminant = b * b - a * c;
+                float s = sqrtf(fmaxf(discriminant, 0));
+                float near = (-b - s) * inv_a;
+                float far = (-b + s) * inv_a;
+                // the front hit if it is ahead of the origin, the back hit otherwise
+                float t = near >= 1e-6f ? near : far;
+                // bitwise | so the loop stays branchless
+                bool miss = (discriminant < 0) | (far < 1e-6f) | (t > max_range);
+                candidate[k] = miss ? BVH_MISS : t;
+            }
+
+            int batch_count = std::min(SPHERE_BATCH, spheres.count - base);
+            for(int k = 0; k < batch_count; k++) {
+                if(candidate[k] == BVH_MISS or candidate[k] >= closest.distance) continue;
+                Sphere* sphere = spheres.objects[base + k];
+                bool calculate_uv = sphere->get_material().texture->get_type() != TEX_COLOR;
+                HitInfo h = cast_to_sphere(sphere, calculate_uv);
+                if(h.did_hit and h.distance < closest.distance) {
+                    closest = h;
+                    closest.object = sphere;
+                }
+            }
+        }
+        return closest;
+    }
+
     HitInfo cast_to_triangle(Triangle* tri, bool both_face, bool calculate_uv) {
         HitInfo h;
 
@@ -145,6 +202,9 @@ struct Ray {
             Vec3 coord = w * vt1 + u * vt2 + v * vt3;
             h.u = coord.x;
             h.v = coord.y;
+            // ratio between the uv area and the world area of the triangle
+            float uv_area = (vt2 - vt1).cross(vt3 - vt1).length();
+            h.uv_density = sqrtf(uv_area / normalVector.length());
         }
 
         h.material = *(tri->material);
@@ -163,7 +223,26 @@ struct Ray {
         float tFar = fmin(fmin(t2.x, t2.y), t2.z);
         return tNear <= tFar;
     }
-    HitInfo cast_to_mesh(Object* mesh, bool calculate_uv) {
+    // distance to the entry point of a box, BVH_MISS if the ray misses it
+    float distance_to_AABB(Vec3 box_min, Vec3 box_max, Vec3 inv_dir) {
+        Vec3 tMin = (box_min - origin) * inv_dir;
+        Vec3 tMax = (box_max - origin) * inv_dir;
+        float tNear = fmax(fmax(fmin(tMin.x, tMax.x), fmin(tMin.y, tMax.y)), fmin(tMin.z, tMax.z));
+        float tFar = fmin(fmin(fmax(tMin.x, tMax.x), fmax(tMin.y, tMax.y)), fmax(tMin.z, tMax.z));
+        if(tNear > tFar or tFar < 0) return BVH_MISS;
+        return fmax(tNear, 0);
+    }
+    HitInfo cast_to_mesh(Mesh* mesh, bool calculate_uv) {
+        return cast_to_mesh_impl<false>(mesh, calculate_uv, nullptr);
+    }
+    // like cast_to_mesh(), also counting the nodes visited and triangles tested into `stats`
+    HitInfo cast_to_mesh_counted(Mesh* mesh, bool calculate_uv, BVHTraversalStats& stats) {
+        stats.rays++;
+        return cast_to_mesh_impl<true>(mesh, calculate_uv, &stats);
+    }
+    // the counting is compiled out of the normal version
+    template<bool COUNT>
+    HitInfo cast_to_mesh_impl(Mesh* mesh, bool calculate_uv, BVHTraversalStats* stats) {
         Vec3 AABB_min = mesh->AABB_min;
         Vec3 AABB_max = mesh->AABB_max;
 
@@ -174,17 +253,87 @@ struct Ray {
         // if not collide with AABB then skip
         if(!cast_to_AABB(AABB_min, AABB_max)) return closest;
 
-        // find closest hit
-        for(int i = 0; i < (int)mesh->tris.size(); i++) {
-            Material mat = mesh->get_material();
-            bool transparent = mat.transparent or mat.smoke;
-            HitInfo h = cast_to_triangle(&(mesh->tris[i]), transparent, calculate_uv);
-            if(h.did_hit and h.distance < closest.distance)
-                closest = h;
+        const Material& mat = mesh->get_material();
+        bool transparent = mat.transparent or mat.smoke;
+
+        // no hierarchy, test every triangle
+        if(mesh->bvh.empty()) {
+            if(COUNT) stats->prims += mesh->tris.size();
+            for(int i = 0; i < (int)mesh->tris.size(); i++) {
+                HitInfo h = cast_to_triangle(&(mesh->tris[i]), transparent, calculate_uv);
+                if(h.did_hit and h.distance < closest.distance)
+                    closest = h;
+            }
+            return closest;
+        }
+
+        // walk the BVH, visiting the nearer child first and skipping boxes behind the closest hit
+        const std::vector<BVHNode>& nodes = mesh->bvh.nodes;
+        const std::vector<int>& prim_indices = mesh->bvh.prim_indices;
+        Vec3 inv_dir = 1 / direction;
+
+        int stack[BVH_STACK_SIZE];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+        while(stack_size > 0) {
+            const BVHNode& node = nodes[stack[--stack_size]];
+            if(distance_to_AABB(node.box_min, node.box_max, inv_dir) >= fmin(closest.distance, max_range))
+                continue;
+            if(COUNT) stats->nodes++;
+
+            if(node.count > 0) {
+                if(COUNT) stats->prims += node.count;
+                for(int i = node.first; i < node.first + node.count; i++) {
+                    HitInfo h = cast_to_triangle(&(mesh->tris[prim_indices[i]]), transparent, calculate_uv);
+                    if(h.did_hit and h.distance < closest.distance)
+                        closest = h;
+                }
+                continue;
+            }
+
+            const BVHNode& left = nodes[node.first];
+            const BVHNode& right = nodes[node.first + 1];
+            float d_left = distance_to_AABB(left.box_min, left.box_max, inv_dir);
+            float d_right = distance_to_AABB(right.box_min, right.box_max, inv_dir);
+            // push the farther child first so the nearer one is popped next
+            if(d_left < d_right) {
+                if(d_right != BVH_MISS) stack[stack_size++] = node.first + 1;
+                if(d_left != BVH_MISS) stack[stack_size++] = node.first;
+            }
+            else {
+                if(d_left != BVH_MISS) stack[stack_size++] = node.first;
+                if(d_right != BVH_MISS) stack[stack_size++] = node.first + 1;
+            }
         }
 
         return closest;
     }
 };
 
+// cast `ray_count` rays at `mesh` and count the work the tree makes, to compare builders on an asset
+// the rays start on a sphere around the mesh and go through random points of its box
+// uses its own random numbers, so the same mesh always gets the same rays
+inline BVHTraversalStats measure_traversal(Mesh* mesh, int ray_count = 10000) {
+    PCG32 rng;
+    std::uniform_real_distribution<float> u(0, 1);
+    Vec3 size = mesh->AABB_max - mesh->AABB_min;
+    Vec3 center = (mesh->AABB_min + mesh->AABB_max) / 2;
+    float radius = size.length() + 1e-3f;
+
+    BVHTraversalStats stats;
+    for(int i = 0; i < ray_count; i++) {
+        float z = u(rng) * 2 - 1, phi = u(rng) * 2 * M_PI;
+        float r = sqrtf(fmaxf(1 - z * z, 0));
+        Vec3 from = center + Vec3(r * cosf(phi), r * sinf(phi), z) * radius;
+        Vec3 to = mesh->AABB_min + size * Vec3(u(rng), u(rng), u(rng));
+
+        Ray ray;
+        ray.origin = from;
+        ray.direction = (to - from).normalize();
+        ray.max_range = 2 * radius;
+        ray.cast_to_mesh_counted(mesh, false, stats);
+    }
+    return stats;
+}
+
 #endif
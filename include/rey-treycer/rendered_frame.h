@@ -0,0 +1,34 @@
+#ifndef RENDERED_FRAME_H
+#define RENDERED_FRAME_H
+
+#include <vector>
+
+#include "vec3.h"
+
+// a frame is drawn in square tiles of this size, threads take the next free tile
+// cancelling a frame takes at most one column of a tile
+const int DRAW_TILE_SIZE = 16;
+
+// a finished frame as published by ReyTreycer, never changed after that
+struct RenderedFrame {
+    // indexed [x][y] like ReyTreycer::screen_color, but exactly width x height
+    std::vector<std::vector<Vec3>> color;
+    int width = 0;
+    int height = 0;
+    // ReyTreycer::rendered_count after the frame
+    int rendered_count = 0;
+    float noise = 1;
+    // color is ReyTreycer::denoised_color
+    bool denoised = false;
+
+    // increases by one with every published frame
+    int frame_id = 0;
+    // the image is split into tiles of DRAW_TILE_SIZE, tile (tx, ty) is tx + ty * tile_columns
+    int tile_columns = 0;
+    int tile_rows = 0;
+    // frame_id of the last frame that changed each tile
+    // a reader that showed frame n only needs the tiles with a version above n
+    std::vector<int> tile_version;
+};
+
+#endif
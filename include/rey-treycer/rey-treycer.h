@@ -1,26 +1,109 @@
 #ifndef REYTREYCER_H
 #define REYTREYCER_H
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <stack>
+#include <unordered_map>
 
 #include "camera.h"
 #include "objects.h"
+#include "scene.h"
+#include "visibility_buffer.h"
+#include "denoise.h"
+#include "temporal.h"
+#include "image_writer.h"
+#include "texture_cache.h"
+#include "mesh_cache.h"
+#include "checkpoint.h"
+#include "partial.h"
+#include "rendered_frame.h"
+#include "shared_framebuffer.h"
+
+// when ReyTreycer::render_until() stops, every limit that is not 0 applies
+struct RenderBudget {
+    // wall clock seconds, a frame is only started if it is expected to finish in time
+    double seconds = 0;
+    // frames times ray_per_pixel, the preview frames after a restart count as one, see ReyTreycer::sampled_frames()
+    int samples_per_pixel = 0;
+    // estimated relative noise of the image, see ReyTreycer::noise_estimate
+    float noise = 0;
+    // with a noise limit, stop tracing the pixels that are already below it
+    bool adaptive = true;
+};
+
+struct RenderReport {
+    int frames = 0;
+    double seconds = 0;
+    float noise = 0;
+};
+
+// pixels need this many samples before their noise estimate is trusted
+const int ADAPTIVE_MIN_SAMPLES = 8;
 
 class ReyTreycer {
 private:
-    // TODO: better naming
-    
-    // how many columns a single thread will draw
-    int column_threads;
-    // how many rows a single thread will draw
-    int row_threads;
-    // the width of the rectangle a thread will draw
-    int thread_width;
-    // the height of the rectangle a thread will draw
-    int thread_height;
+    int thread_count;
     // a vector to store all draw threads
     std::vector<std::thread> threads;
+    // draw threads still working on the current frame
+    std::atomic<int> running_threads{0};
+    // the next tile a draw thread will take
+    std::atomic<int> next_tile{0};
+    // bumped by cancel_frame(), a frame stops as soon as it differs from frame_epoch
+    std::atomic<int> epoch{0};
+    int frame_epoch = 0;
+    // set by restart_render() and camera_moved(), handled by the next frame, so the count is
+    // only ever written by the thread that draws
+    std::atomic<bool> restart_requested{false};
+    std::atomic<bool> camera_move_requested{false};
+    Denoiser denoiser;
+    std::mutex denoise_mutex;
+    // builds the trees of added meshes in parallel, see add_object()
+    std::unique_ptr<ThreadPool> build_pool;
+
+    // the thread of start_frame() and the result of its frame
+    std::thread render_thread;
+    std::atomic<bool> rendering{false};
+    std::shared_future<bool> current_frame;
+    std::mutex render_mutex;
+
+    // the last finished frame, only read and replaced with std::atomic_load / std::atomic_store
+    std::shared_ptr<const RenderedFrame> front;
+    // the frame before it, its memory is reused once no reader holds it anymore
+    std::shared_ptr<RenderedFrame> back;
+    std::mutex publish_mutex;
+    int published_frames = 0;
+    // tiles drawn since the last publish, every tile is only written by the thread that drew it
+    std::vector<char> tile_dirty;
+    // something changed all pixels since the last publish (reprojection, big preview blocks)
+    bool all_tiles_dirty = true;
+    std::vector<int> tile_version;
+    bool published_denoised = false;
+
+    // the camera of the last frame and whether this frame started with a reprojection
+    CameraState last_camera;
+    Reprojector reprojector;
+    bool reprojected = false;
+    // block size of the preview level of this frame, 0 when not previewing
+    int preview_block = 0;
+    // frame_index of the first frame after the last restart
+    uint64_t render_first_frame = 0;
+
+    // the visible objects grouped by type, rebuilt at the start of every frame
+    PrimitiveArrays primitives;
+    // first triangle of every pixel, only used when visibility_active is true
+    VisibilityBuffer visibility;
+    bool visibility_active = false;
+    // for every mesh of primitives, whether it changed since the last frame
+    std::vector<char> changed_meshes;
+    // Object::take_changes() of every object at the start of this frame
+    std::vector<int> object_changes;
 
     // get background light
     Vec3 get_environment_light(Vec3 dir) {
@@ -29,35 +112,54 @@ private:
     }
 
     // get closest hit of a ray
-    HitInfo ray_collision(Ray* ray) {
-        HitInfo closest_hit;
-        closest_hit.distance = INFINITY;
-
-        // find the first intersect point in all objects
-        for(Object* obj: objects) {
-            if(!obj->visible) continue;
+    HitInfo ray_collision(Ray* ray, const PrimitiveArrays& prims) {
+        HitInfo closest_hit = ray->cast_to_spheres(prims.spheres, INFINITY);
+        if(!closest_hit.did_hit) closest_hit.distance = INFINITY;
 
+        for(Mesh* mesh: prims.meshes) {
             // only calculate uv if it is not ColorTexture
-            bool calculate_uv = obj->get_material().texture->get_type() != TEX_COLOR;
-
-            HitInfo h;
-            if(obj->is_sphere())
-                h = ray->cast_to_sphere(obj, calculate_uv);
-            else
-                h = ray->cast_to_mesh(obj, calculate_uv);
+            bool calculate_uv = mesh->get_material().texture->get_type() != TEX_COLOR;
+            HitInfo h = ray->cast_to_mesh(mesh, calculate_uv);
 
             // get the closest hit
             if(h.did_hit and h.distance < closest_hit.distance) {
                 closest_hit = h;
-                closest_hit.object = obj;
+                closest_hit.object = mesh;
             }
         }
 
         return closest_hit;
     }
 
-    // get ray traced color from pixel (x, y)
-    Vec3 ray_trace(int x, int y) {
+    // closest hit of the primary ray of pixel (x, y), starting from the visibility buffer
+    HitInfo primary_collision(Ray* ray, int x, int y) {
+        HitInfo closest_hit;
+        const VisibilityTexel& texel = visibility.at(x, y);
+        if(texel.object >= 0) {
+            Mesh* mesh = primitives.meshes[texel.object];
+            const Material& mat = mesh->get_material();
+            bool calculate_uv = mat.texture->get_type() != TEX_COLOR;
+            closest_hit = ray->cast_to_triangle(&(mesh->tris[texel.prim]), mat.transparent or mat.smoke, calculate_uv);
+            // the ray can still miss by rounding or by max_range, then trace it normally
+            if(!closest_hit.did_hit) return ray_collision(ray, primitives);
+            closest_hit.object = mesh;
+        }
+
+        HitInfo h = ray->cast_to_spheres(primitives.spheres, closest_hit.distance);
+        if(h.did_hit) closest_hit = h;
+        return closest_hit;
+    }
+
+    // what the first hit of a ray looked like, for the AOV buffers
+    struct AOVSample {
+        Vec3 albedo = VEC3_ZERO;
+        Vec3 normal = VEC3_ZERO;
+        float depth = 0;
+        int object_id = -1;
+    };
+
+    // get ray traced color from pixel (x, y), also fill `aov` with the first hit if given
+    Vec3 ray_trace(int x, int y, AOVSample* aov = nullptr) {
         Vec3 ray_color = WHITE;
         Vec3 incomming_light = BLACK;
 
@@ -67,7 +169,7 @@ private:
         Ray ray = camera.ray(x, y);
 
         for(int i = 0; i <= camera.max_ray_bounce_count; i++) {
-            HitInfo h = ray_collision(&ray);
+            HitInfo h = i == 0 and visibility_active ? primary_collision(&ray, x, y) : ray_collision(&ray, primitives);
 
             if(h.did_hit) {
                 Vec3 old_direction = ray.direction;
@@ -123,15 +225,30 @@ private:
                     ray.direction = lerp(specular_direction, diffuse_direction, h.material.roughness);
                 }
 
+                // grow the ray cone to the hit point and keep it for the next bounce
+                ray.cone_width += ray.cone_spread * h.distance;
+
                 SurfaceInfo inf; inf.u = h.u; inf.v = h.v; inf.normal = h.normal;
+                inf.uv_footprint = ray.cone_width * h.uv_density;
                 Vec3 color = h.material.texture->get_texture(inf);
                 ray_color = ray_color * color;
 
+                if(i == 0 and aov != nullptr) {
+                    aov->albedo = color;
+                    aov->normal = h.normal;
+                    aov->depth = h.distance;
+                    aov->object_id = h.object->id;
+                }
+
                 if(h.material.emit_light) {
                     incomming_light += ray_color * color * h.material.emission_strength;
                 }
             }
             else {
+                if(i == 0 and aov != nullptr) {
+                    aov->albedo = get_environment_light(ray.direction);
+                    aov->normal = -ray.direction;
+                }
                 incomming_light += ray_color * get_environment_light(ray.direction);
                 break;
             }
@@ -139,18 +256,37 @@ private:
         return incomming_light;
     }
 
-    // start a thread to ray trace pixels in range (from_x, from_y) to (to_x, to_y)
-    void drawing_in_rectangle(int from_x, int to_x, int from_y, int to_y) {
-        for(int x = from_x; x <= to_x; x++)
+    bool frame_cancelled() {
+        return epoch.load(std::memory_order_relaxed) != frame_epoch;
+    }
+
+    // ray trace pixels in range (from_x, from_y) to (to_x, to_y), returns true if any pixel changed
+    // a pixel is either fully traced and accumulated or not touched, so stopping between
+    // two pixels leaves every sample_count matching its color
+    bool drawing_in_rectangle(int from_x, int to_x, int from_y, int to_y) {
+        bool touched = false;
+        for(int x = from_x; x <= to_x; x++) {
+            if(frame_cancelled()) return touched;
             for(int y = from_y; y <= to_y; y++) {
                 Vec3 draw_color = BLACK;
 
+                // in a preview frame only the pixels on the grid of the level that no coarser level traced
+                if(preview_block > 0 and (x % preview_block != 0 or y % preview_block != 0 or sample_count[x + y * WIDTH] > 0))
+                    continue;
+
+                // adaptive sampling, skip the pixels that are quiet enough
+                if(adaptive_threshold > 0 and pixel_noise(x + y * WIDTH) < adaptive_threshold)
+                    continue;
+
                 int lazy_mode_condition = x + y * WIDTH + (WIDTH % 2 == 0 and y % 2 == 1);
                 if(!lazy_mode or lazy_mode_condition % 2 != rendered_count % 2) {
+                    // the random numbers only depend on the pixel and the frame
+                    seed_random(random_seed + frame_index * 0xd1b54a32d192ed03ull + (uint64_t)(x + y * WIDTH));
                     // make more ray per pixel for more accurate color in one frame
                     // but decrease performance
+                    AOVSample sample;
                     for(int k = 1; k <= camera.ray_per_pixel; k++) {
-                        draw_color += ray_trace(x, y);
+                        draw_color += ray_trace(x, y, k == 1 ? &sample : nullptr);
                     }
                     draw_color /= camera.ray_per_pixel;
 
@@ -158,14 +294,99 @@ private:
                     if(draw_color.x != draw_color.x or draw_color.y != draw_color.y or draw_color.z != draw_color.z)
                         continue;
 
+                    int p = x + y * WIDTH;
+                    // right after a reprojection a different first hit means the history belongs to something else
+                    if(reprojected and sample.object_id != aov.object_id[p])
+                        sample_count[p] = 0;
+
                     // progressive rendering
-                    float w = 1.0f / (rendered_count + 1.0f);
+                    float w = 1.0f / (sample_count[p] + 1.0f);
+                    // running variance of the brightness (Welford), for the noise estimate
+                    float lum = luminance(draw_color);
+                    float old_mean = sample_count[p] == 0 ? lum : luminance(screen_color[x][y]);
+                    float new_mean = old_mean + (lum - old_mean) * w;
+                    luminance_m2[p] = sample_count[p] == 0 ? 0 : luminance_m2[p] + (lum - old_mean) * (lum - new_mean);
+
                     // later frames have less impact than previous frames
-                    if(screen_color[x][y] != BLACK)
-                        draw_color = screen_color[x][y] * (1 - w) + draw_color * w;
+                    // the first sample has w = 1 so whatever was there before is replaced
+                    draw_color = screen_color[x][y] * (1 - w) + draw_color * w;
                     screen_color[x][y] = draw_color;
+                    sample_count[p]++;
+                    touched = true;
+
+                    // albedo and normal are averaged like the color, so they stay anti-aliased
+                    aov.albedo[p] = aov.albedo[p] * (1 - w) + sample.albedo * w;
+                    aov.normal[p] = aov.normal[p] * (1 - w) + sample.normal * w;
+                    aov.depth[p] = sample.depth;
+                    aov.object_id[p] = sample.object_id;
+
+                    if(preview_block > 1) fill_preview_block(x, y, preview_block);
                 }
             }
+        }
+        return touched;
+    }
+
+    // the pixels of `region` inside the image, to_x and to_y exclusive
+    void region_bounds(int& from_x, int& from_y, int& to_x, int& to_y) {
+        bool whole = region.width <= 0 or region.height <= 0;
+        from_x = whole ? 0 : std::max(region.x, 0);
+        from_y = whole ? 0 : std::max(region.y, 0);
+        to_x = whole ? WIDTH : std::min(region.x + region.width, WIDTH);
+        to_y = whole ? HEIGHT : std::min(region.y + region.height, HEIGHT);
+    }
+
+    // a draw thread, takes tiles until there are none left or the frame is cancelled
+    void draw_tiles() {
+        int columns = tile_columns();
+        int rows = tile_rows();
+        int region_x, region_y, region_to_x, region_to_y;
+        region_bounds(region_x, region_y, region_to_x, region_to_y);
+        for(int tile = next_tile++; tile < columns * rows and !frame_cancelled(); tile = next_tile++) {
+            int from_x = std::max(tile % columns * DRAW_TILE_SIZE, region_x);
+            int from_y = std::max(tile / columns * DRAW_TILE_SIZE, region_y);
+            int to_x = std::min(tile % columns * DRAW_TILE_SIZE + DRAW_TILE_SIZE, region_to_x);
+            int to_y = std::min(tile / columns * DRAW_TILE_SIZE + DRAW_TILE_SIZE, region_to_y);
+            if(from_x >= to_x or from_y >= to_y) continue;
+            if(drawing_in_rectangle(from_x, to_x - 1, from_y, to_y - 1)) {
+                tile_dirty[tile] = 1;
+                // preview blocks can reach into other tiles, their frames are not worth writing anyway
+                // a sink that can not go back, like a PNG, would get the same tiles again every frame
+                if(tile_sink != nullptr and preview_block == 0 and tile_sink->random_access())
+                    tile_sink->write_tile(screen_color, from_x, from_y, to_x - from_x, to_y - from_y);
+            }
+        }
+        running_threads--;
+    }
+
+    static float luminance(Vec3 c) {
+        return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    }
+    // standard error of the brightness of pixel p relative to the brightness, on a
+    // 0.1 floor so black pixels do not count as infinitely noisy. 1 until there are enough samples
+    float pixel_noise(int p) {
+        int n = sample_count[p];
+        if(n < ADAPTIVE_MIN_SAMPLES) return 1;
+        float standard_error = sqrtf(luminance_m2[p] / ((n - 1.0f) * n));
+        int x = p % WIDTH, y = p / WIDTH;
+        return fminf(standard_error / fmaxf(luminance(screen_color[x][y]), 0.1f), 1);
+    }
+
+    // copy pixel (x, y) to the untraced pixels of its block
+    // blocks of one level never overlap and their untraced pixels are not traced this frame
+    // so threads never write the same pixel
+    void fill_preview_block(int x, int y, int block) {
+        int p = x + y * WIDTH;
+        for(int bx = x; bx < std::min(x + block, WIDTH); bx++)
+            for(int by = y; by < std::min(y + block, HEIGHT); by++) {
+                int q = bx + by * WIDTH;
+                if(sample_count[q] > 0) continue;
+                screen_color[bx][by] = screen_color[x][y];
+                aov.albedo[q] = aov.albedo[p];
+                aov.normal[q] = aov.normal[p];
+                aov.depth[q] = aov.depth[p];
+                aov.object_id[q] = aov.object_id[p];
+            }
     }
 
 public:
@@ -174,48 +395,108 @@ public:
 
     // current rendered frames
     int rendered_count = 0;
+    // frames started since the ReyTreycer was made (or since the loaded checkpoint was made)
+    // seeds the random numbers of each frame
+    uint64_t frame_index = 0;
+    // renders with the same seed, scene and settings give the same image
+    uint64_t random_seed = 0;
+
+    // only draw the pixels in this rectangle, the default draws the whole image
+    RenderRegion region;
 
     std::vector<std::vector<Vec3>> screen_color;
+    // first hit albedo, normal, depth and object id of every pixel, written with screen_color
+    AOVBuffers aov;
+    // how many frames are accumulated in every pixel, x + y * WIDTH
+    std::vector<int> sample_count;
+    // sum of squared differences from the mean brightness of every pixel, x + y * WIDTH
+    std::vector<float> luminance_m2;
+    // average relative noise of the image after the last frame, see pixel_noise()
+    float noise_estimate = 1;
+    // skip pixels whose relative noise is below this, 0 traces every pixel every frame
+    float adaptive_threshold = 0;
+
+    // keep the accumulated image when the camera moves by reprojecting it, instead of
+    // mixing the old view in. the render does not need a restart (rendered_count = 0) on camera moves
+    bool temporal_reprojection = false;
+    // moved pixels keep at most this many samples so the image catches up with the new view
+    int temporal_history_cap = 16;
+
+    // denoise screen_color into denoised_color after every frame
+    bool denoise = false;
+    DenoiseSettings denoise_settings;
+    std::vector<std::vector<Vec3>> denoised_color;
+    // rendered_count when denoised_color was made
+    int denoised_count = -1;
 
     // environment variable
     float environment_refractive_index = RI_AIR;
     Vec3 up_sky_color = Vec3(0.51f, 0.7f, 1.0f) * 1.0f;
     Vec3 down_sky_color = WHITE;
 
+    // after a restart trace one pixel per block of this size and fill the block with it,
+    // then halve the block every frame down to single pixels, each level only traces the pixels
+    // the coarser ones did not. 0 or 1 turns it off
+    int preview_block_size = 0;
+
     // ray trace pixel like a checker board per frame
     // reduce render time by half
     // only turn on for debug/design
     bool lazy_mode = false;
 
+    // rasterize the first hit of every pixel instead of tracing it
+    // only used while the camera has no aperture and no diverge_strength
+    bool use_visibility_buffer = true;
+
+    // every tile drawn outside the preview is written here as soon as it is done, so the file
+    // always holds the latest image. only sinks with random_access() are streamed to
+    TileSink* tile_sink = nullptr;
+
+    // every published frame is also written here, for other processes to watch the render
+    // written on the thread that finishes the frame, only the tiles that changed
+    SharedFramebuffer* shared_framebuffer = nullptr;
+
+    // save a checkpoint to checkpoint_file after every checkpoint_interval finished frames, 0 never does
+    int checkpoint_interval = 0;
+    std::string checkpoint_file;
+
     // all object pointers in the scene
     std::vector<Object*> objects;
+    // owns objects and textures made with scene.make<T>()
+    // objects still need add_object() to be rendered
+    Scene scene;
 
     // the camera
     Camera camera;
 
-    // NOTE: thread_count should be even
     ReyTreycer(int width = 1280, int height = 720, int thread_count = 4) {
         WIDTH = width;
         HEIGHT = height;
         camera.WIDTH = width;
         camera.HEIGHT = height;
-
-        std::vector<int> dividers = get_dividers(thread_count);
-        column_threads = dividers[int(dividers.size()/2)];
-        row_threads = thread_count / column_threads;
-        thread_width = width / column_threads;
-        thread_height = height / row_threads;
+        this->thread_count = std::max(thread_count, 1);
+        build_pool.reset(new ThreadPool(this->thread_count));
 
         screen_color = std::vector<std::vector<Vec3>>(MAX_WIDTH, v_height);
     }
+    ReyTreycer(const ReyTreycer&) = delete;
+    ReyTreycer& operator=(const ReyTreycer&) = delete;
+    ~ReyTreycer() {
+        cancel_frame();
+        wait_frame();
+        if(render_thread.joinable()) render_thread.join();
+    }
     // get the object on pixel (x, y)
+    // the objects may have changed since the last frame so they are grouped again here
     HitInfo get_collision_on(int x, int y) {
+        PrimitiveArrays prims;
+        prims.build(objects);
         Ray ray = camera.ray(x, y);
-        return ray_collision(&ray);
+        return ray_collision(&ray, prims);
     }
-    // get the number of running draw thread
+    // get the number of draw threads still working on the current frame
     int get_running_thread_count() {
-        return threads.size();
+        return running_threads;
     }
     // update screen geometry
     void update_size(int width, int height) {
@@ -223,40 +504,558 @@ public:
         HEIGHT = height;
         camera.WIDTH = width;
         camera.HEIGHT = height;
-        thread_width = width / column_threads;
-        thread_height = height / row_threads;
     }
 
-    // draw and calculate delay
-    void draw_frame() {
+    // stop the frame being drawn after the pixels its threads are on, safe from any thread
+    // the pixels it finished keep their samples, the frame is not counted in rendered_count
+    void cancel_frame() {
+        epoch++;
+    }
+    // start the render over and cancel the frame being drawn, safe from any thread
+    // rendered_count goes to 0 when the next frame starts, see frames_since_restart()
+    void restart_render() {
+        restart_requested = true;
+        cancel_frame();
+    }
+    // the camera moved, safe from any thread. with temporal_reprojection the image is kept and
+    // only the frame count starts over (at 1, 0 would clear the image), otherwise the render restarts
+    void camera_moved() {
+        if(!temporal_reprojection) {
+            restart_render();
+            return;
+        }
+        camera_move_requested = true;
+        cancel_frame();
+    }
+    // rendered_count with the restart or camera move asked for since the last frame already counted
+    // only call it from the thread drawing the frames or while none is drawn
+    int frames_since_restart() {
+        if(restart_requested) return 0;
+        if(camera_move_requested) return std::min(rendered_count, 1);
+        return rendered_count;
+    }
+    // how many samples per pixel the frames since the restart added, divided by ray_per_pixel
+    // the preview frames after a restart only trace every pixel once together, so they count as one
+    int sampled_frames() {
+        int frames = frames_since_restart();
+        int levels = 0;
+        for(int block = preview_block_size; block > 1; block >>= 1) levels++;
+        return std::max(frames - levels, 0);
+    }
+
+    int tile_columns() {
+        return (WIDTH + DRAW_TILE_SIZE - 1) / DRAW_TILE_SIZE;
+    }
+    int tile_rows() {
+        return (HEIGHT + DRAW_TILE_SIZE - 1) / DRAW_TILE_SIZE;
+    }
+
+    // draw one frame, returns false if it was cancelled before all pixels were drawn
+    bool draw_frame() {
+        return draw_frame_since(epoch);
+    }
+    // draw one frame that is cancelled by any cancel_frame() after `start_epoch` was read
+    bool draw_frame_since(int start_epoch) {
+        frame_epoch = start_epoch;
+        if(restart_requested.exchange(false)) rendered_count = 0;
+        if(camera_move_requested.exchange(false)) rendered_count = std::min(rendered_count, 1);
+
+        // only objects that changed since the last frame have their boxes refitted
+        // and are rasterized again into the visibility buffer
+        object_changes.resize(objects.size());
+        for(int i = 0; i < (int)objects.size(); i++) {
+            objects[i]->id = i;
+            object_changes[i] = objects[i]->take_changes();
+        }
+        primitives.build(objects);
+        bool meshes_changed = false;
+        changed_meshes.assign(primitives.meshes.size(), 0);
+        for(int m = 0; m < (int)primitives.meshes.size(); m++) {
+            changed_meshes[m] = object_changes[primitives.meshes[m]->id] != 0;
+            meshes_changed = meshes_changed or changed_meshes[m];
+        }
+        aov.resize(WIDTH, HEIGHT);
+        if((int)sample_count.size() < WIDTH * HEIGHT) {
+            sample_count.resize(WIDTH * HEIGHT, 0);
+            luminance_m2.resize(WIDTH * HEIGHT, 0);
+        }
+
+        // a restarted render starts every pixel over, a moved camera takes its history along
+        CameraState now = camera.state();
+        reprojected = false;
+        if(rendered_count == 0 or (temporal_reprojection and (now.width != last_camera.width or now.height != last_camera.height)))
+            std::fill(sample_count.begin(), sample_count.begin() + WIDTH * HEIGHT, 0);
+        else if(temporal_reprojection and now != last_camera) {
+            reprojector.run(screen_color, sample_count, luminance_m2, aov, last_camera, now, temporal_history_cap);
+            reprojected = true;
+            all_tiles_dirty = true;
+        }
+        last_camera = now;
+
+        // counted from the restart, 8 -> 4 -> 2 -> 1 -> 0 (normal frames)
+        preview_block = rendered_count < 31 ? preview_block_size >> rendered_count : 0;
+        if(preview_block == 1 and preview_block_size <= 1) preview_block = 0;
+        // blocks bigger than a tile are filled into the tiles next to the one that traced them
+        if(preview_block > DRAW_TILE_SIZE) all_tiles_dirty = true;
+
+        int tiles = tile_columns() * tile_rows();
+        if((int)tile_dirty.size() != tiles) {
+            tile_dirty.assign(tiles, 0);
+            all_tiles_dirty = true;
+        }
+
+        // the buffer is kept while the camera does not move, changed meshes are drawn again
+        visibility_active = use_visibility_buffer and camera.aperture == 0 and camera.diverge_strength == 0;
+        if(visibility_active and !visibility.matches(camera, primitives))
+            visibility.build(camera, primitives, thread_count);
+        else if(visibility_active and meshes_changed)
+            visibility.update(primitives, changed_meshes, thread_count);
+        else if(meshes_changed)
+            visibility.invalidate();
+
+        if(rendered_count == 0) render_first_frame = frame_index;
+
         // start all draw thread
-        for(int w = 0; w < column_threads; w++)
-            for(int h = 0; h < row_threads; h++) {
-                int draw_from_x = w * thread_width;
-                int draw_to_x = (w + 1) * thread_width - 1;
-                int draw_from_y = h * thread_height;
-                int draw_to_y = (h + 1) * thread_height - 1;
-                threads.push_back(std::thread(&ReyTreycer::drawing_in_rectangle, this, draw_from_x, draw_to_x, draw_from_y, draw_to_y));
-            }
+        next_tile = 0;
+        running_threads = thread_count;
+        for(int i = 0; i < thread_count; i++)
+            threads.push_back(std::thread(&ReyTreycer::draw_tiles, this));
         // wait till all threads are finished
         for(int i = 0; i < (int)threads.size(); i++)
             threads[i].join();
         // clear the vector for later use
         threads.clear();
+        // a cancelled frame used its random numbers on some pixels already, the next one takes new ones
+        frame_index++;
 
+        // a cancelled frame is not counted, the next one goes over the same pixels again
+        if(frame_cancelled()) return false;
         rendered_count++;
+
+        int from_x, from_y, to_x, to_y;
+        region_bounds(from_x, from_y, to_x, to_y);
+        double total_noise = 0;
+        for(int y = from_y; y < to_y; y++)
+            for(int x = from_x; x < to_x; x++)
+                total_noise += pixel_noise(x + y * WIDTH);
+        noise_estimate = total_noise / std::max((to_x - from_x) * (to_y - from_y), 1);
+
+        if(denoise) denoise_frame();
+        publish_frame();
+        if(checkpoint_interval > 0 and !checkpoint_file.empty() and rendered_count % checkpoint_interval == 0)
+            save_checkpoint(checkpoint_file);
+        return true;
+    }
+
+    // draw a frame on a background thread, like draw_frame() but returns right away
+    // `on_done` is called on that thread with the result of draw_frame() once the frame ended
+    // if a frame is already being drawn, nothing is started and its future is returned
+    // the camera, objects and settings must not be changed while the frame runs, except through
+    // cancel_frame() and restart_render()
+    std::shared_future<bool> start_frame(std::function<void(bool)> on_done = nullptr) {
+        std::lock_guard<std::mutex> lock(render_mutex);
+        if(rendering) return current_frame;
+        if(render_thread.joinable()) render_thread.join();
+
+        rendering = true;
+        auto done = std::make_shared<std::promise<bool>>();
+        current_frame = done->get_future().share();
+        // a cancel_frame() right after this returns must stop the frame even if its thread did not start yet
+        int start_epoch = epoch;
+        render_thread = std::thread([this, done, on_done, start_epoch]() {
+            bool finished = draw_frame_since(start_epoch);
+            if(on_done) on_done(finished);
+            rendering = false;
+            done->set_value(finished);
+        });
+        return current_frame;
+    }
+    // true while a frame started with start_frame() is being drawn
+    bool frame_running() {
+        return rendering;
+    }
+    // wait for the frame of start_frame(), returns its result, true if none was started
+    bool wait_frame() {
+        std::shared_future<bool> f;
+        {
+            std::lock_guard<std::mutex> lock(render_mutex);
+            f = current_frame;
+        }
+        return f.valid() ? f.get() : true;
+    }
+
+    // the last finished frame, nullptr before the first one
+    // safe from any thread while the next frame is drawn, a held frame never changes
+    std::shared_ptr<const RenderedFrame> front_frame() {
+        return std::atomic_load(&front);
+    }
+    // copy the current image (denoised_color if denoise is on) into a new front frame
+    // draw_frame() does it after every finished frame, call it after changing the image
+    // in between, for example after denoise_frame(), while no frame is being drawn
+    void publish_frame() {
+        std::lock_guard<std::mutex> lock(publish_mutex);
+        // the old back frame is reused unless someone still reads it
+        // use_count() is a relaxed read, the fence makes the last reader's accesses happen before ours
+        if(!back or back.use_count() > 1) back = std::make_shared<RenderedFrame>();
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        bool use_denoised = denoise and denoised_count == rendered_count;
+        const std::vector<std::vector<Vec3>>& source = use_denoised ? denoised_color : screen_color;
+
+        // stamp the tiles that changed, the denoiser changes all of them
+        int columns = tile_columns(), rows = tile_rows();
+        int id = ++published_frames;
+        if((int)tile_dirty.size() != columns * rows) tile_dirty.assign(columns * rows, 1);
+        if((int)tile_version.size() != columns * rows) all_tiles_dirty = true;
+        if(use_denoised or use_denoised != published_denoised) all_tiles_dirty = true;
+        tile_version.resize(columns * rows);
+        for(int t = 0; t < columns * rows; t++) {
+            if(all_tiles_dirty or tile_dirty[t]) tile_version[t] = id;
+            tile_dirty[t] = 0;
+        }
+        all_tiles_dirty = false;
+        published_denoised = use_denoised;
+
+        // the back frame is a few frames old, only the tiles changed since then are copied
+        bool full_copy = back->width != WIDTH or back->height != HEIGHT;
+        back->color.resize(WIDTH);
+        for(int x = 0; x < WIDTH; x++) back->color[x].resize(HEIGHT, VEC3_ZERO);
+        for(int t = 0; t < columns * rows; t++) {
+            if(!full_copy and tile_version[t] <= back->frame_id) continue;
+            int from_x = t % columns * DRAW_TILE_SIZE, to_x = std::min(from_x + DRAW_TILE_SIZE, WIDTH);
+            int from_y = t / columns * DRAW_TILE_SIZE, to_y = std::min(from_y + DRAW_TILE_SIZE, HEIGHT);
+            for(int x = from_x; x < to_x; x++)
+                std::copy(source[x].begin() + from_y, source[x].begin() + to_y, back->color[x].begin() + from_y);
+        }
+        back->width = WIDTH;
+        back->height = HEIGHT;
+        back->rendered_count = rendered_count;
+        back->noise = noise_estimate;
+        back->denoised = use_denoised;
+        back->frame_id = id;
+        back->tile_columns = columns;
+        back->tile_rows = rows;
+        back->tile_version = tile_version;
+
+        if(shared_framebuffer != nullptr) shared_framebuffer->write(*back);
+
+        std::shared_ptr<const RenderedFrame> old = std::atomic_exchange(&front, std::shared_ptr<const RenderedFrame>(back));
+        back = std::const_pointer_cast<RenderedFrame>(old);
+    }
+
+    // keep drawing frames until the budget runs out, from where the render is now
+    // with no limit set it draws a single frame
+    RenderReport render_until(RenderBudget budget) {
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed = [&start]() {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        };
+        float old_adaptive_threshold = adaptive_threshold;
+        if(budget.noise > 0 and budget.adaptive) adaptive_threshold = budget.noise;
+
+        RenderReport report;
+        double last_frame = 0;
+        while(true) {
+            if(budget.samples_per_pixel > 0 and sampled_frames() * camera.ray_per_pixel >= budget.samples_per_pixel) break;
+            if(budget.noise > 0 and frames_since_restart() > 0 and noise_estimate <= budget.noise) break;
+            if(budget.seconds > 0 and report.frames > 0 and elapsed() + last_frame > budget.seconds) break;
+
+            double frame_start = elapsed();
+            // cancelled from another thread
+            if(!draw_frame()) break;
+            last_frame = elapsed() - frame_start;
+            report.frames++;
+
+            if(budget.seconds <= 0 and budget.samples_per_pixel <= 0 and budget.noise <= 0) break;
+        }
+
+        adaptive_threshold = old_adaptive_threshold;
+        report.seconds = elapsed();
+        report.noise = noise_estimate;
+        return report;
+    }
+    // denoise the current screen_color into denoised_color
+    void denoise_frame() {
+        std::lock_guard<std::mutex> lock(denoise_mutex);
+        if(denoised_color.empty())
+            denoised_color = std::vector<std::vector<Vec3>>(MAX_WIDTH, v_height);
+        denoiser.run(screen_color, aov, denoised_color, denoise_settings, thread_count);
+        denoised_count = rendered_count;
+    }
+
+    // a hash of what a texture looks like, the same in every process that loaded the same texture
+    // image textures hash their pixels, tiled ones the image they were made from and
+    // procedural ones what their function returns on a few fixed points
+    static uint64_t texture_hash(Texture* texture) {
+        if(texture == nullptr) return 0;
+        std::vector<float> key = {(float)texture->get_type()};
+        switch(texture->get_type()) {
+            case TEX_COLOR: {
+                Vec3 c = ((ColorTexture*)texture)->color;
+                key.insert(key.end(), {c.x, c.y, c.z});
+                break;
+            }
+            case TEX_IMAGE: {
+                ImageTexture* image = (ImageTexture*)texture;
+                size_t bytes = (size_t)image->image_width * image->image_height * image->channels;
+                uint64_t pixels = image->pixel_data != nullptr ? hash_bytes((const char*)image->pixel_data, bytes) : 0;
+                uint64_t values[5] = {(uint64_t)image->image_width, (uint64_t)image->image_height,
+                                      (uint64_t)image->channels, (uint64_t)image->get_mip_level_count(), pixels};
+                return hash_bytes((const char*)values, sizeof(values));
+            }
+            case TEX_TILED: {
+                TiledTexture* tiled = (TiledTexture*)texture;
+                uint64_t values[2] = {tiled->get_source_hash(), tiled->get_source_size()};
+                return hash_bytes((const char*)values, sizeof(values));
+            }
+            case TEX_PROC:
+                for(int i = 0; i < 16; i++) {
+                    SurfaceInfo h;
+                    h.u = (i % 4 + 0.37f) / 4;
+                    h.v = (i / 4 + 0.61f) / 4;
+                    h.normal = Vec3(h.u - 0.5f, h.v - 0.5f, 1).normalize();
+                    h.object_rotation = Vec3(h.v, h.u, 0);
+                    Vec3 c = texture->get_texture(h);
+                    key.insert(key.end(), {c.x, c.y, c.z});
+                }
+                break;
+        }
+        return hash_bytes((const char*)key.data(), key.size() * sizeof(float));
+    }
+
+    // a hash of the scene the samples belong to: the view and lens, the sky, the environment and
+    // every object with its transform, material, texture and triangles
+    // the same in every process that loaded the same scene
+    uint64_t scene_hash() {
+        std::string key;
+        auto put = [&key](const void* data, size_t size) {
+            key.append((const char*)data, size);
+        };
+        CameraState view = camera.state();
+        int values[2] = {camera.max_ray_bounce_count, (int)objects.size()};
+        put(values, sizeof(values));
+        put(&view.position, sizeof(Vec3));
+        put(&view.right, sizeof(Vec3));
+        put(&view.up, sizeof(Vec3));
+        put(&view.look, sizeof(Vec3));
+        put(&view.focal_length, sizeof(float));
+        float lens[5] = {camera.aperture, camera.focus_distance, camera.diverge_strength, camera.max_range,
+                         environment_refractive_index};
+        put(lens, sizeof(lens));
+        put(&up_sky_color, sizeof(Vec3));
+        put(&down_sky_color, sizeof(Vec3));
+
+        // textures are often shared, each is only hashed once
+        std::unordered_map<Texture*, uint64_t> textures;
+
+        // fields are put one by one, padding and pointers differ between processes
+        for(Object* o: objects) {
+            Vec3 transform[3] = {o->get_position(), o->get_rotation(), o->get_scale()};
+            float radius = o->get_radius();
+            bool flags[2] = {o->visible, o->is_sphere()};
+            put(transform, sizeof(transform));
+            put(&radius, sizeof(radius));
+            put(flags, sizeof(flags));
+
+            const Material& m = o->get_material();
+            float material[4] = {m.roughness, m.emission_strength, m.refractive_index, m.density};
+            bool material_flags[3] = {m.emit_light, m.transparent, m.smoke};
+            put(material, sizeof(material));
+            put(material_flags, sizeof(material_flags));
+            if(textures.count(m.texture) == 0) textures[m.texture] = texture_hash(m.texture);
+            put(&textures[m.texture], sizeof(uint64_t));
+
+            if(o->is_sphere()) continue;
+            // hashed triangle by triangle, a big mesh is not copied into the key
+            uint64_t geometry = 0;
+            for(const Triangle& t: ((Mesh*)o)->tris) {
+                Vec3 corners[6] = {t.vert[0], t.vert[1], t.vert[2], t.vert_texture[0], t.vert_texture[1], t.vert_texture[2]};
+                geometry = (geometry ^ hash_bytes((const char*)corners, sizeof(corners))) * 1099511628211ull;
+            }
+            put(&geometry, sizeof(geometry));
+        }
+        return hash_bytes(key.data(), key.size());
     }
 
+    // write the accumulated image with its sample counts, noise and AOVs, and where the random numbers are,
+    // to `filename`. call it between frames, false if the file could not be written
+    bool save_checkpoint(std::string filename) {
+        CheckpointHeader header;
+        memset((void*)&header, 0, sizeof(header));
+        memcpy(header.magic, "RTCP", 4);
+        header.version = CHECKPOINT_VERSION;
+        header.width = WIDTH;
+        header.height = HEIGHT;
+        header.rendered_count = rendered_count;
+        header.ray_per_pixel = camera.ray_per_pixel;
+        header.frame_index = frame_index;
+        header.first_frame = render_first_frame;
+        header.random_seed = random_seed;
+        header.noise_estimate = noise_estimate;
+        header.scene_hash = scene_hash();
+        header.camera = last_camera;
+        if(rendered_count == 0 or (int)sample_count.size() < WIDTH * HEIGHT) return false;
+
+        // screen_color is stored by columns, the file by rows like everything else
+        std::vector<Vec3> color(WIDTH * HEIGHT, VEC3_ZERO);
+        for(int x = 0; x < WIDTH; x++)
+            for(int y = 0; y < HEIGHT; y++)
+                color[x + y * WIDTH] = screen_color[x][y];
+
+        // write to a temporary file first so being killed while writing keeps the last checkpoint
+        size_t n = WIDTH * HEIGHT;
+        std::string tmp_name = temporary_name(filename);
+        std::ofstream f(tmp_name, std::ios::binary);
+        if(!f.is_open()) return false;
+        f.write((const char*)&header, sizeof(header));
+        f.write((const char*)color.data(), n * sizeof(Vec3));
+        f.write((const char*)sample_count.data(), n * sizeof(int));
+        f.write((const char*)luminance_m2.data(), n * sizeof(float));
+        f.write((const char*)aov.albedo.data(), n * sizeof(Vec3));
+        f.write((const char*)aov.normal.data(), n * sizeof(Vec3));
+        f.write((const char*)aov.depth.data(), n * sizeof(float));
+        f.write((const char*)aov.object_id.data(), n * sizeof(int));
+        f.close();
+        if(!f.good() or std::rename(tmp_name.c_str(), filename.c_str()) != 0) {
+            std::remove(tmp_name.c_str());
+            return false;
+        }
+        return true;
+    }
+    // continue the render saved in `filename`, the next frame draws like the one after the checkpoint would have
+    // the scene, camera, size and ray_per_pixel must be the ones the checkpoint was saved with,
+    // otherwise nothing changes and it returns false. call it while no frame is being drawn
+    bool load_checkpoint(std::string filename) {
+        std::ifstream f(filename, std::ios::binary | std::ios::ate);
+        if(!f.is_open()) return false;
+        uint64_t size = f.tellg();
+        f.seekg(0);
+
+        CheckpointHeader header;
+        if(size < sizeof(header) or !f.read((char*)&header, sizeof(header))) return false;
+        if(memcmp(header.magic, "RTCP", 4) != 0 or header.version != CHECKPOINT_VERSION
+           or header.width != WIDTH or header.height != HEIGHT or size != checkpoint_size(WIDTH, HEIGHT)
+           or header.rendered_count <= 0 or header.ray_per_pixel != camera.ray_per_pixel
+           or header.camera != camera.state() or header.scene_hash != scene_hash())
+            return false;
+
+        size_t n = WIDTH * HEIGHT;
+        std::vector<Vec3> color(n, VEC3_ZERO);
+        std::vector<int> counts(n);
+        std::vector<float> m2(n);
+        AOVBuffers loaded;
+        loaded.resize(WIDTH, HEIGHT);
+        f.read((char*)color.data(), n * sizeof(Vec3));
+        f.read((char*)counts.data(), n * sizeof(int));
+        f.read((char*)m2.data(), n * sizeof(float));
+        f.read((char*)loaded.albedo.data(), n * sizeof(Vec3));
+        f.read((char*)loaded.normal.data(), n * sizeof(Vec3));
+        f.read((char*)loaded.depth.data(), n * sizeof(float));
+        f.read((char*)loaded.object_id.data(), n * sizeof(int));
+        if(!f) return false;
+
+        for(int x = 0; x < WIDTH; x++)
+            for(int y = 0; y < HEIGHT; y++)
+                screen_color[x][y] = color[x + y * WIDTH];
+        sample_count = std::move(counts);
+        luminance_m2 = std::move(m2);
+        aov = std::move(loaded);
+        rendered_count = header.rendered_count;
+        frame_index = header.frame_index;
+        render_first_frame = header.first_frame;
+        random_seed = header.random_seed;
+        noise_estimate = header.noise_estimate;
+        last_camera = header.camera;
+        restart_requested = false;
+        camera_move_requested = false;
+        denoised_count = -1;
+        all_tiles_dirty = true;
+        return true;
+    }
+
+    // the pixels of `region` and their samples since the last restart as a standalone buffer
+    PartialBuffer partial_buffer() {
+        int from_x, from_y, to_x, to_y;
+        region_bounds(from_x, from_y, to_x, to_y);
+        PartialBuffer part;
+        part.image_width = WIDTH;
+        part.image_height = HEIGHT;
+        part.x = from_x;
+        part.y = from_y;
+        part.first_frame = render_first_frame;
+        part.end_frame = rendered_count > 0 ? frame_index : render_first_frame;
+        part.frame_count = rendered_count;
+        part.ray_per_pixel = camera.ray_per_pixel;
+        part.resize(to_x - from_x, to_y - from_y);
+        if(rendered_count == 0) return part;
+
+        for(int y = from_y; y < to_y; y++)
+            for(int x = from_x; x < to_x; x++) {
+                int p = x + y * WIDTH, q = x - from_x + (y - from_y) * part.width;
+                part.color[q] = screen_color[x][y];
+                part.sample_count[q] = sample_count[p];
+                part.luminance_m2[q] = luminance_m2[p];
+                part.aov.albedo[q] = aov.albedo[p];
+                part.aov.normal[q] = aov.normal[p];
+                part.aov.depth[q] = aov.depth[p];
+                part.aov.object_id[q] = aov.object_id[p];
+            }
+        return part;
+    }
+    // draw `frames` frames of the pixels in `rect` with the random numbers of frames first_frame onwards
+    // and return them as a partial buffer, see merge_partials(). stops early if cancelled
+    // with `resume` the render goes on from where it is, a checkpoint of the same part should be loaded then
+    // parts of the same scene and settings that differ in pixels or frames merge into
+    // what one process rendering everything would have made
+    PartialBuffer render_region(RenderRegion rect, uint64_t first_frame, int frames, bool resume = false) {
+        region = rect;
+        if(!resume or rendered_count == 0 or render_first_frame != first_frame) {
+            rendered_count = 0;
+            frame_index = first_frame;
+        }
+        // every frame has to be a full sample here
+        int old_preview_block_size = preview_block_size;
+        preview_block_size = 0;
+        while(rendered_count < frames)
+            if(!draw_frame()) break;
+        preview_block_size = old_preview_block_size;
+
+        PartialBuffer part = partial_buffer();
+        region = RenderRegion();
+        return part;
+    }
+
+    // write the whole image (denoised_color if `denoised`) to `sink` tile by tile, row of tiles after row of tiles
+    // works for every sink, begin() and finish() are left to the caller
+    void write_image(TileSink& sink, bool denoised = false) {
+        const std::vector<std::vector<Vec3>>& source = denoised ? denoised_color : screen_color;
+        for(int y = 0; y < HEIGHT; y += DRAW_TILE_SIZE)
+            for(int x = 0; x < WIDTH; x += DRAW_TILE_SIZE)
+                sink.write_tile(source, x, y, std::min(DRAW_TILE_SIZE, WIDTH - x), std::min(DRAW_TILE_SIZE, HEIGHT - y));
+    }
+
+    // the BVH of an added mesh is built on the thread pool of the ray tracer from now on,
+    // until it is removed again. a mesh must not be rebuilt after the ray tracer is gone
     void add_object(Object* obj) {
+        if(!obj->is_sphere()) ((Mesh*)obj)->bvh.settings.pool = build_pool.get();
         objects.push_back(obj);
     }
     void remove_object(Object* obj) {
         for(int i = 0; i < (int)objects.size(); i++)
             if(objects[i] == obj) {
+                if(!obj->is_sphere()) ((Mesh*)obj)->bvh.settings.pool = nullptr;
                 objects.erase(objects.begin() + i);
                 return;
             }
     }
+    // remove every object and destroy everything owned by `scene`
+    // objects not made by `scene` are only removed, not freed
+    void clear_scene() {
+        for(Object* obj: objects)
+            if(!obj->is_sphere()) ((Mesh*)obj)->bvh.settings.pool = nullptr;
+        objects.clear();
+        scene.reset();
+    }
 };
 
 // predefined procedural textures
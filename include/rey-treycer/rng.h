@@ -1,20 +1,60 @@
 #ifndef RNG_H
 #define RNG_H
 
+#include <cstdint>
 #include <random>
 #include "vec3.h"
 
+// PCG32 (pcg-random.org), small enough to be seeded for every pixel
+struct PCG32 {
+    typedef uint32_t result_type;
+    uint64_t state = 0x853c49e6748fea9bull;
+    static constexpr uint64_t increment = 0xda3e39cb94b95bdbull;
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return 0xffffffffu; }
+    result_type operator()() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + increment;
+        uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+        uint32_t rot = old >> 59;
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+};
+
+// every thread has its own generator, so the draw threads never share one
+// ReyTreycer seeds it for every pixel of every frame, which makes a pixel get the same random numbers
+// whatever the number of threads or the part of the image being drawn, and lets a render resumed
+// from a checkpoint continue with the same random numbers
+struct RandomState {
+    PCG32 generator;
+    std::normal_distribution<float> normal{0, 1};
+};
+inline RandomState& random_state() {
+    thread_local RandomState state;
+    return state;
+}
+// restart the random numbers of this thread from `seed`
+inline void seed_random(uint64_t seed) {
+    // splitmix64, so seeds that differ in one bit give unrelated sequences
+    seed += 0x9e3779b97f4a7c15ull;
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ull;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebull;
+    seed ^= seed >> 31;
+    RandomState& state = random_state();
+    state.generator.state = seed;
+    state.normal.reset();
+}
+
 // generate a uniform random value
 inline float random_val(double from = 0, double to = 1) {
-    static std::uniform_real_distribution<float> distribution(from, to);
-    static std::mt19937 generator;
-    return distribution(generator);
+    std::uniform_real_distribution<float> distribution(from, to);
+    return distribution(random_state().generator);
 }
 // generate a normal distributed random value
-inline float random_val_normal_distribution(double from = 0, double to = 1) {
-    static std::normal_distribution<float> distribution(from, to);
-    static std::mt19937 generator;
-    return distribution(generator);
+inline float random_val_normal_distribution(double mean = 0, double stddev = 1) {
+    RandomState& state = random_state();
+    return state.normal(state.generator) * stddev + mean;
 }
 // generate a random direction
 inline Vec3 random_direction() {
@@ -0,0 +1,146 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "objects.h"
+#include "texture_cache.h"
+
+// storage for many objects of one type
+// objects are placed one after another in fixed size blocks, so their addresses never change
+// and objects made one after another are next to each other in memory
+// not thread safe
+template<class T, int BLOCK_SIZE = 64>
+class Pool {
+private:
+    struct Block {
+        alignas(T) unsigned char storage[sizeof(T) * BLOCK_SIZE];
+    };
+    std::vector<std::unique_ptr<Block>> blocks;
+    int count = 0;
+
+    T* slot(int i) {
+        return reinterpret_cast<T*>(blocks[i / BLOCK_SIZE]->storage) + i % BLOCK_SIZE;
+    }
+public:
+    Pool() {}
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+    ~Pool() {
+        reset();
+    }
+
+    T* make() {
+        if(count == (int)blocks.size() * BLOCK_SIZE)
+            blocks.push_back(std::unique_ptr<Block>(new Block));
+        T* obj = new(slot(count)) T();
+        count++;
+        return obj;
+    }
+    int size() {
+        return count;
+    }
+    T& operator[](int i) {
+        return *slot(i);
+    }
+
+    // destroy every object but keep the blocks for the next objects
+    // this is O(1) for types without a destructor
+    void reset() {
+        if(!std::is_trivially_destructible<T>::value)
+            for(int i = count - 1; i >= 0; i--)
+                slot(i)->~T();
+        count = 0;
+    }
+    // same as reset() but also give the memory back
+    void release() {
+        reset();
+        blocks.clear();
+    }
+};
+
+// owns everything a scene is made of, grouped by type
+// pointers handed out stay valid until reset() or the scene is destroyed
+// the triangles of all meshes share one arena, each mesh refers to its ranges of it
+// reset() is not O(1): meshes, spheres, image and tiled textures still own vectors (BVH nodes,
+// mipmaps, tile caches...) so each of them has its destructor run, only the triangles are freed at once
+// materials are not pooled either, they are still stored by value inside each object
+class Scene {
+private:
+    // image buffers (from stbi_load or any malloc) released on reset
+    std::vector<void*> buffers;
+
+    template<class T> Pool<T>& pool_of();
+    // meshes keep their triangles in the arena, anything else needs nothing more
+    void place(void* obj) {}
+    void place(Mesh* mesh) {
+        mesh->tris.bind(&triangles);
+        mesh->default_tris.bind(&triangles);
+    }
+public:
+    TriangleArena triangles;
+    Pool<Sphere> spheres;
+    Pool<Mesh> meshes;
+    Pool<ColorTexture> color_textures;
+    Pool<ImageTexture> image_textures;
+    Pool<TiledTexture> tiled_textures;
+    Pool<ProceduralTexture> procedural_textures;
+
+    Scene() {}
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
+    ~Scene() {
+        reset();
+    }
+
+    // make a new object or texture owned by the scene, for example scene.make<Mesh>()
+    template<class T>
+    T* make() {
+        T* obj = pool_of<T>().make();
+        place(obj);
+        return obj;
+    }
+    // free this malloc'd buffer when the scene is reset, e.g. ImageTexture::pixel_data
+    void own_buffer(void* buffer) {
+        if(buffer != nullptr) buffers.push_back(buffer);
+    }
+
+    // destroy everything in the scene, the pools keep their memory for the next scene
+    // O(n) in the number of objects and textures, see the comment above the class
+    void reset() {
+        spheres.reset();
+        meshes.reset();
+        color_textures.reset();
+        image_textures.reset();
+        tiled_textures.reset();
+        procedural_textures.reset();
+        triangles.reset();
+        for(void* b: buffers) free(b);
+        buffers.clear();
+    }
+    // same as reset() but also give the memory back
+    void release() {
+        reset();
+        spheres.release();
+        meshes.release();
+        color_textures.release();
+        image_textures.release();
+        tiled_textures.release();
+        procedural_textures.release();
+        triangles.release();
+        buffers.shrink_to_fit();
+    }
+};
+template<> inline Pool<Sphere>& Scene::pool_of<Sphere>() { return spheres; }
+template<> inline Pool<Mesh>& Scene::pool_of<Mesh>() { return meshes; }
+template<> inline Pool<ColorTexture>& Scene::pool_of<ColorTexture>() { return color_textures; }
+template<> inline Pool<ImageTexture>& Scene::pool_of<ImageTexture>() { return image_textures; }
+template<> inline Pool<TiledTexture>& Scene::pool_of<TiledTexture>() { return tiled_textures; }
+template<> inline Pool<ProceduralTexture>& Scene::pool_of<ProceduralTexture>() { return procedural_textures; }
+
+#endif
@@ -0,0 +1,320 @@
+#ifndef SCENE_LOADER_H
+#define SCENE_LOADER_H
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include "rey-treycer.h"
+#include "thread_pool.h"
+
+// load a scene from a text file
+//
+// one statement per line, `#` starts a comment. vectors are written as x,y,z and angles are in degree
+//
+//   sky up|down r,g,b
+//   environment_ri value
+//   camera position x,y,z | fov | focus_distance | aperture | diverge_strength
+//          | max_range | bounces | ray_per_pixel | pan | tilt  value
+//   texture <name> color r,g,b
+//   texture <name> image <path>         mipmapped image
+//   texture <name> tiled <path>         tiled image, converted to <path>.rtt on first use
+//   texture <name> procedural checker|normal_map
+//   material <name> texture=<name> [roughness=v] [emission=v] [transparent=0|1] [ri=v] [smoke=0|1] [density=v]
+//   mesh <path> material=<name> [position=x,y,z] [rotation=x,y,z] [scale=x,y,z] [bvh=sah|lbvh|sbvh]
+//   sphere material=<name> [position=x,y,z] [rotation=x,y,z] [radius=v]
+//
+// paths are relative to the scene file. meshes are loaded through their compiled cache
+// independent meshes and images are decoded concurrently on the thread pool, big BVHs are built on it too
+// bvh=lbvh builds the tree of a mesh faster but traces slower, bvh=sbvh builds slowest and
+// traces fastest, for meshes that do not move, see bvh.h
+// the camera is initialized at the end, with the pan and tilt of the file applied
+
+struct SceneStatement {
+    int line;
+    std::vector<std::string> words;
+    // key=value arguments
+    std::map<std::string, std::string> args;
+};
+
+inline bool parse_scene_vec3(const std::string& s, Vec3* out) {
+    std::stringstream ss(s);
+    char comma1 = 0, comma2 = 0;
+    ss >> out->x >> comma1 >> out->y >> comma2 >> out->z;
+    return !ss.fail() and comma1 == ',' and comma2 == ',';
+}
+inline bool parse_scene_float(const std::string& s, float* out) {
+    std::stringstream ss(s);
+    ss >> *out;
+    return !ss.fail();
+}
+// sah, lbvh or sbvh, SAH when there is no bvh argument
+inline bool parse_scene_bvh_mode(std::map<std::string, std::string>& args, int* out) {
+    *out = BVH_BUILD_SAH;
+    if(args.count("bvh") == 0 or args["bvh"] == "sah") return true;
+    if(args["bvh"] == "lbvh") *out = BVH_BUILD_LBVH;
+    else if(args["bvh"] == "sbvh") *out = BVH_BUILD_SBVH;
+    else return false;
+    return true;
+}
+
+// everything a scene file creates is owned by rt.scene, rt.clear_scene() frees it
+inline bool load_scene(std::string filename, ReyTreycer& rt, ImageLoader load_image, ThreadPool* pool = nullptr) {
+    std::ifstream f(filename);
+    if(!f.is_open()) {
+        std::cout << "failed to load scene " << filename << '\n';
+        return false;
+    }
+    std::string directory;
+    size_t slash = filename.find_last_of('/');
+    if(slash != std::string::npos) directory = filename.substr(0, slash + 1);
+    auto resolve = [&directory](const std::string& path) {
+        return path.size() > 0 and path[0] == '/' ? path : directory + path;
+    };
+
+    auto fail = [&filename](int line, std::string message) {
+        std::cout << filename << ':' << line << ": " << message << '\n';
+        return false;
+    };
+
+    // read every statement first so the expensive loads can start together
+    std::vector<SceneStatement> statements;
+    std::string text;
+    for(int line = 1; std::getline(f, text); line++) {
+        size_t comment = text.find('#');
+        if(comment != std::string::npos) text.resize(comment);
+
+        SceneStatement st;
+        st.line = line;
+        std::stringstream ss(text);
+        std::string word;
+        while(ss >> word) {
+            size_t eq = word.find('=');
+            if(eq != std::string::npos)
+                st.args[word.substr(0, eq)] = word.substr(eq + 1);
+            else
+                st.words.push_back(word);
+        }
+        if(!st.words.empty()) statements.push_back(st);
+    }
+
+    std::unique_ptr<ThreadPool> local_pool;
+    if(pool == nullptr) {
+        local_pool.reset(new ThreadPool());
+        pool = local_pool.get();
+    }
+
+    // start decoding every distinct mesh and image
+    // the workers only decode, everything is put into rt.scene on this thread afterwards
+    std::map<std::string, std::future<Mesh>> meshes;
+    std::map<std::string, std::future<std::shared_ptr<ImageTexture>>> images;
+    std::map<std::string, std::future<bool>> tiled_images;
+    for(SceneStatement& st: statements) {
+        if(st.words[0] == "mesh" and st.words.size() >= 2) {
+            std::string path = resolve(st.words[1]);
+            BVHBuildSettings bvh;
+            parse_scene_bvh_mode(st.args, &bvh.mode);
+            bvh.pool = pool;
+            std::string key = std::to_string(bvh.mode) + ":" + path;
+            if(meshes.count(key) == 0)
+                meshes[key] = pool->submit([path, bvh]() { return load_compiled_mesh(path, nullptr, 1, bvh); });
+        }
+        else if(st.words[0] == "texture" and st.words.size() >= 4 and st.words[2] == "image") {
+            std::string path = resolve(st.words[3]);
+            if(images.count(path) == 0)
+                images[path] = pool->submit([path, load_image]() {
+                    auto tex = std::make_shared<ImageTexture>();
+                    tex->pixel_data = load_image(path.c_str(), &(tex->image_width), &(tex->image_height), &(tex->channels));
+                    if(tex->pixel_data == nullptr) return std::shared_ptr<ImageTexture>();
+                    tex->generate_mipmap();
+                    return tex;
+                });
+        }
+        else if(st.words[0] == "texture" and st.words.size() >= 4 and st.words[2] == "tiled") {
+            std::string path = resolve(st.words[3]);
+            // opening once makes sure the tiled file exists, converting the image if needed
+            if(tiled_images.count(path) == 0)
+                tiled_images[path] = pool->submit([path, load_image]() {
+                    TiledTexture probe;
+                    return open_tiled_texture(probe, path, load_image);
+                });
+        }
+    }
+    // wait for all of them before building anything
+    std::map<std::string, Mesh> loaded_meshes;
+    std::map<std::string, Texture*> loaded_images;
+    for(auto& m: meshes) loaded_meshes[m.first] = pool->wait(m.second);
+
+    // move, rotate and scale the meshes on the pool too, a SBVH is then built once on the final vertices
+    // meshes without a transform keep the tree they were loaded with
+    std::map<int, std::future<Mesh>> placed_meshes;
+    for(SceneStatement& st: statements) {
+        if(st.words[0] != "mesh" or st.words.size() != 2) continue;
+        std::map<std::string, std::string>& args = st.args;
+        Vec3 position = VEC3_ZERO, rotation = VEC3_ZERO, scale = Vec3(1, 1, 1);
+        bool has_scale = args.count("scale") and parse_scene_vec3(args["scale"], &scale);
+        bool has_rotation = args.count("rotation") and parse_scene_vec3(args["rotation"], &rotation);
+        bool has_position = args.count("position") and parse_scene_vec3(args["position"], &position);
+        rotation = Vec3(deg2rad(rotation.x), deg2rad(rotation.y), deg2rad(rotation.z));
+        int bvh_mode;
+        parse_scene_bvh_mode(args, &bvh_mode);
+        const Mesh* loaded = &loaded_meshes[std::to_string(bvh_mode) + ":" + resolve(st.words[1])];
+        if(loaded->tris.empty() or !(has_scale or has_rotation or has_position)) continue;
+
+        placed_meshes[st.line] = pool->submit([=]() {
+            Mesh mesh = *loaded;
+            if(has_scale) mesh.set_scale(scale);
+            if(has_rotation) mesh.set_rotation(rotation);
+            if(has_position) mesh.set_position(position);
+            mesh.bvh.settings.pool = pool;
+            mesh.calculate_AABB();
+            // the pool may be gone by the time the tree is built again
+            mesh.bvh.settings.pool = nullptr;
+            return mesh;
+        });
+    }
+    for(auto& i: images) {
+        std::shared_ptr<ImageTexture> decoded = pool->wait(i.second);
+        loaded_images["image:" + i.first] = nullptr;
+        if(!decoded) continue;
+        ImageTexture* tex = rt.scene.make<ImageTexture>();
+        *tex = std::move(*decoded);
+        rt.scene.own_buffer(tex->pixel_data);
+        loaded_images["image:" + i.first] = tex;
+    }
+    for(auto& i: tiled_images) {
+        loaded_images["tiled:" + i.first] = nullptr;
+        if(!pool->wait(i.second)) continue;
+        TiledTexture* tex = rt.scene.make<TiledTexture>();
+        if(tex->open(i.first + ".rtt"))
+            loaded_images["tiled:" + i.first] = tex;
+    }
+
+    std::map<std::string, Texture*> textures;
+    std::map<std::string, Material> materials;
+    std::vector<Object*> objects;
+    float pan = 0, tilt = 0;
+    bool ok = true;
+
+    for(SceneStatement& st: statements) {
+        const std::vector<std::string>& w = st.words;
+        std::map<std::string, std::string>& args = st.args;
+        Vec3 v = VEC3_ZERO;
+        float value = 0;
+
+        if(w[0] == "sky" and w.size() == 3 and parse_scene_vec3(w[2], &v)) {
+            if(w[1] == "up") rt.up_sky_color = v;
+            else if(w[1] == "down") rt.down_sky_color = v;
+            else ok = fail(st.line, "unknown sky color " + w[1]);
+        }
+        else if(w[0] == "environment_ri" and w.size() == 2 and parse_scene_float(w[1], &value)) {
+            rt.environment_refractive_index = value;
+        }
+        else if(w[0] == "camera" and w.size() == 3) {
+            Camera& c = rt.camera;
+            if(w[1] == "position" and parse_scene_vec3(w[2], &v)) c.position = v;
+            else if(!parse_scene_float(w[2], &value)) ok = fail(st.line, "invalid camera value");
+            else if(w[1] == "fov") c.FOV = value;
+            else if(w[1] == "focus_distance") c.focus_distance = value;
+            else if(w[1] == "aperture") c.aperture = value;
+            else if(w[1] == "diverge_strength") c.diverge_strength = value;
+            else if(w[1] == "max_range") c.max_range = value;
+            else if(w[1] == "bounces") c.max_ray_bounce_count = value;
+            else if(w[1] == "ray_per_pixel") c.ray_per_pixel = value;
+            else if(w[1] == "pan") pan = deg2rad(value);
+            else if(w[1] == "tilt") tilt = deg2rad(value);
+            else ok = fail(st.line, "unknown camera setting " + w[1]);
+        }
+        else if(w[0] == "texture" and w.size() >= 4) {
+            const std::string& name = w[1];
+            if(w[2] == "color" and parse_scene_vec3(w[3], &v)) {
+                ColorTexture* tex = rt.scene.make<ColorTexture>();
+                tex->color = v;
+                textures[name] = tex;
+            }
+            else if(w[2] == "image" or w[2] == "tiled") {
+                Texture* tex = loaded_images[w[2] + ':' + resolve(w[3])];
+                if(tex == nullptr) ok = fail(st.line, "failed to load image " + w[3]);
+                textures[name] = tex;
+            }
+            else if(w[2] == "procedural" and (w[3] == "checker" or w[3] == "normal_map")) {
+                ProceduralTexture* tex = rt.scene.make<ProceduralTexture>();
+                if(w[3] == "checker") tex->set_function(&checker);
+                else tex->set_function(&normal_map);
+                textures[name] = tex;
+            }
+            else ok = fail(st.line, "invalid texture " + name);
+        }
+        else if(w[0] == "material" and w.size() == 2) {
+            Material mat;
+            if(textures.count(args["texture"]) == 0 or textures[args["texture"]] == nullptr) {
+                ok = fail(st.line, "unknown texture " + args["texture"]);
+                continue;
+            }
+            mat.texture = textures[args["texture"]];
+            if(args.count("roughness")) parse_scene_float(args["roughness"], &mat.roughness);
+            if(args.count("emission")) {
+                parse_scene_float(args["emission"], &mat.emission_strength);
+                mat.emit_light = mat.emission_strength > 0;
+            }
+            if(args.count("transparent")) mat.transparent = args["transparent"] == "1";
+            if(args.count("ri")) parse_scene_float(args["ri"], &mat.refractive_index);
+            if(args.count("smoke")) mat.smoke = args["smoke"] == "1";
+            if(args.count("density")) parse_scene_float(args["density"], &mat.density);
+            materials[w[1]] = mat;
+        }
+        else if((w[0] == "mesh" and w.size() == 2) or (w[0] == "sphere" and w.size() == 1)) {
+            if(materials.count(args["material"]) == 0) {
+                ok = fail(st.line, "unknown material " + args["material"]);
+                continue;
+            }
+            Vec3 position = VEC3_ZERO, rotation = VEC3_ZERO, scale = Vec3(1, 1, 1);
+            if(args.count("position") and !parse_scene_vec3(args["position"], &position))
+                ok = fail(st.line, "invalid position");
+            if(args.count("rotation") and !parse_scene_vec3(args["rotation"], &rotation))
+                ok = fail(st.line, "invalid rotation");
+            rotation = Vec3(deg2rad(rotation.x), deg2rad(rotation.y), deg2rad(rotation.z));
+
+            if(w[0] == "sphere") {
+                Sphere* sphere = rt.scene.make<Sphere>();
+                float radius = 1;
+                if(args.count("radius")) parse_scene_float(args["radius"], &radius);
+                sphere->set_radius(radius);
+                sphere->set_rotation(rotation);
+                sphere->set_position(position);
+                sphere->set_material(materials[args["material"]]);
+                objects.push_back(sphere);
+                continue;
+            }
+
+            int bvh_mode;
+            if(!parse_scene_bvh_mode(args, &bvh_mode))
+                ok = fail(st.line, "invalid bvh " + args["bvh"]);
+            if(args.count("scale") and !parse_scene_vec3(args["scale"], &scale)) ok = fail(st.line, "invalid scale");
+            Mesh* mesh = rt.scene.make<Mesh>();
+            if(placed_meshes.count(st.line)) *mesh = pool->wait(placed_meshes[st.line]);
+            else *mesh = loaded_meshes[std::to_string(bvh_mode) + ":" + resolve(w[1])];
+            if(mesh->tris.empty()) ok = fail(st.line, "failed to load mesh " + w[1]);
+            mesh->set_material(materials[args["material"]]);
+            mesh->update_material();
+            objects.push_back(mesh);
+        }
+        else ok = fail(st.line, "invalid statement " + w[0]);
+    }
+
+    // the tasks of skipped statements still read loaded_meshes
+    for(auto& m: placed_meshes)
+        if(m.second.valid()) pool->wait(m.second);
+
+    rt.camera.init();
+    rt.camera.tilt(tilt);
+    rt.camera.pan(pan);
+
+    // objects are only added if the whole file is valid
+    if(!ok) return false;
+    for(Object* obj: objects) rt.add_object(obj);
+    return true;
+}
+
+#endif
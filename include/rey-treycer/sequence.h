@@ -0,0 +1,318 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "rey-treycer.h"
+
+// rendering animations: keyframed camera and object transforms, one image per frame
+//
+// the scene is set to the time of a frame, then the frame is rendered from scratch with a RenderBudget
+// moved meshes only refit their BVH (see Object::dirty), nothing is loaded or built again
+// while a frame is traced the one before it is encoded and written on another thread
+//
+// the output is numbered images (.png, .pfm or .exr, the name is a printf pattern like frames/%04d.png)
+// or one raw .y4m video that ffmpeg and most players read
+
+enum INTERPOLATION {
+    // straight lines between the keys
+    INTERPOLATE_LINEAR = 0,
+    // a catmull-rom curve through the keys, no sudden change of speed at a key
+    INTERPOLATE_SMOOTH = 1,
+};
+
+// values of type T (float or Vec3) at points in time, in seconds
+// before the first key it is the first value, after the last key the last value
+template<class T>
+struct Track {
+    std::vector<float> times;
+    std::vector<T> values;
+    int interpolation = INTERPOLATE_LINEAR;
+
+    // add a key, keys can be added in any order, a key at the same time is replaced
+    void key(float time, T value) {
+        int i = std::lower_bound(times.begin(), times.end(), time) - times.begin();
+        if(i < (int)times.size() and times[i] == time) {
+            values[i] = value;
+            return;
+        }
+        times.insert(times.begin() + i, time);
+        values.insert(values.begin() + i, value);
+    }
+    bool empty() const {
+        return times.empty();
+    }
+    float end_time() const {
+        return times.empty() ? 0 : times.back();
+    }
+    T at(float time) const {
+        if(time <= times.front()) return values.front();
+        if(time >= times.back()) return values.back();
+        int i = std::upper_bound(times.begin(), times.end(), time) - times.begin() - 1;
+        float t = (time - times[i]) / (times[i + 1] - times[i]);
+        const T& p1 = values[i];
+        const T& p2 = values[i + 1];
+        if(interpolation == INTERPOLATE_LINEAR)
+            return p1 * (1 - t) + p2 * t;
+        // the missing neighbours at the ends are mirrored so the curve starts and ends straight
+        T p0 = i > 0 ? values[i - 1] : p1 * 2 - p2;
+        T p3 = i + 2 < (int)values.size() ? values[i + 2] : p2 * 2 - p1;
+        float t2 = t * t, t3 = t2 * t;
+        return (p1 * 2 + (p2 - p0) * t + (p0 * 2 - p1 * 5 + p2 * 4 - p3) * t2 + (p1 * 3 - p0 - p2 * 3 + p3) * t3) * 0.5f;
+    }
+};
+
+// the animated transforms of one object, rotation in degree like in scene files
+// an empty track leaves that part of the object as it is
+struct ObjectTrack {
+    Object* object = nullptr;
+    Track<Vec3> position;
+    Track<Vec3> rotation;
+    Track<Vec3> scale;
+};
+
+class Sequence {
+public:
+    // the camera, pan, tilt and FOV in degree
+    Track<Vec3> camera_position;
+    Track<float> camera_pan;
+    Track<float> camera_tilt;
+    Track<float> camera_fov;
+    std::vector<ObjectTrack> objects;
+
+    float fps = 24;
+    // frames first_frame .. first_frame + frame_count - 1 are rendered, frame i is at time i / fps
+    int first_frame = 0;
+    // 0 renders until the last key
+    int frame_count = 0;
+
+    // the tracks of `obj`, made on the first call
+    ObjectTrack& animate(Object* obj) {
+        for(ObjectTrack& track: objects)
+            if(track.object == obj) return track;
+        objects.push_back(ObjectTrack());
+        objects.back().object = obj;
+        return objects.back();
+    }
+
+    float end_time() const {
+        float end = std::max({camera_position.end_time(), camera_pan.end_time(), camera_tilt.end_time(), camera_fov.end_time()});
+        for(const ObjectTrack& track: objects)
+            end = std::max({end, track.position.end_time(), track.rotation.end_time(), track.scale.end_time()});
+        return end;
+    }
+    int frames() const {
+        return frame_count > 0 ? frame_count : std::max(0, (int)floorf(end_time() * fps + 1e-3f) + 1 - first_frame);
+    }
+
+    // set the camera and objects of `rt` to `time`, call it while no frame is being drawn
+    // only what changed is touched: the camera is set up again only if it turned or zoomed,
+    // and meshes that moved refit their BVH when the frame starts
+    void apply(ReyTreycer& rt, float time) {
+        Camera& camera = rt.camera;
+        if(!camera_position.empty()) camera.position = camera_position.at(time);
+        float pan = camera_pan.empty() ? rad2deg(camera.panned_angle) : camera_pan.at(time);
+        float tilt = camera_tilt.empty() ? rad2deg(camera.tilted_angle) : camera_tilt.at(time);
+        float fov = camera_fov.empty() ? camera.FOV : camera_fov.at(time);
+        // compared in degree, going through radians and back is not exact
+        if(fov != camera.FOV or fabsf(pan - rad2deg(camera.panned_angle)) > 1e-4f
+           or fabsf(tilt - rad2deg(camera.tilted_angle)) > 1e-4f) {
+            camera.FOV = fov;
+            camera.init();
+            camera.tilt(deg2rad(tilt));
+            camera.pan(deg2rad(pan));
+        }
+
+        // the setters mark the object dirty, so unchanged values are not set again
+        for(ObjectTrack& track: objects) {
+            Object* obj = track.object;
+            if(!track.position.empty() and obj->get_position() != track.position.at(time))
+                obj->set_position(track.position.at(time));
+            if(!track.scale.empty() and obj->get_scale() != track.scale.at(time))
+                obj->set_scale(track.scale.at(time));
+            Vec3 r = track.rotation.empty() ? VEC3_ZERO : track.rotation.at(time);
+            r = Vec3(deg2rad(r.x), deg2rad(r.y), deg2rad(r.z));
+            if(!track.rotation.empty() and obj->get_rotation() != r)
+                obj->set_rotation(r);
+        }
+    }
+};
+
+// a raw YUV4MPEG2 video, 8 bit 4:4:4 frames with BT.601 limited range colors
+// the colors go through a PostProcessor first, like PNGWriter
+class Y4MWriter {
+private:
+    std::ofstream file;
+    int width = 0;
+    int height = 0;
+    PostProcessor post;
+    std::vector<unsigned char> rgb;
+    std::vector<unsigned char> planes;
+public:
+    PostProcessSettings settings;
+
+    // start the video, false if the file can not be written
+    bool begin(std::string filename, int width, int height, float fps) {
+        file.open(filename, std::ios::binary);
+        if(!file.is_open()) return false;
+        this->width = width;
+        this->height = height;
+        // frame rate as a fraction, 1000 steps per second covers 23.976 and 29.97
+        int rate = roundf(fps * 1000);
+        file << "YUV4MPEG2 W" << width << " H" << height << " F" << rate << ":1000 Ip A1:1 C444\n";
+        return file.good();
+    }
+    // append a frame, `colors` indexed [x][y] like ReyTreycer::screen_color
+    bool write_frame(const std::vector<std::vector<Vec3>>& colors, int thread_count = 1) {
+        int n = width * height;
+        rgb.resize(n * 3);
+        planes.resize(n * 3);
+        post.settings = settings;
+        post.to_rgb8(colors, width, height, rgb.data(), thread_count);
+        unsigned char* y = planes.data();
+        unsigned char* u = y + n;
+        unsigned char* v = u + n;
+        for(int i = 0; i < n; i++) {
+            float r = rgb[i * 3], g = rgb[i * 3 + 1], b = rgb[i * 3 + 2];
+            y[i] = 16 + (65.738f * r + 129.057f * g + 25.064f * b) / 256 + 0.5f;
+            u[i] = 128 + (-37.945f * r - 74.494f * g + 112.439f * b) / 256 + 0.5f;
+            v[i] = 128 + (112.439f * r - 94.154f * g - 18.285f * b) / 256 + 0.5f;
+        }
+        file << "FRAME\n";
+        file.write((const char*)planes.data(), planes.size());
+        return file.good();
+    }
+    bool finish() {
+        file.close();
+        return !file.fail();
+    }
+};
+
+struct SequenceSettings {
+    // when every frame is done, see ReyTreycer::render_until()
+    RenderBudget budget;
+    // numbered images as a printf pattern of the frame number, like frames/%04d.png, or a .y4m video
+    // a name without a % gets -%04d before the extension
+    std::string output;
+    // write the frames denoised, once each after its last sample
+    bool denoise = false;
+    // for .png and .y4m
+    PostProcessSettings post;
+};
+
+struct SequenceReport {
+    int frames = 0;
+    double seconds = 0;
+    // time spent waiting for the writer, close to 0 when encoding hides behind tracing
+    double writer_wait = 0;
+    bool ok = true;
+    std::string error;
+};
+
+// the file name of frame `frame` for the output pattern
+inline std::string sequence_file_name(std::string pattern, int frame) {
+    if(pattern.find('%') == std::string::npos) {
+        size_t dot = pattern.find_last_of('.');
+        if(dot == std::string::npos) dot = pattern.size();
+        pattern = pattern.substr(0, dot) + "-%04d" + pattern.substr(dot);
+    }
+    char name[1024];
+    snprintf(name, sizeof(name), pattern.c_str(), frame);
+    return name;
+}
+
+// render every frame of `seq` into `settings.output`, `on_frame` is called after a frame was traced
+// the settings of `rt` are used as they are, temporal reprojection and preview blocks should be off
+// stops at the first frame that could not be written, or if a frame is cancelled
+inline SequenceReport render_sequence(ReyTreycer& rt, Sequence& seq, const SequenceSettings& settings,
+                                      std::function<void(int, const RenderReport&)> on_frame = nullptr) {
+    auto start = std::chrono::steady_clock::now();
+    auto since = [](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+    };
+    SequenceReport report;
+    auto fail = [&report](std::string error) {
+        report.ok = false;
+        report.error = error;
+    };
+
+    std::string extension = settings.output.substr(settings.output.find_last_of('.') + 1);
+    bool video = extension == "y4m";
+    if(!video and extension != "png" and extension != "pfm" and extension != "exr") {
+        fail("unknown output type " + settings.output);
+        return report;
+    }
+    int width = rt.WIDTH, height = rt.HEIGHT;
+    Y4MWriter y4m;
+    y4m.settings = settings.post;
+    if(video and !y4m.begin(settings.output, width, height, seq.fps)) {
+        fail("failed to create " + settings.output);
+        return report;
+    }
+
+    // one frame is encoded while the next is traced, each into its own copy of the image
+    std::vector<std::vector<Vec3>> images[2];
+    std::future<std::string> writing;
+    auto write = [&, width, height](int frame, const std::vector<std::vector<Vec3>>* image) -> std::string {
+        if(video) return y4m.write_frame(*image) ? "" : "failed to write " + settings.output;
+        std::string name = sequence_file_name(settings.output, frame);
+        PFMWriter pfm;
+        EXRWriter exr;
+        PNGWriter png;
+        png.post.settings = settings.post;
+        TileSink* sink = extension == "pfm" ? (TileSink*)&pfm : extension == "exr" ? (TileSink*)&exr : (TileSink*)&png;
+        if(!sink->begin(name, width, height)) return "failed to create " + name;
+        // in rows of tiles so the PNGWriter can flush as it goes
+        for(int y = 0; y < height; y += DRAW_TILE_SIZE)
+            for(int x = 0; x < width; x += DRAW_TILE_SIZE)
+                sink->write_tile(*image, x, y, std::min(DRAW_TILE_SIZE, width - x), std::min(DRAW_TILE_SIZE, height - y));
+        return sink->finish() ? "" : "failed to write " + name;
+    };
+    auto wait_writer = [&]() {
+        if(!writing.valid()) return;
+        auto wait_start = std::chrono::steady_clock::now();
+        std::string error = writing.get();
+        report.writer_wait += since(wait_start);
+        if(!error.empty() and report.ok) fail(error);
+    };
+
+    int frames = seq.frames();
+    for(int i = 0; i < frames and report.ok; i++) {
+        int frame = seq.first_frame + i;
+        seq.apply(rt, frame / seq.fps);
+        rt.restart_render();
+        RenderReport frame_report = rt.render_until(settings.budget);
+        if(rt.rendered_count == 0) {
+            fail("frame " + std::to_string(frame) + " was cancelled");
+            break;
+        }
+        if(settings.denoise) rt.denoise_frame();
+        if(on_frame) on_frame(frame, frame_report);
+
+        // the writer is still on the other copy, so this one is free
+        const std::vector<std::vector<Vec3>>& color = settings.denoise ? rt.denoised_color : rt.screen_color;
+        std::vector<std::vector<Vec3>>& image = images[i % 2];
+        image.resize(width);
+        for(int x = 0; x < width; x++)
+            image[x].assign(color[x].begin(), color[x].begin() + height);
+
+        wait_writer();
+        writing = std::async(std::launch::async, write, frame, &image);
+        report.frames++;
+    }
+    wait_writer();
+    if(video and !y4m.finish() and report.ok) fail("failed to write " + settings.output);
+
+    report.seconds = since(start);
+    return report;
+}
+
+#endif
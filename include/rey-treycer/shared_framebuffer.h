@@ -0,0 +1,272 @@
+#ifndef SHARED_FRAMEBUFFER_H
+#define SHARED_FRAMEBUFFER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "postprocess.h"
+#include "rendered_frame.h"
+
+// the published frames of a ReyTreycer in a named posix shared memory segment, so other processes
+// can watch a render by mapping it, without copies and without the renderer waiting for them
+//
+// the segment is a SharedFramebufferHeader, then the pixels from header_size on, rows `pitch` bytes apart
+// it is made big enough for MAX_WIDTH x MAX_HEIGHT once, so it never moves, unused pages take no memory
+//
+// the header works as a seqlock: `sequence` is odd while a frame is written. a reader reads it,
+// reads the header fields and pixels it wants, then reads it again. if it was odd or changed the read
+// may be torn and has to be done again, SharedFramebuffer::read() does that for a full copy
+// posix only, elsewhere create() and open() fail
+
+const uint32_t SHARED_FRAMEBUFFER_VERSION = 1;
+
+enum SHARED_PIXEL_FORMAT {
+    // 3 floats per pixel, linear colors as rendered
+    SHARED_RGB32F = 1,
+    // b, g, r, a bytes through a PostProcessor
+    SHARED_BGRA8 = 2,
+};
+
+struct SharedFramebufferHeader {
+    char magic[4];
+    uint32_t version;
+    // offset of the first pixel and bytes for pixels after it
+    uint64_t header_size;
+    uint64_t capacity;
+    // odd while the writer changes anything below or in the pixels
+    std::atomic<uint64_t> sequence;
+    int32_t width;
+    int32_t height;
+    int32_t format;
+    int32_t pitch;
+    // RenderedFrame::frame_id, rendered_count and noise of the frame in the pixels
+    uint64_t frame_id;
+    int32_t rendered_count;
+    float noise;
+    // the writer closed the segment, no more frames will come
+    int32_t finished;
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the seqlock needs a lock free 64 bit atomic");
+
+class SharedFramebuffer {
+private:
+    std::string name;
+    int fd = -1;
+    char* mapped = nullptr;
+    size_t mapped_size = 0;
+    bool owner = false;
+    // the frame in the pixels, only tiles changed after it are written next time
+    uint64_t written_frame = 0;
+    PostProcessor post;
+
+    static std::string shm_name(std::string name) {
+        return name.empty() or name[0] != '/' ? '/' + name : name;
+    }
+    static uint64_t header_bytes() {
+        // pixels start on a cache line
+        return (sizeof(SharedFramebufferHeader) + 63) / 64 * 64;
+    }
+public:
+    // tonemapping and encoding for SHARED_BGRA8
+    PostProcessSettings settings;
+
+    SharedFramebuffer() {}
+    SharedFramebuffer(const SharedFramebuffer&) = delete;
+    SharedFramebuffer& operator=(const SharedFramebuffer&) = delete;
+    ~SharedFramebuffer() {
+        close();
+    }
+
+    // create the segment `name` for writing, an old one with that name is replaced
+    bool create(std::string name, int format = SHARED_RGB32F) {
+        close();
+#ifdef _WIN32
+        return false;
+#else
+        this->name = shm_name(name);
+        shm_unlink(this->name.c_str());
+        fd = shm_open(this->name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if(fd < 0) return false;
+        owner = true;
+
+        int bytes_per_pixel = format == SHARED_BGRA8 ? 4 : 12;
+        uint64_t capacity = (uint64_t)MAX_WIDTH * MAX_HEIGHT * bytes_per_pixel;
+        mapped_size = header_bytes() + capacity;
+        if(ftruncate(fd, mapped_size) != 0) {
+            close();
+            return false;
+        }
+        void* p = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED) {
+            close();
+            return false;
+        }
+        mapped = (char*)p;
+
+        SharedFramebufferHeader* h = header();
+        new (&h->sequence) std::atomic<uint64_t>(0);
+        memcpy(h->magic, "RTFB", 4);
+        h->version = SHARED_FRAMEBUFFER_VERSION;
+        h->header_size = header_bytes();
+        h->capacity = capacity;
+        h->format = format;
+        h->width = 0;
+        h->height = 0;
+        h->pitch = 0;
+        h->frame_id = 0;
+        h->finished = 0;
+        written_frame = 0;
+        return true;
+#endif
+    }
+    // map the segment `name` made by another process for reading
+    bool open(std::string name) {
+        close();
+#ifdef _WIN32
+        return false;
+#else
+        this->name = shm_name(name);
+        fd = shm_open(this->name.c_str(), O_RDONLY, 0);
+        if(fd < 0) return false;
+        struct stat st;
+        if(fstat(fd, &st) != 0 or (size_t)st.st_size < sizeof(SharedFramebufferHeader)) {
+            close();
+            return false;
+        }
+        mapped_size = st.st_size;
+        void* p = mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED) {
+            close();
+            return false;
+        }
+        mapped = (char*)p;
+        SharedFramebufferHeader* h = header();
+        if(memcmp(h->magic, "RTFB", 4) != 0 or h->version != SHARED_FRAMEBUFFER_VERSION
+           or h->header_size + h->capacity > mapped_size) {
+            close();
+            return false;
+        }
+        return true;
+#endif
+    }
+    // unmap, and remove the segment if this made it. readers keep their mapping until they close
+    void close() {
+#ifndef _WIN32
+        if(mapped != nullptr) {
+            if(owner) {
+                header()->finished = 1;
+                header()->sequence.fetch_add(2, std::memory_order_release);
+            }
+            munmap(mapped, mapped_size);
+        }
+        if(fd >= 0) ::close(fd);
+        if(owner) shm_unlink(name.c_str());
+#endif
+        mapped = nullptr;
+        fd = -1;
+        owner = false;
+    }
+    bool is_open() {
+        return mapped != nullptr;
+    }
+
+    SharedFramebufferHeader* header() {
+        return (SharedFramebufferHeader*)mapped;
+    }
+    // the pixels, only valid while the sequence stays the same
+    const char* pixels() {
+        return mapped + header()->header_size;
+    }
+
+    // write the tiles of `frame` changed since the last written frame, all of them after a size change
+    // called by ReyTreycer::publish_frame() when set as its shared_framebuffer
+    void write(const RenderedFrame& frame) {
+        if(!owner) return;
+        SharedFramebufferHeader* h = header();
+        int bytes_per_pixel = h->format == SHARED_BGRA8 ? 4 : 12;
+        int pitch = frame.width * bytes_per_pixel;
+        if((uint64_t)pitch * frame.height > h->capacity) return;
+        bool full = frame.width != h->width or frame.height != h->height or (uint64_t)frame.frame_id < written_frame;
+        if(h->format == SHARED_BGRA8) {
+            // a changed curve changes every pixel
+            full = full or post.settings.tonemapping != settings.tonemapping or post.settings.exposure != settings.exposure
+                   or post.settings.srgb != settings.srgb or post.settings.gamma != settings.gamma;
+            post.settings = settings;
+            post.prepare();
+        }
+
+        uint64_t s = h->sequence.load(std::memory_order_relaxed);
+        h->sequence.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        h->width = frame.width;
+        h->height = frame.height;
+        h->pitch = pitch;
+        char* out = mapped + h->header_size;
+        for(int t = 0; t < frame.tile_columns * frame.tile_rows; t++) {
+            if(!full and (uint64_t)frame.tile_version[t] <= written_frame) continue;
+            int from_x = t % frame.tile_columns * DRAW_TILE_SIZE, to_x = std::min(from_x + DRAW_TILE_SIZE, frame.width);
+            int from_y = t / frame.tile_columns * DRAW_TILE_SIZE, to_y = std::min(from_y + DRAW_TILE_SIZE, frame.height);
+            if(h->format == SHARED_BGRA8) {
+                post.convert(frame.color, from_x, from_y, to_x - from_x, to_y - from_y,
+                             (unsigned char*)out + from_y * pitch + from_x * 4, pitch, PIXEL_BGRA8);
+                continue;
+            }
+            for(int y = from_y; y < to_y; y++) {
+                float* pixel = (float*)(out + y * pitch) + from_x * 3;
+                for(int x = from_x; x < to_x; x++, pixel += 3) {
+                    const Vec3& c = frame.color[x][y];
+                    pixel[0] = c.x; pixel[1] = c.y; pixel[2] = c.z;
+                }
+            }
+        }
+        h->frame_id = frame.frame_id;
+        h->rendered_count = frame.rendered_count;
+        h->noise = frame.noise;
+        written_frame = frame.frame_id;
+
+        h->sequence.store(s + 2, std::memory_order_release);
+    }
+
+    // copy the current frame into `out` (rows of `pitch` bytes) and its header into `copy`
+    // retries while the writer is busy, false if it did not get a clean copy in `attempts` tries
+    bool read(SharedFramebufferHeader& copy, std::vector<char>& out, int attempts = 100) {
+        SharedFramebufferHeader* h = header();
+        for(int i = 0; i < attempts; i++) {
+            uint64_t s = h->sequence.load(std::memory_order_acquire);
+            if(s % 2 == 1) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            copy.width = h->width;
+            copy.height = h->height;
+            copy.format = h->format;
+            copy.pitch = h->pitch;
+            copy.frame_id = h->frame_id;
+            copy.rendered_count = h->rendered_count;
+            copy.noise = h->noise;
+            copy.finished = h->finished;
+            size_t bytes = (size_t)copy.pitch * copy.height;
+            if(bytes > h->capacity) continue;
+            out.resize(bytes);
+            memcpy(out.data(), pixels(), bytes);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(h->sequence.load(std::memory_order_relaxed) == s) return true;
+        }
+        return false;
+    }
+};
+
+#endif
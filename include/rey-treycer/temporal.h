@@ -0,0 +1,82 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include <algorithm>
+#include <vector>
+
+#include "camera.h"
+#include "denoise.h"
+
+// moves the accumulated image of the last frame to where it is seen from a new camera pose
+// every pixel with a first hit is put back into the world with its depth and projected again,
+// the nearest one wins when several land on the same pixel
+// pixels nothing lands on (disoccluded) lose their history and start over
+class Reprojector {
+private:
+    std::vector<Vec3> color, albedo, normal;
+    std::vector<float> depth, nearest, m2;
+    std::vector<int> count, object_id;
+public:
+    // `screen_color` is indexed [x][y], the other buffers x + y * width
+    // the history of every moved pixel is capped to `history_cap` samples so it adapts to the new view quickly
+    // `luminance_m2` is the per pixel variance sum of ReyTreycer, scaled down with the capped history
+    void run(std::vector<std::vector<Vec3>>& screen_color, std::vector<int>& sample_count,
+             std::vector<float>& luminance_m2, AOVBuffers& aov,
+             CameraState before, CameraState now, int history_cap) {
+        int width = now.width, height = now.height;
+        int n = width * height;
+        color.assign(n, BLACK);
+        albedo.assign(n, BLACK);
+        normal.assign(n, BLACK);
+        depth.assign(n, 0);
+        m2.assign(n, 0);
+        nearest.assign(n, BVH_MISS);
+        count.assign(n, 0);
+        object_id.assign(n, -1);
+
+        for(int y = 0; y < height; y++)
+            for(int x = 0; x < width; x++) {
+                int p = x + y * width;
+                if(sample_count[p] == 0) continue;
+
+                Vec3 dir = before.pixel_direction(x, y);
+                bool sky = aov.depth[p] == 0;
+                Vec3 point = before.position + dir * aov.depth[p];
+                Vec3 v = sky ? now.direction_to_camera_space(dir) : now.to_camera_space(point);
+                if(v.z < 1e-3f) continue;
+
+                float sx, sy;
+                now.to_screen(v, &sx, &sy);
+                int tx = floorf(sx + 0.5f), ty = floorf(sy + 0.5f);
+                if(tx < 0 or tx >= width or ty < 0 or ty >= height) continue;
+
+                // the sky is behind everything
+                int q = tx + ty * width;
+                float key = sky ? BVH_MISS / 2 : v.z;
+                if(key >= nearest[q]) continue;
+                nearest[q] = key;
+
+                color[q] = screen_color[x][y];
+                albedo[q] = aov.albedo[p];
+                normal[q] = aov.normal[p];
+                depth[q] = sky ? 0 : (point - now.position).length();
+                count[q] = std::min(sample_count[p], history_cap);
+                m2[q] = luminance_m2[p] * count[q] / sample_count[p];
+                object_id[q] = aov.object_id[p];
+            }
+
+        for(int y = 0; y < height; y++)
+            for(int x = 0; x < width; x++) {
+                int q = x + y * width;
+                screen_color[x][y] = color[q];
+                sample_count[q] = count[q];
+                luminance_m2[q] = m2[q];
+                aov.albedo[q] = albedo[q];
+                aov.normal[q] = normal[q];
+                aov.depth[q] = depth[q];
+                aov.object_id[q] = object_id[q];
+            }
+    }
+};
+
+#endif
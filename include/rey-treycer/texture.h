@@ -2,16 +2,21 @@
 #define TEXTURE_H
 
 #include <functional>
+#include <vector>
+#include "constant.h"
 
 enum TEXTURE {
     TEX_NULL,
     TEX_COLOR,
     TEX_IMAGE,
     TEX_PROC,
+    TEX_TILED,
 };
 
 struct SurfaceInfo {
     float u, v;
+    // the size of the pixel footprint in uv space, used to pick a mip level
+    float uv_footprint = 0;
     Vec3 normal = VEC3_ZERO;
     Vec3 object_rotation = VEC3_ZERO;
 };
@@ -37,24 +42,151 @@ public:
     }
 };
 
+// one level of the mip pyramid, always stored as 3 channel rgb
+struct MipLevel {
+    int width, height;
+    std::vector<unsigned char> texels;
+};
+
+// bilinear filtering of a width x height image, texel centers are at (x + 0.5, y + 0.5)
+// fetch(x, y) must return the color of texel (x, y) and clamp out of range coordinates
+template<class Fetch>
+inline Vec3 bilinear_filter(Fetch fetch, int width, int height, float u, float v) {
+    float fx = u * width - 0.5f;
+    float fy = v * height - 0.5f;
+    int x = floorf(fx);
+    int y = floorf(fy);
+    float tx = fx - x;
+    float ty = fy - y;
+
+    Vec3 top = lerp(fetch(x, y), fetch(x + 1, y), tx);
+    Vec3 bottom = lerp(fetch(x, y + 1), fetch(x + 1, y + 1), tx);
+    return lerp(top, bottom, ty);
+}
+// the fractional mip level where one texel covers about the pixel footprint
+inline float mip_lod(float uv_footprint, int width, int height) {
+    float texels_per_footprint = uv_footprint * fmax(width, height);
+    return texels_per_footprint > 1 ? log2f(texels_per_footprint) : 0;
+}
+inline int clamp_texel(int a, int size) {
+    return a < 0 ? 0 : (a >= size ? size - 1 : a);
+}
+
+// the sRGB curve, image bytes are sRGB encoded and have to be decoded before they are averaged
+inline float srgb_to_linear(float v) {
+    return v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+}
+inline float linear_to_srgb(float v) {
+    return v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1 / 2.4f) - 0.055f;
+}
+
 // a texture type that takes a image as texture
 class ImageTexture: public Texture {
+private:
+    // mip_levels[0] is the full image, every next level is half the size of the previous one
+    std::vector<MipLevel> mip_levels;
+
+    // get the color of texel (x, y), clamped to the image borders
+    Vec3 texel(const MipLevel& level, int x, int y) {
+        x = clamp_texel(x, level.width);
+        y = clamp_texel(y, level.height);
+        const unsigned char* pixel = level.texels.data() + (y * level.width + x) * 3;
+        return Vec3(pixel[0], pixel[1], pixel[2]);
+    }
+    // same as above but read directly from pixel_data, used when there is no mipmap
+    Vec3 raw_texel(int x, int y) {
+        x = clamp_texel(x, image_width);
+        y = clamp_texel(y, image_height);
+        const unsigned char* pixel = pixel_data + (y * image_width + x) * channels;
+        if(channels < 3) return Vec3(pixel[0], pixel[0], pixel[0]);
+        return Vec3(pixel[0], pixel[1], pixel[2]);
+    }
+    Vec3 bilinear(const MipLevel& level, float u, float v) {
+        auto fetch = [&](int x, int y) { return texel(level, x, y); };
+        return bilinear_filter(fetch, level.width, level.height, u, v);
+    }
 public:
     int channels;
     int image_width, image_height;
     unsigned char *pixel_data;
 
+    // build the mip pyramid from pixel_data
+    // call this once after setting pixel_data, image_width/height and channels
+    // without it the texture is sampled bilinearly from the full image only
+    void generate_mipmap() {
+        mip_levels.clear();
+
+        MipLevel base;
+        base.width = image_width;
+        base.height = image_height;
+        base.texels.resize(image_width * image_height * 3);
+        for(int y = 0; y < image_height; y++)
+            for(int x = 0; x < image_width; x++) {
+                Vec3 c = raw_texel(x, y);
+                unsigned char* pixel = base.texels.data() + (y * image_width + x) * 3;
+                pixel[0] = c.x; pixel[1] = c.y; pixel[2] = c.z;
+            }
+        mip_levels.push_back(base);
+
+        // decoding table of the sRGB bytes
+        float linear[256];
+        for(int i = 0; i < 256; i++)
+            linear[i] = srgb_to_linear(i / 255.0f);
+
+        // box filter every 2x2 block of the previous level in linear space
+        // the last texel of an odd sized level also takes the left over row or column
+        while(mip_levels.back().width > 1 or mip_levels.back().height > 1) {
+            const MipLevel& prev = mip_levels.back();
+            MipLevel next;
+            next.width = prev.width > 1 ? prev.width / 2 : 1;
+            next.height = prev.height > 1 ? prev.height / 2 : 1;
+            next.texels.resize(next.width * next.height * 3);
+            for(int y = 0; y < next.height; y++)
+                for(int x = 0; x < next.width; x++) {
+                    int x0 = 2 * x, x1 = x == next.width - 1 ? prev.width : 2 * x + 2;
+                    int y0 = 2 * y, y1 = y == next.height - 1 ? prev.height : 2 * y + 2;
+                    Vec3 c = VEC3_ZERO;
+                    for(int sy = y0; sy < y1; sy++)
+                        for(int sx = x0; sx < x1; sx++) {
+                            const unsigned char* src = prev.texels.data() + (sy * prev.width + sx) * 3;
+                            c += Vec3(linear[src[0]], linear[src[1]], linear[src[2]]);
+                        }
+                    c /= (x1 - x0) * (y1 - y0);
+                    unsigned char* pixel = next.texels.data() + (y * next.width + x) * 3;
+                    pixel[0] = linear_to_srgb(c.x) * 255 + 0.5f;
+                    pixel[1] = linear_to_srgb(c.y) * 255 + 0.5f;
+                    pixel[2] = linear_to_srgb(c.z) * 255 + 0.5f;
+                }
+            mip_levels.push_back(next);
+        }
+    }
+    int get_mip_level_count() {
+        return mip_levels.size();
+    }
+    const MipLevel& get_mip_level(int i) {
+        return mip_levels[i];
+    }
+
     // set the pizel_data, image_width/height and channels first before using this
     Vec3 get_texture(SurfaceInfo h) {
-        int x = h.u * (image_width - 1);
-        int y = h.v * (image_height - 1);
+        if(mip_levels.empty()) {
+            auto fetch = [&](int x, int y) { return raw_texel(x, y); };
+            return bilinear_filter(fetch, image_width, image_height, h.u, h.v) / 255.0f;
+        }
 
-        unsigned char* pixel = pixel_data + (y * image_width + x) * channels;
-        unsigned char r = pixel[0];
-        unsigned char g = pixel[1];
-        unsigned char b = pixel[2];
+        // pick the level where one texel covers about the pixel footprint
+        // then blend the two nearest levels (trilinear filtering)
+        float lod = mip_lod(h.uv_footprint, image_width, image_height);
+        int max_level = mip_levels.size() - 1;
+        if(lod >= max_level)
+            return bilinear(mip_levels[max_level], h.u, h.v) / 255.0f;
 
-        return Vec3(r, g, b) / 255.0f;
+        int level = lod;
+        float t = lod - level;
+        Vec3 color = bilinear(mip_levels[level], h.u, h.v);
+        if(t > 0)
+            color = lerp(color, bilinear(mip_levels[level + 1], h.u, h.v), t);
+        return color / 255.0f;
     }
     int get_type() {
         return TEX_IMAGE;
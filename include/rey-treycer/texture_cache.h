@@ -0,0 +1,400 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "texture.h"
+#include "mapped_file.h"
+
+// tiled textures are stored on disk as a pre-built mip pyramid cut into square tiles
+// tiles are only read from the (memory-mapped) file when a lookup touches them
+// and are kept in a global LRU cache with a fixed memory budget
+
+const int TEXTURE_TILE_SIZE = 32;
+const int TEXTURE_CACHE_SHARDS = 16;
+const uint32_t TILED_TEXTURE_VERSION = 2;
+
+enum TEXEL_FORMAT {
+    // 8 bit rgba, 4 bytes per texel
+    TEXEL_RGBA8 = 0,
+    // float rgb, 12 bytes per texel
+    // the same values as the 8 bit texels (the sRGB bytes / 255), not linearized,
+    // so both formats render alike and only differ in what the file can hold
+    TEXEL_RGB32F = 1,
+};
+inline int texel_size(int format) {
+    return format == TEXEL_RGB32F ? 12 : 4;
+}
+
+// file layout: header, one TiledTextureLevel per mip level, then the tiles of every level
+// tiles of a level are stored row by row, texels inside a tile are also row by row
+struct TiledTextureHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t level_count;
+    uint32_t tile_size;
+    uint32_t format;
+    uint32_t reserved;
+    // the image file the texture was made from, a changed image makes the file outdated
+    uint64_t source_hash;
+    uint64_t source_size;
+};
+struct TiledTextureLevel {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    // where the first tile of this level starts in the file
+    uint64_t offset;
+};
+
+struct TextureTile {
+    int format;
+    std::vector<unsigned char> data;
+};
+
+class TextureCache {
+private:
+    struct Entry {
+        uint64_t key;
+        std::shared_ptr<const TextureTile> tile;
+    };
+    // the cache is split by key so threads rarely wait on the same lock
+    struct Shard {
+        std::mutex mutex;
+        // most recently used tiles are at the front
+        std::list<Entry> lru;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> map;
+        size_t used = 0;
+        size_t hits = 0;
+        size_t misses = 0;
+    };
+    Shard shards[TEXTURE_CACHE_SHARDS];
+    std::atomic<size_t> budget{size_t(256) << 20};
+
+    Shard& shard_of(uint64_t key) {
+        return shards[(key ^ (key >> 17) ^ (key >> 31)) % TEXTURE_CACHE_SHARDS];
+    }
+    // drop least recently used tiles until the shard fits in its part of the budget
+    void evict(Shard& shard) {
+        size_t limit = budget / TEXTURE_CACHE_SHARDS;
+        // always keep the tile that was just inserted
+        while(shard.used > limit and shard.lru.size() > 1) {
+            Entry& e = shard.lru.back();
+            shard.used -= e.tile->data.size();
+            shard.map.erase(e.key);
+            shard.lru.pop_back();
+        }
+    }
+public:
+    // memory budget of all cached tiles, in bytes
+    void set_budget(size_t bytes) {
+        budget = bytes;
+        for(Shard& shard: shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            evict(shard);
+        }
+    }
+    size_t get_budget() {
+        return budget;
+    }
+    size_t get_memory_usage() {
+        size_t total = 0;
+        for(Shard& shard: shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.used;
+        }
+        return total;
+    }
+    void get_stats(size_t* hits, size_t* misses) {
+        *hits = 0; *misses = 0;
+        for(Shard& shard: shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            *hits += shard.hits;
+            *misses += shard.misses;
+        }
+    }
+    void clear() {
+        for(Shard& shard: shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.lru.clear();
+            shard.map.clear();
+            shard.used = 0;
+        }
+    }
+
+    // get a tile from the cache, load() is called to page it in on a miss
+    // the returned tile stays valid even if it gets evicted while in use
+    template<class Load>
+    std::shared_ptr<const TextureTile> get(uint64_t key, Load load) {
+        Shard& shard = shard_of(key);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.map.find(key);
+            if(it != shard.map.end()) {
+                shard.hits++;
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                return it->second->tile;
+            }
+            shard.misses++;
+        }
+
+        // load outside of the lock, if another thread loaded the same tile meanwhile we keep theirs
+        std::shared_ptr<const TextureTile> tile = load();
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.map.find(key);
+        if(it != shard.map.end())
+            return it->second->tile;
+        shard.lru.push_front({key, tile});
+        shard.map[key] = shard.lru.begin();
+        shard.used += tile->data.size();
+        evict(shard);
+        return tile;
+    }
+};
+// the cache shared by all tiled textures
+inline TextureCache& texture_cache() {
+    static TextureCache cache;
+    return cache;
+}
+
+// a texture that is read tile by tile from a file made by write_tiled_texture()
+class TiledTexture: public Texture {
+private:
+    MappedFile file;
+    TiledTextureHeader header;
+    std::vector<TiledTextureLevel> levels;
+    // identify this texture in the cache keys
+    uint64_t id = 0;
+
+    std::shared_ptr<const TextureTile> get_tile(int level, int tile_x, int tile_y) {
+        const TiledTextureLevel& l = levels[level];
+        uint64_t tile_index = (uint64_t)tile_y * l.tiles_x + tile_x;
+        uint64_t key = (id << 40) | ((uint64_t)level << 32) | tile_index;
+
+        // most lookups of a thread hit the same tile as the previous one, skip the cache for those
+        static thread_local uint64_t last_key = ~0ull;
+        static thread_local std::shared_ptr<const TextureTile> last_tile;
+        if(key == last_key) return last_tile;
+
+        last_tile = texture_cache().get(key, [&]() {
+            size_t bytes = (size_t)header.tile_size * header.tile_size * texel_size(header.format);
+            auto tile = std::make_shared<TextureTile>();
+            tile->format = header.format;
+            tile->data.resize(bytes);
+            memcpy(tile->data.data(), file.data() + l.offset + tile_index * bytes, bytes);
+            return std::shared_ptr<const TextureTile>(tile);
+        });
+        last_key = key;
+        return last_tile;
+    }
+    Vec3 texel(int level, int x, int y) {
+        const TiledTextureLevel& l = levels[level];
+        x = clamp_texel(x, l.width);
+        y = clamp_texel(y, l.height);
+        int tile_size = header.tile_size;
+
+        std::shared_ptr<const TextureTile> tile = get_tile(level, x / tile_size, y / tile_size);
+        int i = (y % tile_size) * tile_size + (x % tile_size);
+        if(tile->format == TEXEL_RGB32F) {
+            float c[3];
+            memcpy(c, tile->data.data() + i * 12, 12);
+            return Vec3(c[0], c[1], c[2]);
+        }
+        const unsigned char* pixel = tile->data.data() + i * 4;
+        return Vec3(pixel[0], pixel[1], pixel[2]) / 255.0f;
+    }
+    Vec3 bilinear(int level, float u, float v) {
+        auto fetch = [&](int x, int y) { return texel(level, x, y); };
+        return bilinear_filter(fetch, levels[level].width, levels[level].height, u, v);
+    }
+public:
+    // open a tiled texture file, returns false if the file is missing or invalid
+    bool open(std::string filename) {
+        static std::atomic<uint64_t> next_id{1};
+
+        levels.clear();
+        if(!file.open(filename) or file.size() < sizeof(TiledTextureHeader)) return false;
+        memcpy(&header, file.data(), sizeof(header));
+        if(memcmp(header.magic, "RTTX", 4) != 0 or header.version != TILED_TEXTURE_VERSION
+           or header.level_count == 0 or header.level_count > 64 or header.tile_size == 0
+           or header.tile_size > 4096 or (header.format != TEXEL_RGBA8 and header.format != TEXEL_RGB32F))
+            return false;
+        uint64_t tiles_start = sizeof(header) + (uint64_t)header.level_count * sizeof(TiledTextureLevel);
+        if(file.size() < tiles_start) return false;
+
+        levels.resize(header.level_count);
+        memcpy(levels.data(), file.data() + sizeof(header), header.level_count * sizeof(TiledTextureLevel));
+
+        // make sure every level covers its size and all of its tiles are inside the file
+        uint64_t tile_bytes = (uint64_t)header.tile_size * header.tile_size * texel_size(header.format);
+        for(const TiledTextureLevel& l: levels) {
+            uint64_t tile_count = (uint64_t)l.tiles_x * l.tiles_y;
+            if(l.width == 0 or l.height == 0 or (uint64_t)l.tiles_x * header.tile_size < l.width
+               or (uint64_t)l.tiles_y * header.tile_size < l.height or l.offset < tiles_start
+               or l.offset > file.size() or tile_count > (file.size() - l.offset) / tile_bytes) {
+                levels.clear();
+                return false;
+            }
+        }
+
+        id = next_id++;
+        return true;
+    }
+    // same as above, but also returns false if the file was made from another image than the one
+    // with this content hash and size
+    bool open(std::string filename, uint64_t source_hash, uint64_t source_size) {
+        if(!open(filename)) return false;
+        if(header.source_hash != source_hash or header.source_size != source_size) {
+            levels.clear();
+            file.close();
+            return false;
+        }
+        return true;
+    }
+    int get_width() {
+        return header.width;
+    }
+    int get_height() {
+        return header.height;
+    }
+    // the image file the texture was made from, see open_tiled_texture()
+    uint64_t get_source_hash() {
+        return header.source_hash;
+    }
+    uint64_t get_source_size() {
+        return header.source_size;
+    }
+
+    Vec3 get_texture(SurfaceInfo h) {
+        if(levels.empty()) return VEC3_ZERO;
+
+        // same trilinear filtering as ImageTexture
+        float lod = mip_lod(h.uv_footprint, header.width, header.height);
+        int max_level = levels.size() - 1;
+        if(lod >= max_level)
+            return bilinear(max_level, h.u, h.v);
+
+        int level = lod;
+        float t = lod - level;
+        Vec3 color = bilinear(level, h.u, h.v);
+        if(t > 0)
+            color = lerp(color, bilinear(level + 1, h.u, h.v), t);
+        return color;
+    }
+    int get_type() {
+        return TEX_TILED;
+    }
+};
+
+// convert an image texture into a tiled texture file
+// the mip pyramid of the texture is generated if it does not have one yet
+// source_hash and source_size identify the image file it came from, see open_tiled_texture()
+inline bool write_tiled_texture(std::string filename, ImageTexture& tex, int format = TEXEL_RGBA8,
+                                uint64_t source_hash = 0, uint64_t source_size = 0) {
+    if(tex.get_mip_level_count() == 0) tex.generate_mipmap();
+
+    const int tile_size = TEXTURE_TILE_SIZE;
+    const size_t tile_bytes = (size_t)tile_size * tile_size * texel_size(format);
+
+    TiledTextureHeader header;
+    memcpy(header.magic, "RTTX", 4);
+    header.version = TILED_TEXTURE_VERSION;
+    header.width = tex.image_width;
+    header.height = tex.image_height;
+    header.level_count = tex.get_mip_level_count();
+    header.tile_size = tile_size;
+    header.format = format;
+    header.reserved = 0;
+    header.source_hash = source_hash;
+    header.source_size = source_size;
+
+    std::vector<TiledTextureLevel> levels(header.level_count);
+    uint64_t offset = sizeof(header) + levels.size() * sizeof(TiledTextureLevel);
+    for(int i = 0; i < (int)levels.size(); i++) {
+        const MipLevel& mip = tex.get_mip_level(i);
+        levels[i].width = mip.width;
+        levels[i].height = mip.height;
+        levels[i].tiles_x = (mip.width + tile_size - 1) / tile_size;
+        levels[i].tiles_y = (mip.height + tile_size - 1) / tile_size;
+        levels[i].offset = offset;
+        offset += (uint64_t)levels[i].tiles_x * levels[i].tiles_y * tile_bytes;
+    }
+
+    // write to a temporary file first so no reader ever maps a half written texture
+    std::string tmp_name = temporary_name(filename);
+    std::ofstream f(tmp_name, std::ios::binary);
+    if(!f.is_open()) return false;
+    f.write((const char*)&header, sizeof(header));
+    f.write((const char*)levels.data(), levels.size() * sizeof(TiledTextureLevel));
+
+    std::vector<unsigned char> tile(tile_bytes);
+    for(int i = 0; i < (int)levels.size(); i++) {
+        const MipLevel& mip = tex.get_mip_level(i);
+        for(int ty = 0; ty < (int)levels[i].tiles_y; ty++)
+            for(int tx = 0; tx < (int)levels[i].tiles_x; tx++) {
+                for(int y = 0; y < tile_size; y++)
+                    for(int x = 0; x < tile_size; x++) {
+                        // pad the edge tiles by repeating the border texels
+                        int sx = clamp_texel(tx * tile_size + x, mip.width);
+                        int sy = clamp_texel(ty * tile_size + y, mip.height);
+                        const unsigned char* src = mip.texels.data() + (sy * mip.width + sx) * 3;
+                        unsigned char* dst = tile.data() + (y * tile_size + x) * texel_size(format);
+                        if(format == TEXEL_RGB32F) {
+                            float c[3] = {src[0] / 255.0f, src[1] / 255.0f, src[2] / 255.0f};
+                            memcpy(dst, c, 12);
+                        }
+                        else {
+                            dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; dst[3] = 255;
+                        }
+                    }
+                f.write((const char*)tile.data(), tile.size());
+            }
+    }
+    f.close();
+    if(!f.good() or std::rename(tmp_name.c_str(), filename.c_str()) != 0) {
+        std::remove(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+// decode an image file like stbi_load(filename, &width, &height, &channels, 0) does
+// the library does not decode images itself, the caller passes a function for it
+// the returned buffer must be allocated with malloc (stbi_load does), nullptr on failure
+typedef std::function<unsigned char*(const char* filename, int* width, int* height, int* channels)> ImageLoader;
+
+// open the tiled version `<filename>.rtt` of an image
+// the image is decoded and converted first if the tiled file is missing or was made from another image
+inline bool open_tiled_texture(TiledTexture& tex, std::string filename, ImageLoader load_image) {
+    MappedFile source;
+    if(!source.open(filename)) return false;
+    uint64_t source_size = source.size();
+    uint64_t source_hash = hash_bytes(source.data(), source.size());
+    source.close();
+
+    std::string tiled_name = filename + ".rtt";
+    if(tex.open(tiled_name, source_hash, source_size)) return true;
+
+    ImageTexture image;
+    image.pixel_data = load_image(filename.c_str(), &(image.image_width), &(image.image_height), &(image.channels));
+    if(image.pixel_data == nullptr) return false;
+    image.generate_mipmap();
+    bool written = write_tiled_texture(tiled_name, image, TEXEL_RGBA8, source_hash, source_size);
+    free(image.pixel_data);
+
+    return written and tex.open(tiled_name, source_hash, source_size);
+}
+
+#endif
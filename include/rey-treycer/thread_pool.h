@@ -0,0 +1,95 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a fixed set of worker threads that run queued tasks
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+
+    void worker_loop() {
+        while(true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this]() { return stopping or !tasks.empty(); });
+                if(stopping and tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+public:
+    ThreadPool(int thread_count = std::thread::hardware_concurrency()) {
+        if(thread_count < 1) thread_count = 1;
+        for(int i = 0; i < thread_count; i++)
+            workers.push_back(std::thread(&ThreadPool::worker_loop, this));
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    // finish the queued tasks then stop all workers
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for(std::thread& t: workers) t.join();
+    }
+
+    int size() {
+        return workers.size();
+    }
+
+    // queue a task, its result (or exception) is delivered through the returned future
+    template<class F>
+    auto submit(F f) -> std::future<decltype(f())> {
+        using R = decltype(f());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+        std::future<R> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back([task]() { (*task)(); });
+        }
+        condition.notify_one();
+        return result;
+    }
+
+    // run one queued task on the calling thread, returns false if there was none
+    bool run_pending_task() {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(tasks.empty()) return false;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+        return true;
+    }
+
+    // wait for a future, helping with queued tasks meanwhile
+    // so a task can wait for the tasks it submitted without starving the pool
+    template<class T>
+    T wait(std::future<T>& f) {
+        while(f.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            if(!run_pending_task())
+                f.wait_for(std::chrono::microseconds(100));
+        return f.get();
+    }
+};
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef VISIBILITY_BUFFER_H
+#define VISIBILITY_BUFFER_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "camera.h"
+#include "primitives.h"
+
+// the first triangle seen through every pixel, found by rasterizing the meshes instead of tracing rays
+// only valid for a pinhole camera (no aperture, no divergence) because then every primary ray
+// of a pixel goes through the same point
+// spheres are not rasterized, they are still tested with the primary ray
+
+const int VISIBILITY_TILE_SIZE = 32;
+// triangles are clipped at this camera depth so nothing behind the camera is projected
+const float VISIBILITY_NEAR = 1e-3f;
+
+struct VisibilityTexel {
+    // index into PrimitiveArrays::meshes, -1 if no triangle covers the pixel
+    int object = -1;
+    // index of the triangle in the mesh
+    int prim = -1;
+    // 1 / camera depth, larger is nearer, 0 is the background
+    float inv_depth = 0;
+};
+
+class VisibilityBuffer {
+private:
+    // a projected triangle ready to be rasterized
+    // edge i is a * x + b * y + c and is >= 0 inside the triangle
+    struct ScreenTriangle {
+        float a[3], b[3], c[3];
+        // 1 / depth as a plane over the screen
+        float zx, zy, z0;
+        int min_x, max_x, min_y, max_y;
+        int object, prim;
+    };
+
+    int width = 0, height = 0;
+    int tile_columns = 0, tile_rows = 0;
+    std::vector<VisibilityTexel> texels;
+    std::vector<ScreenTriangle> screen_tris;
+    // indices into screen_tris for every tile
+    std::vector<std::vector<int>> bins;
+
+    // what the buffer was built for
+    CameraState state;
+    std::vector<Mesh*> built_meshes;
+    // the triangles of mesh m are screen_tris[mesh_first[m]] .. screen_tris[mesh_first[m + 1] - 1]
+    std::vector<int> mesh_first;
+    bool valid = false;
+
+    // edges shared by two triangles are set up from the same ordered end points
+    // so a pixel on the edge gives exactly opposite values and is never missed by both
+    static void setup_edge(float px, float py, float qx, float qy, float& a, float& b, float& c) {
+        bool swapped = px > qx or (px == qx and py > qy);
+        if(swapped) {
+            std::swap(px, qx);
+            std::swap(py, qy);
+        }
+        a = py - qy;
+        b = qx - px;
+        c = -(a * px + b * py);
+        if(swapped) {
+            a = -a; b = -b; c = -c;
+        }
+    }
+
+    // project a triangle given in camera space (x right, y up, z depth) and store it
+    void add_screen_triangle(const Vec3* v, int object, int prim) {
+        float sx[3], sy[3], iz[3];
+        for(int i = 0; i < 3; i++) {
+            iz[i] = 1 / v[i].z;
+            state.to_screen(v[i], &sx[i], &sy[i]);
+        }
+
+        ScreenTriangle t;
+        // edge i is opposite to vertex i
+        setup_edge(sx[1], sy[1], sx[2], sy[2], t.a[0], t.b[0], t.c[0]);
+        setup_edge(sx[2], sy[2], sx[0], sy[0], t.a[1], t.b[1], t.c[1]);
+        setup_edge(sx[0], sy[0], sx[1], sy[1], t.a[2], t.b[2], t.c[2]);
+        float area = t.a[0] * sx[0] + t.b[0] * sy[0] + t.c[0];
+        if(area == 0) return;
+        // flip so the inside is positive whatever the winding on screen
+        if(area < 0) {
+            for(int i = 0; i < 3; i++) {
+                t.a[i] = -t.a[i]; t.b[i] = -t.b[i]; t.c[i] = -t.c[i];
+            }
+            area = -area;
+        }
+        t.zx = (t.a[0] * iz[0] + t.a[1] * iz[1] + t.a[2] * iz[2]) / area;
+        t.zy = (t.b[0] * iz[0] + t.b[1] * iz[1] + t.b[2] * iz[2]) / area;
+        t.z0 = (t.c[0] * iz[0] + t.c[1] * iz[1] + t.c[2] * iz[2]) / area;
+
+        t.min_x = std::max((int)ceilf(fminf(fminf(sx[0], sx[1]), sx[2])), 0);
+        t.max_x = std::min((int)floorf(fmaxf(fmaxf(sx[0], sx[1]), sx[2])), width - 1);
+        t.min_y = std::max((int)ceilf(fminf(fminf(sy[0], sy[1]), sy[2])), 0);
+        t.max_y = std::min((int)floorf(fmaxf(fmaxf(sy[0], sy[1]), sy[2])), height - 1);
+        if(t.min_x > t.max_x or t.min_y > t.max_y) return;
+
+        t.object = object;
+        t.prim = prim;
+        screen_tris.push_back(t);
+    }
+
+    // cull, clip against the near plane and project one triangle
+    void setup_triangle(const Triangle& tri, bool both_face, int object, int prim) {
+        // same rule as Ray::cast_to_triangle(), back faces are only hit by transparent meshes
+        Vec3 normal = (tri.vert[1] - tri.vert[0]).cross(tri.vert[2] - tri.vert[0]);
+        if(!both_face and (state.position - tri.vert[0]).dot(normal) <= 0) return;
+
+        Vec3 v[3] = {VEC3_ZERO, VEC3_ZERO, VEC3_ZERO};
+        int in_front = 0;
+        for(int i = 0; i < 3; i++) {
+            v[i] = state.to_camera_space(tri.vert[i]);
+            in_front += v[i].z >= VISIBILITY_NEAR;
+        }
+        if(in_front == 0) return;
+        if(in_front == 3) {
+            add_screen_triangle(v, object, prim);
+            return;
+        }
+
+        // clip the polygon against the near plane, a triangle becomes at most a quad
+        Vec3 poly[4] = {VEC3_ZERO, VEC3_ZERO, VEC3_ZERO, VEC3_ZERO};
+        int n = 0;
+        for(int i = 0; i < 3; i++) {
+            const Vec3& p = v[i];
+            const Vec3& q = v[(i + 1) % 3];
+            if(p.z >= VISIBILITY_NEAR) poly[n++] = p;
+            if((p.z >= VISIBILITY_NEAR) != (q.z >= VISIBILITY_NEAR)) {
+                // always go from the front end so the neighbour triangle gets the same point
+                const Vec3& front = p.z >= VISIBILITY_NEAR ? p : q;
+                const Vec3& back = p.z >= VISIBILITY_NEAR ? q : p;
+                float t = (VISIBILITY_NEAR - front.z) / (back.z - front.z);
+                poly[n++] = front + (back - front) * t;
+            }
+        }
+        Vec3 first[3] = {poly[0], poly[1], poly[2]};
+        add_screen_triangle(first, object, prim);
+        if(n == 4) {
+            Vec3 second[3] = {poly[0], poly[2], poly[3]};
+            add_screen_triangle(second, object, prim);
+        }
+    }
+
+    void rasterize_tile(int tile) {
+        int x0 = (tile % tile_columns) * VISIBILITY_TILE_SIZE;
+        int y0 = (tile / tile_columns) * VISIBILITY_TILE_SIZE;
+        int x1 = std::min(x0 + VISIBILITY_TILE_SIZE, width) - 1;
+        int y1 = std::min(y0 + VISIBILITY_TILE_SIZE, height) - 1;
+
+        for(int y = y0; y <= y1; y++)
+            for(int x = x0; x <= x1; x++)
+                texels[y * width + x] = VisibilityTexel();
+
+        for(int index: bins[tile]) {
+            const ScreenTriangle& t = screen_tris[index];
+            int from_x = std::max(t.min_x, x0), to_x = std::min(t.max_x, x1);
+            int from_y = std::max(t.min_y, y0), to_y = std::min(t.max_y, y1);
+
+            for(int y = from_y; y <= to_y; y++) {
+                VisibilityTexel* row = &texels[y * width];
+                // branchless so the compiler can do several pixels at once
+                for(int x = from_x; x <= to_x; x++) {
+                    float e0 = t.a[0] * x + t.b[0] * y + t.c[0];
+                    float e1 = t.a[1] * x + t.b[1] * y + t.c[1];
+                    float e2 = t.a[2] * x + t.b[2] * y + t.c[2];
+                    float inv_depth = t.zx * x + t.zy * y + t.z0;
+                    bool pass = (e0 >= 0) & (e1 >= 0) & (e2 >= 0) & (inv_depth > row[x].inv_depth);
+                    row[x].object = pass ? t.object : row[x].object;
+                    row[x].prim = pass ? t.prim : row[x].prim;
+                    row[x].inv_depth = pass ? inv_depth : row[x].inv_depth;
+                }
+            }
+        }
+    }
+    // project the triangles of mesh m of `prims` and append them to screen_tris
+    void setup_mesh(const PrimitiveArrays& prims, int m) {
+        Mesh* mesh = prims.meshes[m];
+        const Material& mat = mesh->get_material();
+        bool both_face = mat.transparent or mat.smoke;
+        for(int i = 0; i < (int)mesh->tris.size(); i++)
+            setup_triangle(mesh->tris[i], both_face, m, i);
+    }
+    // call `f` with the index of every tile triangle t touches
+    template<class F>
+    void for_tiles(const ScreenTriangle& t, F f) {
+        for(int ty = t.min_y / VISIBILITY_TILE_SIZE; ty <= t.max_y / VISIBILITY_TILE_SIZE; ty++)
+            for(int tx = t.min_x / VISIBILITY_TILE_SIZE; tx <= t.max_x / VISIBILITY_TILE_SIZE; tx++)
+                f(ty * tile_columns + tx);
+    }
+
+    // sort the triangles into the tiles with `redraw` set and rasterize those tiles
+    // the bins of the other tiles are left as they are and only read after they were sorted again
+    void rasterize(const std::vector<char>& redraw, int thread_count) {
+        bins.resize(tile_columns * tile_rows);
+        std::vector<int> tiles;
+        for(int tile = 0; tile < (int)bins.size(); tile++)
+            if(redraw[tile]) {
+                bins[tile].clear();
+                tiles.push_back(tile);
+            }
+        for(int i = 0; i < (int)screen_tris.size(); i++)
+            for_tiles(screen_tris[i], [&](int tile) {
+                if(redraw[tile]) bins[tile].push_back(i);
+            });
+
+        // tiles never share pixels so every thread takes whole tiles
+        std::atomic<int> next(0);
+        auto worker = [this, &next, &tiles]() {
+            for(int i = next++; i < (int)tiles.size(); i = next++)
+                rasterize_tile(tiles[i]);
+        };
+        std::vector<std::thread> threads;
+        for(int i = 1; i < thread_count; i++)
+            threads.push_back(std::thread(worker));
+        worker();
+        for(std::thread& t: threads) t.join();
+    }
+public:
+    // true if the buffer was built for this camera and these meshes
+    // meshes that moved or changed since are redrawn with update()
+    bool matches(Camera& camera, const PrimitiveArrays& prims) {
+        return valid and state == camera.state() and built_meshes == prims.meshes;
+    }
+    // forget the buffer, the next matches() is false
+    void invalidate() {
+        valid = false;
+    }
+
+    // rasterize every mesh of `prims` as seen from `camera`
+    void build(Camera& camera, const PrimitiveArrays& prims, int thread_count) {
+        width = camera.WIDTH;
+        height = camera.HEIGHT;
+        tile_columns = (width + VISIBILITY_TILE_SIZE - 1) / VISIBILITY_TILE_SIZE;
+        tile_rows = (height + VISIBILITY_TILE_SIZE - 1) / VISIBILITY_TILE_SIZE;
+        texels.resize(width * height);
+
+        state = camera.state();
+        built_meshes = prims.meshes;
+        valid = true;
+
+        screen_tris.clear();
+        mesh_first.assign(prims.meshes.size() + 1, 0);
+        for(int m = 0; m < (int)prims.meshes.size(); m++) {
+            mesh_first[m] = screen_tris.size();
+            setup_mesh(prims, m);
+        }
+        mesh_first.back() = screen_tris.size();
+
+        rasterize(std::vector<char>(tile_columns * tile_rows, 1), thread_count);
+    }
+
+    // redraw the meshes with `changed[m]` set (m indexes prims.meshes) after they moved or changed,
+    // for a buffer that matches() the camera and meshes. only their triangles are projected again,
+    // and only the tiles under where they were or are now are rasterized again
+    void update(const PrimitiveArrays& prims, const std::vector<char>& changed, int thread_count) {
+        std::vector<char> redraw(tile_columns * tile_rows, 0);
+        auto mark = [&redraw](int tile) { redraw[tile] = 1; };
+
+        std::vector<ScreenTriangle> old_tris;
+        old_tris.swap(screen_tris);
+        screen_tris.reserve(old_tris.size());
+        std::vector<int> old_first = mesh_first;
+        for(int m = 0; m < (int)prims.meshes.size(); m++) {
+            mesh_first[m] = screen_tris.size();
+            if(!changed[m]) {
+                screen_tris.insert(screen_tris.end(), old_tris.begin() + old_first[m], old_tris.begin() + old_first[m + 1]);
+                continue;
+            }
+            for(int i = old_first[m]; i < old_first[m + 1]; i++)
+                for_tiles(old_tris[i], mark);
+            setup_mesh(prims, m);
+            for(int i = mesh_first[m]; i < (int)screen_tris.size(); i++)
+                for_tiles(screen_tris[i], mark);
+        }
+        mesh_first.back() = screen_tris.size();
+
+        rasterize(redraw, thread_count);
+    }
+
+    const VisibilityTexel& at(int x, int y) {
+        return texels[y * width + x];
+    }
+};
+
+#endif